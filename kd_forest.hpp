@@ -0,0 +1,472 @@
+/******************************************************************************
+/* @file Contains a kd forest that partitions space into independent barn::concurrent_kd_tree shards.
+/*
+/* Points route to their shard by a prefix of their Morton code, so producer threads that insert into
+/* different regions do not contend on one writer lock:
+/*
+/*      barn::kd_forest_options forest;
+/*      forest.n_shards = 16;
+/*      barn::kd_forest<point_t, 3> points(initial.begin(), initial.end(), forest);
+/*
+/*      // any number of producer threads
+/*      points.insert(point);
+/*      points.insert(batch.begin(), batch.end(), barn::kd_batch_options{ 8 });
+/*
+/*      // any number of reader threads
+/*      auto neighbors = points.find_k_nearest(center, 8);
+/*
+/* Queries only visit the shards whose bounding box overlaps the query and merge their results.
+/* Once a shard outgrows the others by kd_forest_options::max_imbalance, the forest re-partitions
+/* the space from its current points.
+/*
+/* @author langenhagen
+/* @version 161017
+/******************************************************************************/
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+//INCLUDES C/C++ standard library (and other external libraries)
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <assert.h>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//INCLUDES project headers
+
+#include "kd_tree_concurrent.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// NAMESPACE, CONSTANTS and TYPE DECLARATIONS/IMPLEMENTATIONS
+
+
+namespace barn {
+
+    /** Parameters for partitioning a barn::kd_forest into shards.
+    */
+    struct kd_forest_options {
+        size_t n_shards = 8;                ///< number of independent trees the space is partitioned into
+        float max_imbalance = 1.5f;         ///< re-partition once a shard holds this many times as many points as the mean
+                                            ///< shard, or as the largest shard right after the last re-partitioning;
+                                            ///< 0 only re-partitions on rebalance()
+        size_t min_rebalance_size = 4096;   ///< forests with fewer points do not re-partition automatically
+        size_t max_readers = 64;            ///< number of queries that can read one shard at once, see concurrent_kd_tree
+    };
+
+
+    /** Implements a forest of kd-trees that partition the space between them, for insert rates one tree's writer lock
+    cannot absorb.
+    The space is divided into cells by the first bits of the points' Morton codes within the bounding box of the points
+    seen at the last re-partitioning; points outside that box fall into the nearest border cell. Runs of consecutive
+    cells along the Morton curve, i.e. compact regions, form the shards, each a barn::concurrent_kd_tree with its own
+    writer lock and lock-free snapshots. Writers to different shards never wait for each other.
+    Queries take a snapshot of every shard, skip the shards whose bounding box does not overlap the query and merge
+    the results, which are copies of the points.
+    Re-partitioning rebuilds all shards and blocks all other operations while it runs; modifications and queries
+    share a reader-writer lock with it.
+    */
+    template<
+        typename data_t /*data type*/,
+        size_t n_dims = 2 /*number of dimensions of the data type*/,
+        typename metric_t = kd_metric::l2 /*distance metric, see barn::kd_metric*/>
+    class kd_forest {
+    public: // inner typedefs
+        using shard_tree_t = concurrent_kd_tree<data_t, n_dims, metric_t>;
+        using coord_t = detail::kd_coord_t<data_t>;
+
+    private: // inner typedefs
+
+        /** One shard; a cache line of its own, so the size counters of different shards do not contend.
+        */
+        struct alignas(64) shard_t {
+            shard_tree_t tree;                  ///< the shard's points
+            std::atomic<size_t> size{ 0 };      ///< number of points in the tree
+
+            template< typename iter_t>
+            shard_t(const iter_t start, const iter_t end, const kd_build_options& options, const metric_t& metric,
+                    const size_t max_readers)
+                : tree(start, end, options, metric, max_readers), size(static_cast<size_t>(std::distance(start, end)))
+            {}
+        };
+
+        using box_t = detail::kd_box<coord_t, n_dims>;
+        using node_handle = typename shard_tree_t::storage_t::node_handle;
+        using neighbor_t = std::pair<coord_t /*reduced distance*/, const data_t*>;
+
+        static constexpr size_t cells_per_shard = 1024; ///< granularity of the partitioning
+        static constexpr size_t max_cell_bits = 20;     ///< at most 2^20 cells
+
+    private: // vars
+
+        std::vector<std::unique_ptr<shard_t>> shards_;  ///< the shards, replaced as a whole by re-partitioning
+        std::vector<std::uint32_t> cell_shard_;         ///< the shard of every cell, indexed by Morton prefix
+        box_t domain_;                                  ///< the box the cells divide
+        size_t cell_bits_ = 0;                          ///< length of the Morton prefixes
+        size_t levels_ = 0;                             ///< number of bits per axis the prefixes are taken from
+        std::atomic<size_t> size_{ 0 };                 ///< number of points in all shards
+        size_t rebalanced_largest_ = 0;                 ///< size of the largest shard after the last re-partitioning
+        mutable std::shared_mutex routing_mutex_;       ///< exclusive for re-partitioning, shared for everything else
+        kd_forest_options forest_options_;              ///< parameters for partitioning
+        kd_build_options options_;                      ///< parameters for building the shards
+        metric_t metric_;                               ///< the distance metric
+
+    public: // ctors & dtor
+
+        /** Creates an empty forest. All points go into the first shard until the first re-partitioning,
+        see kd_forest_options::min_rebalance_size.
+        */
+        explicit kd_forest(
+            const kd_forest_options& forest = kd_forest_options(),
+            const kd_build_options& options = kd_build_options(),
+            const metric_t& metric = metric_t())
+            : forest_options_(forest), options_(options), metric_(metric) {
+            assert(forest.n_shards > 0 && forest.n_shards <= std::numeric_limits<std::uint32_t>::max()
+                && "the number of shards must be positive and fit into 32 bits");
+
+            size_t cell_bits = 0;
+            while (cell_bits < max_cell_bits && (size_t(1) << cell_bits) < cells_per_shard * forest.n_shards)
+                ++cell_bits;
+            cell_bits_ = cell_bits;
+            levels_ = std::max(size_t(1), (cell_bits_ + n_dims - 1) / n_dims);
+            cell_shard_.assign(size_t(1) << cell_bits_, 0);
+
+            std::vector<data_t> none;
+            for (size_t s = 0; s < forest.n_shards; ++s)
+                shards_.emplace_back(new shard_t(none.begin(), none.end(), options_, metric_, forest_options_.max_readers));
+        }
+
+        /** Creates a forest from the given elements, partitioned by their bounding box.
+        */
+        template< typename iter_t>
+        kd_forest(
+            const iter_t start,
+            const iter_t end,
+            const kd_forest_options& forest = kd_forest_options(),
+            const kd_build_options& options = kd_build_options(),
+            const metric_t& metric = metric_t())
+            : kd_forest(forest, options, metric) {
+            std::vector<data_t> points(start, end);
+            partition(points);
+        }
+
+        kd_forest(const kd_forest&) = delete;
+        kd_forest& operator=(const kd_forest&) = delete;
+
+    public: // methods
+
+        /** Inserts the given data element into its shard.
+        Re-partitions the forest afterwards if that shard became too large, see kd_forest_options::max_imbalance.
+        */
+        void insert(const data_t& data) {
+            size_t shard_size = 0;
+            {
+                std::shared_lock<std::shared_mutex> lock(routing_mutex_);
+                shard_t& shard = *shards_[shard_of(data)];
+                shard.tree.insert(data);
+                shard_size = ++shard.size;
+                ++size_;
+            }
+            rebalance_if_needed(shard_size);
+        }
+
+        /** Inserts the given data elements, grouped by shard; up to options.n_threads shards take their points at once.
+        Re-partitions the forest afterwards if a shard became too large, see kd_forest_options::max_imbalance.
+        @param options Only n_threads is considered.
+        */
+        template< typename iter_t>
+        void insert(const iter_t first, const iter_t last, const kd_batch_options& options = kd_batch_options()) {
+            const size_t n = static_cast<size_t>(std::distance(first, last));
+            size_t largest = 0;
+            {
+                std::shared_lock<std::shared_mutex> lock(routing_mutex_);
+                std::vector<std::uint32_t> shard_of_point(n);
+                std::vector<size_t> offsets(shards_.size() + 1, 0);
+                for (size_t i = 0; i < n; ++i) {
+                    shard_of_point[i] = shard_of(first[i]);
+                    ++offsets[shard_of_point[i] + 1];
+                }
+                std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+                std::vector<size_t> order(n);
+                std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+                for (size_t i = 0; i < n; ++i)
+                    order[next[shard_of_point[i]]++] = i;
+
+                detail::parallel_for(shards_.size(), options.n_threads, [&](const size_t s, size_t) {
+                    for (size_t j = offsets[s]; j < offsets[s + 1]; ++j)
+                        shards_[s]->tree.insert(first[order[j]]);
+                    shards_[s]->size += offsets[s + 1] - offsets[s];
+                });
+                size_ += n;
+                for (const auto& shard : shards_)
+                    largest = std::max(largest, shard->size.load());
+            }
+            rebalance_if_needed(largest);
+        }
+
+        /** Erases one data element with the same coordinates as the given one from its shard.
+        @return Returns whether such an element was found.
+        */
+        bool erase(const data_t& data) {
+            std::shared_lock<std::shared_mutex> lock(routing_mutex_);
+            shard_t& shard = *shards_[shard_of(data)];
+            if (!shard.tree.erase(data))
+                return false;
+            --shard.size;
+            --size_;
+            return true;
+        }
+
+        /** Calls the given visitor with every data element that lies in the circle given by the center and radius parameters.
+        The visitor runs on the calling thread and must not modify the forest.
+        @param f Callable with the signature void(const data_t&).
+        */
+        template< typename visitor_t>
+        void for_each_in_range(const data_t& center, const coord_t radius, visitor_t&& f) const {
+            const coord_t reduced_radius = metric_.to_reduced(radius);
+            std::shared_lock<std::shared_mutex> lock(routing_mutex_);
+            for (const auto& shard : shards_) {
+                const auto snapshot = shard->tree.snapshot();
+                if (overlaps(*snapshot, center, reduced_radius))
+                    snapshot->for_each_in_range(center, radius, [&f](const data_t& data) { f(data); });
+            }
+        }
+
+        /** Retrieves copies of all data elements that lie in the circle given by the center and radius parameters.
+        */
+        std::vector<data_t> find_points_within_range(const data_t& center, const coord_t radius) const {
+            std::vector<data_t> ret;
+            for_each_in_range(center, radius, [&ret](const data_t& data) { ret.push_back(data); });
+            return ret;
+        }
+
+        /** Counts the data elements that lie in the circle given by the center and radius parameters.
+        */
+        size_t count_in_range(const data_t& center, const coord_t radius) const {
+            const coord_t reduced_radius = metric_.to_reduced(radius);
+            size_t ret = 0;
+            std::shared_lock<std::shared_mutex> lock(routing_mutex_);
+            for (const auto& shard : shards_) {
+                const auto snapshot = shard->tree.snapshot();
+                if (overlaps(*snapshot, center, reduced_radius))
+                    ret += snapshot->count_in_range(center, radius);
+            }
+            return ret;
+        }
+
+        /** Retrieves copies of the k data elements closest to the given center, sorted by ascending distance.
+        Visits the shards closest bounding box first and stops at the first shard farther away than the current
+        k-th neighbor. Fewer elements are returned if the forest holds less than k elements.
+        */
+        std::vector<data_t> find_k_nearest(const data_t& center, const size_t k) const {
+            std::vector<data_t> ret;
+            if (k == 0)
+                return ret;
+
+            std::shared_lock<std::shared_mutex> lock(routing_mutex_);
+            std::vector<typename shard_tree_t::snapshot_t> snapshots;
+            std::vector<std::pair<coord_t /*reduced distance*/, size_t /*snapshot*/>> order;
+            snapshots.reserve(shards_.size());
+            for (const auto& shard : shards_) {
+                snapshots.push_back(shard->tree.snapshot());
+                const auto& storage = snapshots.back()->storage();
+                if (!storage.is_null(storage.root()))
+                    order.emplace_back(storage.bounds(storage.root()).min_distance(metric_, center), snapshots.size() - 1);
+            }
+            std::sort(order.begin(), order.end());
+
+            const auto farther = [](const neighbor_t& a, const neighbor_t& b) { return a.first < b.first; };
+            std::vector<neighbor_t> heap;
+            for (const auto& shard : order) {
+                if (heap.size() == k && shard.first > heap.front().first)
+                    break;
+                for (const data_t* p : snapshots[shard.second]->find_k_nearest(center, k)) {
+                    const coord_t distance = detail::kd_distance<n_dims, coord_t>(metric_, *p, center);
+                    if (heap.size() == k) {
+                        if (!(distance < heap.front().first))
+                            break; // the shard's neighbors come sorted
+                        std::pop_heap(heap.begin(), heap.end(), farther);
+                        heap.pop_back();
+                    }
+                    heap.emplace_back(distance, p);
+                    std::push_heap(heap.begin(), heap.end(), farther);
+                }
+            }
+            std::sort_heap(heap.begin(), heap.end(), farther);
+
+            ret.reserve(heap.size());
+            for (const auto& n : heap)
+                ret.push_back(*n.second);
+            return ret;
+        }
+
+        /** Re-partitions the space from the bounding box and distribution of the current points and rebuilds all shards.
+        Blocks all other operations on the forest while it runs.
+        */
+        void rebalance() {
+            std::unique_lock<std::shared_mutex> lock(routing_mutex_);
+            repartition();
+        }
+
+        /** Returns the number of data elements in the forest.
+        */
+        inline size_t size() const noexcept {
+            return size_.load();
+        }
+
+        /** Returns the number of data elements in each shard.
+        */
+        std::vector<size_t> shard_sizes() const {
+            std::shared_lock<std::shared_mutex> lock(routing_mutex_);
+            std::vector<size_t> ret;
+            for (const auto& shard : shards_)
+                ret.push_back(shard->size.load());
+            return ret;
+        }
+
+        /** Returns the forest's distance metric.
+        */
+        inline const metric_t& metric() const noexcept {
+            return metric_;
+        }
+
+    private: // helpers
+
+        /** Returns the cell of the given point, i.e. the first cell_bits_ bits of its Morton code within domain_.
+        */
+        size_t cell_of(const data_t& p) const {
+            constexpr size_t n_code_dims = n_dims < max_cell_bits ? n_dims : max_cell_bits;
+            const std::uint64_t n_steps = std::uint64_t(1) << levels_;
+
+            std::array<std::uint64_t, n_code_dims> cell;
+            for (size_t d = 0; d < n_code_dims; ++d) {
+                const double extent = double(domain_.hi[d]) - double(domain_.lo[d]);
+                const double t = extent > 0 ? (double(p[d]) - double(domain_.lo[d])) / extent : 0.;
+                cell[d] = t > 0. ? std::min(std::uint64_t(t * n_steps), n_steps - 1) : 0;
+            }
+
+            size_t code = 0;
+            size_t n_bits = 0;
+            for (size_t b = levels_; b-- > 0 && n_bits < cell_bits_;)
+                for (size_t d = 0; d < n_code_dims && n_bits < cell_bits_; ++d, ++n_bits)
+                    code = (code << 1) | ((cell[d] >> b) & 1);
+            return code;
+        }
+
+        /** Returns the index of the shard the given point belongs to.
+        */
+        inline std::uint32_t shard_of(const data_t& p) const {
+            return cell_shard_[cell_of(p)];
+        }
+
+        /** Tells whether the given shard version holds points and its bounding box overlaps the given circle.
+        */
+        inline bool overlaps(const typename shard_tree_t::tree_t& tree, const data_t& center, const coord_t reduced_radius) const {
+            const auto& storage = tree.storage();
+            return !storage.is_null(storage.root())
+                && !(storage.bounds(storage.root()).min_distance(metric_, center) > reduced_radius);
+        }
+
+        /** Tells whether a shard of the given size is too large for a forest of the given size.
+        */
+        inline bool imbalanced(const size_t shard_size, const size_t total) const {
+            const double limit = double(forest_options_.max_imbalance)
+                * std::max(double(total) / shards_.size(), double(rebalanced_largest_));
+            return forest_options_.max_imbalance > 0.f && shards_.size() > 1
+                && total >= forest_options_.min_rebalance_size && shard_size > limit;
+        }
+
+        /** Re-partitions the forest if a shard of the given size makes it imbalanced.
+        */
+        void rebalance_if_needed(const size_t shard_size) {
+            if (!imbalanced(shard_size, size_.load()))
+                return;
+
+            std::unique_lock<std::shared_mutex> lock(routing_mutex_);
+            // another writer may have re-partitioned the forest in the meantime
+            size_t largest = 0;
+            for (const auto& shard : shards_)
+                largest = std::max(largest, shard->size.load());
+            if (imbalanced(largest, size_.load()))
+                repartition();
+        }
+
+        /** Collects the points of all shards and partitions them anew. Requires the exclusive lock.
+        */
+        void repartition() {
+            std::vector<data_t> points;
+            points.reserve(size_.load());
+            for (const auto& shard : shards_) {
+                const auto snapshot = shard->tree.snapshot();
+                const auto& storage = snapshot->storage();
+                detail::kd_stack<node_handle> stack;
+                if (!storage.is_null(storage.root()))
+                    stack.push(storage.root());
+                while (!stack.empty()) {
+                    const node_handle n = stack.pop();
+                    if (!storage.is_erased(n, 0))
+                        points.push_back(storage.point(n, 0));
+                    for (const node_handle child : { storage.left(n), storage.right(n) })
+                        if (!storage.is_null(child))
+                            stack.push(child);
+                }
+            }
+            partition(points);
+        }
+
+        /** Sets the domain to the bounding box of the given points, assigns runs of cells with about equally many
+        points to the shards and rebuilds the shards from the points. Requires the exclusive lock or an unshared forest.
+        CAUTION: Reorders the given points.
+        */
+        void partition(std::vector<data_t>& points) {
+            const size_t n_shards = forest_options_.n_shards;
+            domain_ = box_t();
+            for (const data_t& p : points)
+                domain_.extend(p);
+
+            std::vector<std::uint32_t> cells(points.size());
+            std::vector<size_t> counts(cell_shard_.size(), 0);
+            for (size_t i = 0; i < points.size(); ++i) {
+                cells[i] = static_cast<std::uint32_t>(cell_of(points[i]));
+                ++counts[cells[i]];
+            }
+
+            // a cell goes to the shard its middle point would go to if the points were split evenly along the curve
+            size_t preceding = 0;
+            for (size_t c = 0; c < cell_shard_.size(); ++c) {
+                const size_t middle = preceding + counts[c] / 2;
+                cell_shard_[c] = static_cast<std::uint32_t>(points.empty() ? 0 : std::min(n_shards - 1, middle * n_shards / points.size()));
+                preceding += counts[c];
+            }
+
+            std::vector<size_t> offsets(n_shards + 1, 0);
+            for (const std::uint32_t c : cells)
+                ++offsets[cell_shard_[c] + 1];
+            std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+            std::vector<data_t> grouped(points.size());
+            std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+            for (size_t i = 0; i < points.size(); ++i)
+                grouped[next[cell_shard_[cells[i]]]++] = std::move(points[i]);
+
+            rebalanced_largest_ = 0;
+            for (size_t s = 0; s < n_shards; ++s) {
+                shards_[s].reset();
+                shards_[s].reset(new shard_t(grouped.begin() + offsets[s], grouped.begin() + offsets[s + 1],
+                                             options_, metric_, forest_options_.max_readers));
+                rebalanced_largest_ = std::max(rebalanced_largest_, offsets[s + 1] - offsets[s]);
+            }
+            size_ = points.size();
+        }
+    };
+
+} // END namespace barn
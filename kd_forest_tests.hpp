@@ -0,0 +1,133 @@
+/******************************************************************************
+/* @file Test routines for barn::kd_forest.
+/*
+/* @author langenhagen
+/* @version 161017
+/*****************************************************************************/
+#pragma once
+
+
+#include <algorithm>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include "kd_forest.hpp"
+#include "kd_tree_tests.hpp"
+#include "barn_test/FunctionTest.hpp"
+
+using namespace std;
+using namespace unittest;
+
+
+/// Counts the radius and 10-nearest-neighbor queries of the given forest around 20 random centers whose results differ
+/// from a linear scan over points, and whether its shard sizes don't add up to its size.
+template< typename forest_t>
+size_t kd_forest_query_mismatches(const forest_t& forest, const vector<kd_tree_tests::point_t<3>>& points) {
+    using namespace kd_tree_tests;
+    size_t ret = forest.size() != points.size();
+    const auto shard_sizes = forest.shard_sizes();
+    ret += accumulate(shard_sizes.begin(), shard_sizes.end(), size_t(0)) != points.size();
+    for (const auto& c : random_points<3>(20, 7)) {
+        const auto expected = scan_range<3>(points, c, 0.15f, forest.metric());
+        auto found = forest.find_points_within_range(c, 0.15f);
+        sort(found.begin(), found.end());
+        ret += (found != expected) + (forest.count_in_range(c, 0.15f) != expected.size());
+
+        vector<float> distances;
+        for (const auto& p : forest.find_k_nearest(c, 10))
+            distances.push_back(reduced_distance<3>(forest.metric(), p, c));
+        ret += !is_sorted(distances.begin(), distances.end());
+        ret += !same_distances(distances, scan_k_nearest<3>(points, c, 10, forest.metric()));
+    }
+    return ret;
+}
+
+/// Fills a forest with the given number of shards from n random points: half by construction, a quarter by single
+/// inserts from as many threads and a quarter by a batch insert. Compares it with a linear scan after that, after
+/// erasing every fifth point and after rebalance().
+size_t kd_forest_mismatches(const size_t n_points, const size_t n_shards, const size_t n_threads) {
+    using namespace kd_tree_tests;
+    using forest_t = barn::kd_forest<point_t<3>, 3>;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_forest_options forest_options;
+    forest_options.n_shards = n_shards;
+    forest_options.min_rebalance_size = 256;
+    barn::kd_build_options options;
+    options.balance = 0.7f;
+    forest_t forest(points.begin(), points.begin() + n_points / 2, forest_options, options);
+
+    vector<thread> threads;
+    for (size_t t = 0; t < n_threads; ++t)
+        threads.emplace_back([&, t]() {
+            for (size_t i = n_points / 2 + t; i < n_points * 3 / 4; i += n_threads)
+                forest.insert(points[i]);
+        });
+    for (auto& t : threads)
+        t.join();
+    barn::kd_batch_options batch;
+    batch.n_threads = n_threads;
+    forest.insert(points.begin() + n_points * 3 / 4, points.end(), batch);
+    size_t ret = kd_forest_query_mismatches(forest, points);
+
+    vector<point_t<3>> live;
+    for (size_t i = 0; i < n_points; ++i) {
+        if (i % 5 == 0)
+            ret += !forest.erase(points[i]);
+        else
+            live.push_back(points[i]);
+    }
+    ret += forest.erase(point_t<3>{ { 2.f, 2.f, 2.f } });
+    ret += kd_forest_query_mismatches(forest, live);
+
+    forest.rebalance();
+    return ret + kd_forest_query_mismatches(forest, live);
+}
+
+/// Inserts n points sorted along the first axis into a forest with the given number of shards, which moves all inserts
+/// into one shard after another, and checks that re-partitioning keeps every shard below max_imbalance times the mean.
+size_t kd_forest_imbalance_violations(const size_t n_points, const size_t n_shards) {
+    using namespace kd_tree_tests;
+    auto points = random_points<3>(n_points, 1);
+    sort(points.begin(), points.end());
+    barn::kd_forest_options forest_options;
+    forest_options.n_shards = n_shards;
+    forest_options.min_rebalance_size = 256;
+    barn::kd_forest<point_t<3>, 3> forest(forest_options);
+    for (const auto& p : points)
+        forest.insert(p);
+    const auto shard_sizes = forest.shard_sizes();
+    const float mean = float(n_points) / n_shards;
+    return kd_forest_query_mismatches(forest, points)
+        + (*max_element(shard_sizes.begin(), shard_sizes.end()) > forest_options.max_imbalance * mean + 1);
+}
+
+
+/// Calls the testing routine
+void kd_forest_test_all() {
+
+    auto& os = std::cout;
+    auto all_passed = true;
+    os << "\n";
+
+    os << "Test kd_forest queries" << std::endl;
+    FunctionTest<size_t, size_t, size_t, size_t> forest_test(kd_forest_mismatches);
+    forest_test.verbosity_level = verbosity::NORMAL;
+    forest_test.test("empty", size_t(0), size_t(0), size_t(4), size_t(1));
+    forest_test.test("1 shard", size_t(0), size_t(4000), size_t(1), size_t(1));
+    forest_test.test("8 shards", size_t(0), size_t(4000), size_t(8), size_t(1));
+    forest_test.test("8 shards, 4 threads", size_t(0), size_t(4000), size_t(8), size_t(4));
+    all_passed &= forest_test.write_test_series_summary();
+
+    os << "Test kd_forest re-partitioning" << std::endl;
+    FunctionTest<size_t, size_t, size_t> imbalance_test(kd_forest_imbalance_violations);
+    imbalance_test.verbosity_level = verbosity::NORMAL;
+    imbalance_test.test("4 shards, sorted inserts", size_t(0), size_t(4000), size_t(4));
+    imbalance_test.test("8 shards, sorted inserts", size_t(0), size_t(4000), size_t(8));
+    all_passed &= imbalance_test.write_test_series_summary();
+
+    os << "\n";
+    if (all_passed) os << "+++ ALL TEST SERIES PASSED +++ :)))";
+    else            os << "--- SOME ERRORS OCCURED ---    :(((";
+    os << "\n\n\n";
+}
@@ -1,7 +1,7 @@
 /******************************************************************************
 /* @file Contains the kd tree class.
 /*
-/* TODO review and unit test
+/* TODO review
 /* TODO doxy-doc
 /*
 /* @author langenhagen
@@ -12,278 +12,3925 @@
 ///////////////////////////////////////////////////////////////////////////////
 //INCLUDES C/C++ standard library (and other external libraries)
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <assert.h>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <ostream>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#if defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+
+// Define BARN_KD_TREE_STATS before including this header to record per-query counters, see barn::kd_query_stats.
+// Without it, the queries carry no instrumentation at all.
+#if defined(BARN_KD_TREE_STATS)
+    #define BARN_KD_STATS(...) __VA_ARGS__
+#else
+    #define BARN_KD_STATS(...)
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // NAMESPACE, CONSTANTS and TYPE DECLARATIONS/IMPLEMENTATIONS
 
 
-namespace barn {
+namespace barn {
+
+    /// Implementation details, clients never use these directly.
+    namespace detail {
+
+        /// The scalar type of a single coordinate of data_t.
+        template< typename data_t>
+        using kd_coord_t = typename std::remove_cv<
+            typename std::remove_reference<decltype(std::declval<const data_t&>()[0])>::type>::type;
+
+        /** Partially sorts the given range so that middle holds the median with respect to the given axis.
+        */
+        template< typename data_t, typename iter_t>
+        inline void kd_partition(const iter_t start, const iter_t middle, const iter_t end, const size_t axis) {
+            std::nth_element(
+                start,
+                middle,
+                end,
+                [&axis](const data_t& i, const data_t& j) { return i[axis] < j[axis]; });
+        }
+
+        /** Tells whether the given points have equal coordinates on all axes.
+        */
+        template< size_t n_dims, typename data_t>
+        inline bool kd_equal_coordinates(const data_t& a, const data_t& b) {
+            for (size_t d = 0; d < n_dims; ++d)
+                if (!(a[d] == b[d]))
+                    return false;
+            return true;
+        }
+
+        template< size_t n_dims, typename data_t>
+        inline auto kd_same_element(const data_t& a, const data_t& b, int) -> decltype(bool(a == b)) {
+            return a == b;
+        }
+
+        template< size_t n_dims, typename data_t>
+        inline bool kd_same_element(const data_t& a, const data_t& b, long) {
+            return std::is_trivially_copyable<data_t>::value
+                ? std::memcmp(&a, &b, sizeof(data_t)) == 0
+                : kd_equal_coordinates<n_dims>(a, b);
+        }
+
+        /** Tells whether the given elements are equal as a whole, payload included: by operator== if data_t has one,
+        else bytewise if it is trivially copyable, else only by their coordinates.
+        */
+        template< size_t n_dims, typename data_t>
+        inline bool kd_same_element(const data_t& a, const data_t& b) {
+            return kd_same_element<n_dims>(a, b, 0);
+        }
+
+        /// Largest number of dimensions for which the per-point loops over the axes are unrolled at compile time.
+        constexpr size_t kd_max_unrolled_dims = 8;
+
+        /** The per-point loops over the axes [axis, n_dims) of the distance computations, unrolled at compile time
+        by recursing on the axis, so that every coordinate access and metric call sees a constant axis.
+        */
+        template< size_t axis, size_t n_dims>
+        struct kd_unrolled_axes {
+            /// Folds the coordinate differences between a and b into the reduced distance acc.
+            template< typename coord_t, typename metric_t, typename a_t, typename b_t>
+            static inline coord_t distance(const metric_t& metric, const coord_t acc, const a_t& a, const b_t& b) {
+                return kd_unrolled_axes<axis + 1, n_dims>::distance(
+                    metric, metric.accumulate(acc, coord_t(a[axis] - b[axis]), axis), a, b);
+            }
+
+            /// Folds the distances between p and the box [lo, hi] into the reduced distance acc.
+            template< typename coord_t, typename metric_t, typename point_t>
+            static inline coord_t min_distance(
+                const metric_t& metric, const coord_t acc, const std::array<coord_t, n_dims>& lo, const std::array<coord_t, n_dims>& hi, const point_t& p) {
+                const coord_t diff = std::max(std::max(coord_t(lo[axis] - p[axis]), coord_t(p[axis] - hi[axis])), coord_t(0));
+                return kd_unrolled_axes<axis + 1, n_dims>::min_distance(metric, metric.accumulate(acc, diff, axis), lo, hi, p);
+            }
+
+            /// Folds the distances between p and the farthest corner of the box [lo, hi] into the reduced distance acc.
+            template< typename coord_t, typename metric_t, typename point_t>
+            static inline coord_t max_distance(
+                const metric_t& metric, const coord_t acc, const std::array<coord_t, n_dims>& lo, const std::array<coord_t, n_dims>& hi, const point_t& p) {
+                const coord_t diff = std::max(coord_t(p[axis] - lo[axis]), coord_t(hi[axis] - p[axis]));
+                return kd_unrolled_axes<axis + 1, n_dims>::max_distance(metric, metric.accumulate(acc, diff, axis), lo, hi, p);
+            }
+        };
+
+        template< size_t n_dims>
+        struct kd_unrolled_axes<n_dims, n_dims> {
+            template< typename coord_t, typename metric_t, typename a_t, typename b_t>
+            static inline coord_t distance(const metric_t&, const coord_t acc, const a_t&, const b_t&) { return acc; }
+
+            template< typename coord_t, typename metric_t, typename point_t>
+            static inline coord_t min_distance(
+                const metric_t&, const coord_t acc, const std::array<coord_t, n_dims>&, const std::array<coord_t, n_dims>&, const point_t&) { return acc; }
+
+            template< typename coord_t, typename metric_t, typename point_t>
+            static inline coord_t max_distance(
+                const metric_t&, const coord_t acc, const std::array<coord_t, n_dims>&, const std::array<coord_t, n_dims>&, const point_t&) { return acc; }
+        };
+
+        /** The per-point loops over the axes of the distance computations as plain loops,
+        for more dimensions than kd_max_unrolled_dims, where unrolling only bloats the code.
+        */
+        template< size_t n_dims>
+        struct kd_looped_axes {
+            template< typename coord_t, typename metric_t, typename a_t, typename b_t>
+            static inline coord_t distance(const metric_t& metric, coord_t acc, const a_t& a, const b_t& b) {
+                for (size_t d = 0; d < n_dims; ++d)
+                    acc = metric.accumulate(acc, coord_t(a[d] - b[d]), d);
+                return acc;
+            }
+
+            template< typename coord_t, typename metric_t, typename point_t>
+            static inline coord_t min_distance(
+                const metric_t& metric, coord_t acc, const std::array<coord_t, n_dims>& lo, const std::array<coord_t, n_dims>& hi, const point_t& p) {
+                for (size_t d = 0; d < n_dims; ++d)
+                    acc = metric.accumulate(acc, std::max(std::max(coord_t(lo[d] - p[d]), coord_t(p[d] - hi[d])), coord_t(0)), d);
+                return acc;
+            }
+
+            template< typename coord_t, typename metric_t, typename point_t>
+            static inline coord_t max_distance(
+                const metric_t& metric, coord_t acc, const std::array<coord_t, n_dims>& lo, const std::array<coord_t, n_dims>& hi, const point_t& p) {
+                for (size_t d = 0; d < n_dims; ++d)
+                    acc = metric.accumulate(acc, std::max(coord_t(p[d] - lo[d]), coord_t(hi[d] - p[d])), d);
+                return acc;
+            }
+        };
+
+        /// The distance computations' loops over the axes of n_dims-dimensional points.
+        template< size_t n_dims>
+        using kd_axes = typename std::conditional<
+            n_dims <= kd_max_unrolled_dims, kd_unrolled_axes<0, n_dims>, kd_looped_axes<n_dims>>::type;
+
+        /** Tells whether data_t holds its n_dims coordinates as a plain array of coord_t, e.g. std::array<float, 3>,
+        so that the coordinates of a stored point can be read in place, in one cache line, bit-identical to the
+        structure-of-arrays copies the flat layout keeps for its vectorized bucket scans.
+        */
+        template< typename data_t, typename coord_t, size_t n_dims>
+        struct kd_is_coord_array : std::false_type {};
+
+        template< typename coord_t, size_t n_dims>
+        struct kd_is_coord_array<std::array<coord_t, n_dims>, coord_t, n_dims> : std::true_type {};
+
+        /** Returns the reduced distance between the given points under the given metric.
+        */
+        template< size_t n_dims, typename coord_t, typename metric_t, typename a_t, typename b_t>
+        inline coord_t kd_distance(const metric_t& metric, const a_t& a, const b_t& b) {
+            return kd_axes<n_dims>::distance(metric, coord_t(0), a, b);
+        }
+
+        /** An axis-aligned bounding box, empty until the first point is added.
+        */
+        template< typename coord_t, size_t n_dims>
+        struct kd_box {
+            std::array<coord_t, n_dims> lo;     ///< the minimum corner
+            std::array<coord_t, n_dims> hi;     ///< the maximum corner
+
+            kd_box() noexcept {
+                lo.fill(std::numeric_limits<coord_t>::max());
+                hi.fill(std::numeric_limits<coord_t>::lowest());
+            }
+
+            /// Creates the box spanned by the given minimum and maximum corners.
+            template< typename point_t>
+            kd_box(const point_t& min_corner, const point_t& max_corner) {
+                for (size_t d = 0; d < n_dims; ++d) {
+                    lo[d] = min_corner[d];
+                    hi[d] = max_corner[d];
+                }
+            }
+
+            /// Grows the box to contain the given point.
+            template< typename point_t>
+            inline void extend(const point_t& p) {
+                for (size_t d = 0; d < n_dims; ++d) {
+                    lo[d] = std::min(lo[d], coord_t(p[d]));
+                    hi[d] = std::max(hi[d], coord_t(p[d]));
+                }
+            }
+
+            /// Grows the box to contain the given box.
+            inline void extend(const kd_box& b) {
+                for (size_t d = 0; d < n_dims; ++d) {
+                    lo[d] = std::min(lo[d], b.lo[d]);
+                    hi[d] = std::max(hi[d], b.hi[d]);
+                }
+            }
+
+            /// Tells whether the given point lies within the box, boundary included.
+            template< typename point_t>
+            inline bool contains(const point_t& p) const {
+                for (size_t d = 0; d < n_dims; ++d)
+                    if (p[d] < lo[d] || p[d] > hi[d])
+                        return false;
+                return true;
+            }
+
+            /// Tells whether the given box lies within this box.
+            inline bool contains(const kd_box& b) const {
+                for (size_t d = 0; d < n_dims; ++d)
+                    if (b.lo[d] < lo[d] || b.hi[d] > hi[d])
+                        return false;
+                return true;
+            }
+
+            /// Tells whether the given box and this box share at least one point.
+            inline bool intersects(const kd_box& b) const {
+                for (size_t d = 0; d < n_dims; ++d)
+                    if (b.hi[d] < lo[d] || b.lo[d] > hi[d])
+                        return false;
+                return true;
+            }
+
+            /// Returns the reduced distance between the given point and the closest point of the box.
+            template< typename metric_t, typename point_t>
+            inline coord_t min_distance(const metric_t& metric, const point_t& p) const {
+                return kd_axes<n_dims>::min_distance(metric, coord_t(0), lo, hi, p);
+            }
+
+            /// Returns the reduced distance between the given point and the farthest point of the box.
+            template< typename metric_t, typename point_t>
+            inline coord_t max_distance(const metric_t& metric, const point_t& p) const {
+                return kd_axes<n_dims>::max_distance(metric, coord_t(0), lo, hi, p);
+            }
+
+            /// Returns the reduced distance between the closest points of the given box and this box.
+            template< typename metric_t>
+            inline coord_t min_distance(const metric_t& metric, const kd_box& b) const {
+                coord_t ret(0);
+                for (size_t d = 0; d < n_dims; ++d) {
+                    const coord_t diff = std::max(std::max(coord_t(lo[d] - b.hi[d]), coord_t(b.lo[d] - hi[d])), coord_t(0));
+                    ret = metric.accumulate(ret, diff, d);
+                }
+                return ret;
+            }
+
+            /// Returns the reduced distance between the farthest points of the given box and this box.
+            template< typename metric_t>
+            inline coord_t max_distance(const metric_t& metric, const kd_box& b) const {
+                coord_t ret(0);
+                for (size_t d = 0; d < n_dims; ++d) {
+                    const coord_t diff = std::max(coord_t(hi[d] - b.lo[d]), coord_t(b.hi[d] - lo[d]));
+                    ret = metric.accumulate(ret, diff, d);
+                }
+                return ret;
+            }
+        };
+
+        /** A LIFO stack for iterative tree traversals.
+        Keeps the first inline_capacity elements in place and only touches the heap for deeper trees.
+        */
+        template< typename T, size_t inline_capacity = 64>
+        class kd_stack {
+        private: // vars
+            std::array<T, inline_capacity> inline_;     ///< the first inline_capacity elements
+            std::vector<T> overflow_;                   ///< the elements beyond inline_capacity
+            size_t size_ = 0;                           ///< number of elements
+
+        public: // methods
+
+            inline bool empty() const noexcept { return size_ == 0; }
+            inline size_t size() const noexcept { return size_; }
+
+            inline void push(const T& e) {
+                if (size_ < inline_capacity)
+                    inline_[size_] = e;
+                else
+                    overflow_.push_back(e);
+                ++size_;
+            }
+
+            inline T pop() {
+                assert(size_ > 0 && "cannot pop from an empty stack");
+                --size_;
+                if (size_ < inline_capacity)
+                    return inline_[size_];
+                T ret = overflow_.back();
+                overflow_.pop_back();
+                return ret;
+            }
+        };
+
+        /** Runs f(task, thread) for every task in [0, n_tasks) on up to n_threads threads, including the calling one.
+        Tasks are handed out dynamically in ascending order; thread is a dense index in [0, n_threads).
+        */
+        template< typename func_t>
+        void parallel_for(const size_t n_tasks, size_t n_threads, func_t&& f) {
+            n_threads = std::max(size_t(1), std::min(n_threads, n_tasks));
+
+            std::atomic<size_t> next_task(0);
+            auto work = [&](const size_t thread) {
+                for (size_t task = next_task++; task < n_tasks; task = next_task++)
+                    f(task, thread);
+            };
+
+            std::vector<std::future<void>> workers;
+            for (size_t t = 1; t < n_threads; ++t)
+                workers.push_back(std::async(std::launch::async, work, t));
+            work(0);
+            for (auto& w : workers)
+                w.get();
+        }
+
+        /** Returns the permutation that sorts the given points along a Morton (z-order) curve
+        over their bounding box, so that consecutive points tend to be spatially close.
+        */
+        template< typename data_t, size_t n_dims, typename iter_t>
+        std::vector<size_t> morton_order(const iter_t first, const size_t n) {
+            using coord_t = kd_coord_t<data_t>;
+            constexpr size_t n_code_dims = n_dims < 64 ? n_dims : 64;
+            constexpr size_t bits = 64 / n_code_dims > 16 ? 16 : 64 / n_code_dims;
+
+            std::array<coord_t, n_code_dims> lo, hi;
+            lo.fill(std::numeric_limits<coord_t>::max());
+            hi.fill(std::numeric_limits<coord_t>::lowest());
+            for (size_t i = 0; i < n; ++i)
+                for (size_t d = 0; d < n_code_dims; ++d) {
+                    lo[d] = std::min(lo[d], coord_t(first[i][d]));
+                    hi[d] = std::max(hi[d], coord_t(first[i][d]));
+                }
+
+            std::vector<std::pair<std::uint64_t, size_t>> codes(n);
+            for (size_t i = 0; i < n; ++i) {
+                std::array<std::uint64_t, n_code_dims> cell;
+                for (size_t d = 0; d < n_code_dims; ++d) {
+                    const double extent = double(hi[d]) - double(lo[d]);
+                    const double t = extent > 0 ? (double(first[i][d]) - double(lo[d])) / extent : 0.;
+                    cell[d] = std::min(std::uint64_t(t * (1 << bits)), std::uint64_t((1 << bits) - 1));
+                }
+
+                std::uint64_t code = 0;
+                for (size_t b = bits; b-- > 0;)
+                    for (size_t d = 0; d < n_code_dims; ++d)
+                        code = (code << 1) | ((cell[d] >> b) & 1);
+                codes[i] = { code, i };
+            }
+            std::sort(codes.begin(), codes.end());
+
+            std::vector<size_t> ret(n);
+            for (size_t i = 0; i < n; ++i)
+                ret[i] = codes[i].second;
+            return ret;
+        }
+
+        /** Maps coordinates to unsigned integer keys of the same order, if there is such a mapping.
+        */
+        template< typename coord_t, typename enable_t = void>
+        struct kd_radix_key {
+            static constexpr bool enabled = false;
+        };
+
+        template< typename coord_t>
+        struct kd_radix_key<coord_t, typename std::enable_if<std::is_integral<coord_t>::value && !std::is_same<coord_t, bool>::value>::type> {
+            using key_t = typename std::make_unsigned<coord_t>::type;
+            static constexpr bool enabled = true;
+
+            static inline key_t get(const coord_t c) noexcept {
+                // flipping the sign bit moves the negative values below the positive ones
+                return static_cast<key_t>(c) ^ (std::is_signed<coord_t>::value ? key_t(key_t(1) << (sizeof(key_t) * 8 - 1)) : key_t(0));
+            }
+        };
+
+        template< typename coord_t>
+        struct kd_radix_key<coord_t, typename std::enable_if<std::is_floating_point<coord_t>::value && std::numeric_limits<coord_t>::is_iec559
+                                                             && (sizeof(coord_t) == 4 || sizeof(coord_t) == 8)>::type> {
+            using key_t = typename std::conditional<sizeof(coord_t) == 4, std::uint32_t, std::uint64_t>::type;
+            static constexpr bool enabled = true;
+
+            static inline key_t get(const coord_t c) noexcept {
+                // negative values order reversed by magnitude, all below the positive ones
+                constexpr key_t sign = key_t(1) << (sizeof(key_t) * 8 - 1);
+                key_t ret;
+                std::memcpy(&ret, &c, sizeof(ret));
+                return ret & sign ? ~ret : ret | sign;
+            }
+        };
+
+        /** Stably sorts the given elements by their member coord with an LSD radix sort.
+        */
+        template< typename entry_t>
+        void kd_sort_by_coord(std::vector<entry_t>& entries, std::true_type) {
+            using radix_key = kd_radix_key<decltype(entries[0].coord)>;
+            constexpr size_t digit_bits = 11, n_digits = size_t(1) << digit_bits;
+            constexpr size_t n_passes = (sizeof(typename radix_key::key_t) * 8 + digit_bits - 1) / digit_bits;
+
+            std::vector<std::array<size_t, n_digits>> counts(n_passes);
+            for (auto& c : counts)
+                c.fill(0);
+            for (const entry_t& e : entries) {
+                const auto key = radix_key::get(e.coord);
+                for (size_t pass = 0; pass < n_passes; ++pass)
+                    ++counts[pass][(key >> (pass * digit_bits)) & (n_digits - 1)];
+            }
+
+            std::vector<entry_t> scratch(entries.size());
+            for (size_t pass = 0; pass < n_passes; ++pass) {
+                std::array<size_t, n_digits>& next = counts[pass];
+                if (std::find(next.begin(), next.end(), entries.size()) != next.end())
+                    continue; // all keys share this digit
+                size_t sum = 0;
+                for (size_t& c : next) {
+                    const size_t count = c;
+                    c = sum;
+                    sum += count;
+                }
+                for (const entry_t& e : entries)
+                    scratch[next[(radix_key::get(e.coord) >> (pass * digit_bits)) & (n_digits - 1)]++] = e;
+                entries.swap(scratch);
+            }
+        }
+
+        /** Sorts the given elements with their operator<.
+        */
+        template< typename entry_t>
+        inline void kd_sort_by_coord(std::vector<entry_t>& entries, std::false_type) {
+            std::sort(entries.begin(), entries.end());
+        }
+
+    } // END namespace detail
+
+
+    /** Distance metrics for barn::kd_tree.
+    All comparisons happen in a metric's reduced space, e.g. squared distances for L2, so that no root
+    is taken in the hot loop. A metric provides:
+        - to_reduced(r) / from_reduced(d): converts between real and reduced distances
+        - accumulate(acc, diff, axis): folds one coordinate difference into a reduced distance
+        - axis_distance(diff, axis): the reduced distance to a splitting plane at distance diff on the given axis;
+          must never exceed the reduced distance of any point on the far side of the plane
+    */
+    namespace kd_metric {
+
+        /** Euclidean distance, compared as squared euclidean distance. Default.
+        */
+        struct l2 {
+            template< typename coord_t> inline coord_t to_reduced(const coord_t r) const { return r * r; }
+            template< typename coord_t> inline coord_t from_reduced(const coord_t d) const { return std::sqrt(d); }
+            template< typename coord_t> inline coord_t accumulate(const coord_t acc, const coord_t diff, size_t) const { return acc + diff * diff; }
+            template< typename coord_t> inline coord_t axis_distance(const coord_t diff, size_t) const { return diff * diff; }
+        };
+
+        /** Manhattan distance.
+        */
+        struct l1 {
+            template< typename coord_t> inline coord_t to_reduced(const coord_t r) const { return r; }
+            template< typename coord_t> inline coord_t from_reduced(const coord_t d) const { return d; }
+            template< typename coord_t> inline coord_t accumulate(const coord_t acc, const coord_t diff, size_t) const { return acc + std::abs(diff); }
+            template< typename coord_t> inline coord_t axis_distance(const coord_t diff, size_t) const { return std::abs(diff); }
+        };
+
+        /** Chebyshev distance, i.e. the maximum coordinate difference.
+        */
+        struct linf {
+            template< typename coord_t> inline coord_t to_reduced(const coord_t r) const { return r; }
+            template< typename coord_t> inline coord_t from_reduced(const coord_t d) const { return d; }
+            template< typename coord_t> inline coord_t accumulate(const coord_t acc, const coord_t diff, size_t) const { return std::max(acc, coord_t(std::abs(diff))); }
+            template< typename coord_t> inline coord_t axis_distance(const coord_t diff, size_t) const { return std::abs(diff); }
+        };
+
+        /** Euclidean distance with a non-negative weight per axis, compared squared.
+        */
+        template< typename weight_t, size_t n_dims>
+        struct weighted_l2 {
+            std::array<weight_t, n_dims> weights;   ///< the per-axis weights
+
+            weighted_l2() noexcept { weights.fill(weight_t(1)); }
+            weighted_l2(const std::array<weight_t, n_dims>& w) : weights(w) {
+                assert(std::all_of(w.begin(), w.end(), [](const weight_t x) { return x >= 0; }) && "weights must not be negative");
+            }
+
+            template< typename coord_t> inline coord_t to_reduced(const coord_t r) const { return r * r; }
+            template< typename coord_t> inline coord_t from_reduced(const coord_t d) const { return std::sqrt(d); }
+            template< typename coord_t> inline coord_t accumulate(const coord_t acc, const coord_t diff, const size_t axis) const { return acc + weights[axis] * diff * diff; }
+            template< typename coord_t> inline coord_t axis_distance(const coord_t diff, const size_t axis) const { return weights[axis] * diff * diff; }
+        };
+
+    } // END namespace kd_metric
+
+
+    /// Largest supported number of points per leaf bucket.
+    constexpr size_t kd_max_bucket_size = 256;
+
+
+    /** Policies for choosing the splitting axis and position of a kd-tree node while building, see
+    kd_build_options::split. Every node stores its axis, so the policies can be mixed freely with inserts.
+    */
+    enum class kd_split {
+        round_robin,        ///< cycle through the axes, split at the median. Default
+        widest_spread,      ///< split the axis along which the points spread the most at the median
+        sliding_midpoint,   ///< split the axis of widest spread at the middle of the points' extent, moved onto the
+                            ///< nearest point; yields well-shaped cells for clustered or anisotropic data
+        cost_model          ///< choose the split on any axis that minimizes the children's number of points times
+                            ///< their bounding boxes' margins, i.e. the surface area heuristic with the sum of the
+                            ///< extents instead of the surface area, which stays meaningful for flat data
+    };
+
+
+    /// Implementation details, clients never use these directly.
+    namespace detail {
+
+        /** Computes the reduced distances between a center and a bucket of points given structure-of-arrays.
+        The generic version loops axis by axis over the bucket, which compilers vectorize for simple metrics.
+        */
+        template< typename metric_t, typename coord_t, size_t n_dims>
+        struct kd_bucket_kernel {
+            template< typename data_t>
+            static inline void distances(
+                const metric_t& metric,
+                const std::array<const coord_t*, n_dims>& coords,
+                const size_t count,
+                const data_t& center,
+                coord_t* out) {
+
+                std::fill_n(out, count, coord_t(0));
+                for (size_t d = 0; d < n_dims; ++d) {
+                    const coord_t c = center[d];
+                    const coord_t* x = coords[d];
+                    for (size_t i = 0; i < count; ++i)
+                        out[i] = metric.accumulate(out[i], coord_t(x[i] - c), d);
+                }
+            }
+        };
+
+#if defined(__SSE2__)
+        /** Squared euclidean distances of a bucket of floats, 8 (AVX) or 4 (SSE) points per instruction.
+        Adds the axes in the same order as the scalar code, so results are bit-identical to it.
+        */
+        template< size_t n_dims>
+        struct kd_bucket_kernel<kd_metric::l2, float, n_dims> {
+            template< typename data_t>
+            static inline void distances(
+                const kd_metric::l2&,
+                const std::array<const float*, n_dims>& coords,
+                const size_t count,
+                const data_t& center,
+                float* out) {
+
+                size_t i = 0;
+#if defined(__AVX__)
+                for (; i + 8 <= count; i += 8) {
+                    __m256 acc = _mm256_setzero_ps();
+                    for (size_t d = 0; d < n_dims; ++d) {
+                        const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(coords[d] + i), _mm256_set1_ps(center[d]));
+                        acc = _mm256_add_ps(acc, _mm256_mul_ps(diff, diff));
+                    }
+                    _mm256_storeu_ps(out + i, acc);
+                }
+#endif
+                for (; i + 4 <= count; i += 4) {
+                    __m128 acc = _mm_setzero_ps();
+                    for (size_t d = 0; d < n_dims; ++d) {
+                        const __m128 diff = _mm_sub_ps(_mm_loadu_ps(coords[d] + i), _mm_set1_ps(center[d]));
+                        acc = _mm_add_ps(acc, _mm_mul_ps(diff, diff));
+                    }
+                    _mm_storeu_ps(out + i, acc);
+                }
+                for (; i < count; ++i) {
+                    float acc = 0.f;
+                    for (size_t d = 0; d < n_dims; ++d)
+                        acc += (coords[d][i] - center[d]) * (coords[d][i] - center[d]);
+                    out[i] = acc;
+                }
+            }
+        };
+
+        /** Squared euclidean distances of a bucket of doubles, 4 (AVX) or 2 (SSE) points per instruction.
+        Adds the axes in the same order as the scalar code, so results are bit-identical to it.
+        */
+        template< size_t n_dims>
+        struct kd_bucket_kernel<kd_metric::l2, double, n_dims> {
+            template< typename data_t>
+            static inline void distances(
+                const kd_metric::l2&,
+                const std::array<const double*, n_dims>& coords,
+                const size_t count,
+                const data_t& center,
+                double* out) {
+
+                size_t i = 0;
+#if defined(__AVX__)
+                for (; i + 4 <= count; i += 4) {
+                    __m256d acc = _mm256_setzero_pd();
+                    for (size_t d = 0; d < n_dims; ++d) {
+                        const __m256d diff = _mm256_sub_pd(_mm256_loadu_pd(coords[d] + i), _mm256_set1_pd(center[d]));
+                        acc = _mm256_add_pd(acc, _mm256_mul_pd(diff, diff));
+                    }
+                    _mm256_storeu_pd(out + i, acc);
+                }
+#endif
+                for (; i + 2 <= count; i += 2) {
+                    __m128d acc = _mm_setzero_pd();
+                    for (size_t d = 0; d < n_dims; ++d) {
+                        const __m128d diff = _mm_sub_pd(_mm_loadu_pd(coords[d] + i), _mm_set1_pd(center[d]));
+                        acc = _mm_add_pd(acc, _mm_mul_pd(diff, diff));
+                    }
+                    _mm_storeu_pd(out + i, acc);
+                }
+                for (; i < count; ++i) {
+                    double acc = 0.;
+                    for (size_t d = 0; d < n_dims; ++d)
+                        acc += (coords[d][i] - center[d]) * (coords[d][i] - center[d]);
+                    out[i] = acc;
+                }
+            }
+        };
+#endif
+
+        /** Computes lower bounds of the reduced distances between a center and a bucket of points whose coordinates are
+        quantized, given structure-of-arrays as multiples of a step per axis above the corner of the points' box.
+        Every coordinate difference is reduced by its axis' tolerance and then shrunk by the given factor, before it is
+        accumulated. Loops axis by axis over the bucket like kd_bucket_kernel.
+        @param center The center relative to the corner of the box.
+        */
+        template< typename metric_t, typename coord_t, size_t n_dims>
+        struct kd_quantized_kernel {
+            static inline void lower_bounds(
+                const metric_t& metric,
+                const std::array<const std::uint16_t*, n_dims>& quantized,
+                const size_t count,
+                const std::array<coord_t, n_dims>& center,
+                const std::array<coord_t, n_dims>& step,
+                const std::array<coord_t, n_dims>& tolerance,
+                const coord_t shrink,
+                coord_t* out) {
+
+                std::fill_n(out, count, coord_t(0));
+                for (size_t d = 0; d < n_dims; ++d) {
+                    const std::uint16_t* q = quantized[d];
+                    for (size_t i = 0; i < count; ++i) {
+                        const coord_t diff = (std::abs(coord_t(center[d] - coord_t(q[i]) * step[d])) - tolerance[d]) * shrink;
+                        out[i] = metric.accumulate(out[i], std::max(coord_t(0), diff), d);
+                    }
+                }
+            }
+        };
+
+        /** The coordinates of one point stored structure-of-arrays, indexable like a point.
+        */
+        template< typename coord_t, size_t n_dims>
+        struct kd_coords_ref {
+            const std::array<std::vector<coord_t>, n_dims>* coords; ///< one coordinate array per axis
+            size_t i;                                               ///< the point's index in the arrays
+
+            inline coord_t operator[](const size_t axis) const { return (*coords)[axis][i]; }
+        };
+
+        /** Chooses the cut of the given points on one axis among evenly spaced candidates
+        that minimizes the cost of kd_split::cost_model.
+        @param point_of Maps the range's elements to the points.
+        @param cost Updated with the cost of the chosen cut if it is lower.
+        @return Returns whether a cheaper cut was found, then written to value.
+        */
+        template< size_t n_dims, typename iter_t, typename point_of_t, typename coord_t>
+        bool kd_cheapest_cut(
+            const iter_t start,
+            const iter_t end,
+            const point_of_t& point_of,
+            const kd_box<coord_t, n_dims>& bounds,
+            const size_t axis,
+            double& cost,
+            coord_t& value) {
+
+            constexpr size_t n_bins = 16;
+            const double lo = double(bounds.lo[axis]);
+            const double extent = double(bounds.hi[axis]) - lo;
+            if (!(extent > 0))
+                return false;
+
+            std::array<size_t, n_bins> counts = {};
+            std::array<kd_box<coord_t, n_dims>, n_bins> boxes;
+            for (iter_t it = start; it != end; ++it) {
+                const auto p = point_of(*it);
+                const size_t bin = std::min(size_t((double(p[axis]) - lo) / extent * n_bins), n_bins - 1);
+                ++counts[bin];
+                boxes[bin].extend(p);
+            }
+
+            const auto margin = [](const kd_box<coord_t, n_dims>& b) {
+                double ret = 0.;
+                for (size_t d = 0; d < n_dims; ++d)
+                    ret += double(b.hi[d]) - double(b.lo[d]);
+                return ret;
+            };
+
+            // right_boxes[b] bounds the bins from b on
+            std::array<kd_box<coord_t, n_dims>, n_bins> right_boxes;
+            right_boxes[n_bins - 1] = boxes[n_bins - 1];
+            for (size_t b = n_bins - 1; b-- > 0;) {
+                right_boxes[b] = right_boxes[b + 1];
+                right_boxes[b].extend(boxes[b]);
+            }
+
+            const size_t n = static_cast<size_t>(std::distance(start, end));
+            bool found = false;
+            kd_box<coord_t, n_dims> left_box;
+            size_t n_left = 0;
+            for (size_t b = 1; b < n_bins; ++b) {
+                left_box.extend(boxes[b - 1]);
+                n_left += counts[b - 1];
+                if (n_left == 0 || n_left == n)
+                    continue;
+                const double c = n_left * margin(left_box) + (n - n_left) * margin(right_boxes[b]);
+                if (c < cost) {
+                    cost = c;
+                    value = coord_t(lo + extent * b / n_bins);
+                    found = true;
+                }
+            }
+            return found;
+        }
+
+        /** Chooses the splitting axis of a node holding the points in [start, end) with the given policy and
+        partitions the points around the node's point.
+        @param axis The axis the node has under kd_split::round_robin; set to the chosen axis.
+        @return Returns the node's point: the points before it are not greater on the chosen axis,
+        the points after it not smaller.
+        */
+        template< typename data_t, size_t n_dims, typename iter_t>
+        iter_t kd_split_range(const iter_t start, const iter_t end, size_t& axis, const kd_split split) {
+            using coord_t = kd_coord_t<data_t>;
+            const auto less_on_axis = [&axis](const data_t& i, const data_t& j) { return i[axis] < j[axis]; };
+            const auto n_points = std::distance(start, end);
+            iter_t middle = std::next(start, n_points / 2);
+            if (split == kd_split::round_robin || n_points < 2) {
+                kd_partition<data_t>(start, middle, end, axis);
+                return middle;
+            }
+
+            kd_box<coord_t, n_dims> bounds;
+            for (iter_t it = start; it != end; ++it)
+                bounds.extend(*it);
+            for (size_t d = 0; d < n_dims; ++d)
+                if (bounds.hi[d] - bounds.lo[d] > bounds.hi[axis] - bounds.lo[axis])
+                    axis = d;
+
+            coord_t value = bounds.lo[axis] + (bounds.hi[axis] - bounds.lo[axis]) / 2;
+            if (split == kd_split::cost_model) {
+                double cost = std::numeric_limits<double>::max();
+                for (size_t d = 0; d < n_dims; ++d) {
+                    coord_t cut;
+                    if (kd_cheapest_cut(start, end, [](const data_t& p) -> const data_t& { return p; }, bounds, d, cost, cut)) {
+                        axis = d;
+                        value = cut;
+                    }
+                }
+            }
+
+            if (split == kd_split::widest_spread || !(bounds.lo[axis] < bounds.hi[axis])) {
+                kd_partition<data_t>(start, middle, end, axis);
+                return middle;
+            }
+
+            // the node's point is the lowest one at or above the plane, or the highest if all lie below
+            middle = std::partition(start, end, [&](const data_t& p) { return p[axis] < value; });
+            if (middle == end) {
+                middle = std::prev(end);
+                std::iter_swap(std::max_element(start, end, less_on_axis), middle);
+            }
+            else
+                std::iter_swap(std::min_element(middle, end, less_on_axis), middle);
+            return middle;
+        }
+
+    } // END namespace detail
+
+
+    /** Parameters for batched queries on a barn::kd_tree.
+    */
+    struct kd_batch_options {
+        size_t n_threads = 1;           ///< maximum number of threads answering queries concurrently
+        size_t grain_size = 256;        ///< number of consecutive queries a thread takes at once
+        bool spatial_order = true;      ///< answer queries in Morton order so consecutive queries touch the same nodes
+    };
+
+
+    /** Parameters trading accuracy for speed in nearest-neighbor queries on a barn::kd_tree.
+    The defaults search exactly. In high dimensions an exact search visits most of the tree, approximate
+    searches visit the nodes best bin first, i.e. closest bounding box first, and stop early.
+    */
+    struct kd_search_options {
+        float epsilon = 0.f;            ///< accepted relative error: the i-th result is at most 1 + epsilon times as far away
+                                        ///< as the true i-th nearest neighbor; 0 is exact
+        size_t max_leaves = 0;          ///< maximum number of nodes holding points, i.e. leaf buckets in bucketed trees, whose
+                                        ///< points are checked, once k results are found; 0 is unlimited. Voids the epsilon bound
+
+        /// Tells whether these options ask for an exact search.
+        inline bool exact() const noexcept { return epsilon <= 0.f && max_leaves == 0; }
+    };
+
+
+    /** Results of a batched query in compressed sparse row layout.
+    The results of query i are neighbors[offsets[i]] ... neighbors[offsets[i + 1] - 1].
+    */
+    template< typename data_t>
+    struct kd_batch_result {
+        std::vector<size_t> offsets;    ///< per query the index of its first result, plus the total number of results
+        std::vector<data_t*> neighbors; ///< the results of all queries, grouped by query
+        std::vector<data_t*> queries;   ///< the query of each group if the queries are the elements of a tree, see
+                                        ///< kd_tree::k_nearest_join(); empty otherwise
+
+        /// Returns the number of queries.
+        inline size_t size() const noexcept { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+        /// Returns the number of results of the given query.
+        inline size_t count(const size_t query) const { return offsets[query + 1] - offsets[query]; }
+
+        /// Returns the first result of the given query.
+        inline data_t* const* begin(const size_t query) const { return neighbors.data() + offsets[query]; }
+
+        /// Returns the end of the results of the given query.
+        inline data_t* const* end(const size_t query) const { return neighbors.data() + offsets[query + 1]; }
+    };
+
+
+    /** Counters of one query on a barn::kd_tree, to tell an unbalanced tree, a too large radius and failing pruning apart.
+    Only recorded if BARN_KD_TREE_STATS is defined before including this header; otherwise they stay 0.
+    */
+    struct kd_query_stats {
+        size_t nodes_visited = 0;           ///< nodes whose points were checked, or whose subtree was counted or collected as a whole
+        size_t subtrees_pruned = 0;         ///< subtrees skipped because their bounding box or splitting plane is out of reach
+        size_t distance_evaluations = 0;    ///< distances between the query and points computed; containment tests for box queries
+        size_t max_stack_depth = 0;         ///< largest number of nodes pending on the traversal stack, or recursion depth, at once
+    };
+
+    /** Writes the given query counters as one JSON object.
+    */
+    inline std::ostream& to_json(std::ostream& os, const kd_query_stats& stats) {
+        return os << "{\"nodes_visited\":" << stats.nodes_visited
+            << ",\"subtrees_pruned\":" << stats.subtrees_pruned
+            << ",\"distance_evaluations\":" << stats.distance_evaluations
+            << ",\"max_stack_depth\":" << stats.max_stack_depth << "}";
+    }
+
+
+    /** The shape of a barn::kd_tree, see kd_tree::stats().
+    */
+    struct kd_tree_stats {
+        size_t size = 0;                    ///< number of data elements
+        size_t erased = 0;                  ///< number of erased data elements still stored until the next compaction
+        size_t nodes = 0;                   ///< number of nodes
+        size_t depth = 0;                   ///< number of nodes on the longest path from the root to a leaf
+        float balance = 0.f;                ///< largest share of a subtree's elements held by one child, over all subtrees of at
+                                            ///< least 16 elements; about 0.5 for a freshly built tree, at most
+                                            ///< kd_build_options::balance for a balanced one
+        size_t bytes = 0;                   ///< bytes the nodes and points occupy on the heap
+        std::vector<size_t> depth_histogram; ///< per depth the number of leaves; index d counts the leaves at depth d + 1
+    };
+
+    /** Writes the given tree statistics as one JSON object.
+    */
+    inline std::ostream& to_json(std::ostream& os, const kd_tree_stats& stats) {
+        os << "{\"size\":" << stats.size
+            << ",\"erased\":" << stats.erased
+            << ",\"nodes\":" << stats.nodes
+            << ",\"depth\":" << stats.depth
+            << ",\"balance\":" << stats.balance
+            << ",\"bytes\":" << stats.bytes
+            << ",\"depth_histogram\":[";
+        for (size_t d = 0; d < stats.depth_histogram.size(); ++d)
+            os << (d > 0 ? "," : "") << stats.depth_histogram[d];
+        return os << "]}";
+    }
+
+
+    namespace detail {
+
+        /// Returns the counters of the calling thread's current or last query.
+        inline kd_query_stats& kd_thread_query_stats() noexcept {
+            static thread_local kd_query_stats stats;
+            return stats;
+        }
+
+        /// Resets the calling thread's query counters at the start of a query and returns them.
+        inline kd_query_stats& kd_begin_query_stats() noexcept {
+            kd_query_stats& ret = kd_thread_query_stats();
+            ret = kd_query_stats();
+            return ret;
+        }
+
+        /** Counts one level of a recursive query towards the calling thread's max_stack_depth while in scope.
+        */
+        class kd_recursion_stats {
+        private: // helpers
+            static size_t& depth() noexcept {
+                static thread_local size_t ret = 0;
+                return ret;
+            }
+
+        public: // ctors & dtor
+            kd_recursion_stats() noexcept {
+                kd_query_stats& stats = kd_thread_query_stats();
+                stats.max_stack_depth = std::max(stats.max_stack_depth, ++depth());
+            }
+            ~kd_recursion_stats() { --depth(); }
+            kd_recursion_stats(const kd_recursion_stats&) = delete;
+            kd_recursion_stats& operator=(const kd_recursion_stats&) = delete;
+        };
+
+    } // END namespace detail
+
+
+    /** Parameters for the bulk construction of a barn::kd_tree.
+    */
+    struct kd_build_options {
+        size_t n_threads = 1;           ///< maximum number of threads building subtrees concurrently; 1 builds sequentially
+        size_t grain_size = 1 << 16;    ///< partitions with fewer points are never split off into a separate task
+        size_t bucket_size = 1;         ///< maximum number of points per leaf, at most kd_max_bucket_size; only kd_layout::flat has buckets
+        float balance = 0.f;            ///< largest share of a subtree's points one child may hold before insert() rebuilds the subtree,
+                                        ///< in (0.5, 1); 0 never rebalances
+        float max_erased = 0.5f;        ///< largest share of erased points before erase() compacts the tree; 0 never compacts
+                                        ///< automatically. Trees with at least grain_size points are compacted in the background
+        size_t max_refit_rebuild = 0;   ///< largest subtree refit() rebuilds to move a point across one of the subtree's splitting
+                                        ///< planes; points crossing planes higher up are erased and reinserted instead. Rebuilding
+                                        ///< keeps the subtrees tighter but costs more per point; 0 always reinserts
+        kd_split split = kd_split::round_robin; ///< how bulk construction and rebuilds choose the nodes' splitting planes
+        bool presort = false;           ///< whether kd_layout::flat sorts the coordinates once per axis and moves every point only
+                                        ///< once, instead of selecting among the points on every level. Faster for points much
+                                        ///< larger than their coordinates and for few dimensions, but needs more scratch memory
+        bool quantize = false;          ///< whether kd_layout::flat keeps the coordinates of its bucket points as 16 bit fixed point
+                                        ///< within their node's bounding box instead of full copies. Queries prune by them and take
+                                        ///< exact distances from the points, so results stay the same. Floating point coordinates
+                                        ///< and metrics that grow with every coordinate difference only, like all of kd_metric.
+                                        ///< Not a compressed tree: the points, nodes and bounding boxes stay full size, since
+                                        ///< queries return pointers to the points, and only the coordinate copies go from 4 to 2
+                                        ///< bytes per float. With 1M 3D float points that is 31 instead of 37 bytes per point
+                                        ///< with buckets of 16, and 61 instead of 73 without, about 16% less, while radius
+                                        ///< queries take about twice as long with buckets, see kd_tree_benchmark.cpp.
+                                        ///< Only worth it when memory is tighter than query time
+
+        /** Tells whether the subtrees of a partition at the given depth are built concurrently.
+        Every fork adds one thread, so forking stops once the number of tasks would exceed n_threads.
+        */
+        inline bool fork(const size_t depth, const size_t n_points) const noexcept {
+            return n_points >= grain_size && depth < 8 * sizeof(size_t) - 1 && (size_t(2) << depth) <= n_threads;
+        }
+
+        /** Tells whether a subtree whose larger child holds the given number of its points must be rebuilt.
+        Keeping every subtree balanced like this bounds the tree depth by log(n) / log(1 / balance).
+        */
+        inline bool unbalanced(const size_t child_size, const size_t subtree_size) const noexcept {
+            return balance > 0.f && child_size > balance * subtree_size;
+        }
+    };
+
+
+    /** Stores kd-tree nodes as separate heap objects, linked via shared pointers.
+    Convenient for dynamic trees, but each node is a separate allocation.
+    */
+    template< typename data_t, size_t n_dims>
+    class kd_linked_storage {
+    public: // inner typedefs
+        struct node_t;
+        using node_ptr = std::shared_ptr<node_t>;
+        using node_handle = node_t*;
+        using element_t = data_t;   ///< the type of the points queries hand out
+        using coord_t = detail::kd_coord_t<data_t>;
+        using box_t = detail::kd_box<coord_t, n_dims>;
+
+    public: // inner classes
+
+        /** Represents nodes in the kd-tree.
+        */
+        struct node_t {
+            data_t data;                ///< data field
+            bool erased = false;        ///< tombstone; erased nodes stay in the tree until it is compacted
+            std::uint8_t axis = 0;      ///< the splitting axis
+            node_t* parent = nullptr;   ///< parent; not owning, so parents and children form no reference cycles
+            node_ptr left = nullptr;    ///< left child
+            node_ptr right = nullptr;   ///< right child
+            size_t size = 1;            ///< number of points in the subtree that are not erased
+            box_t bounds;               ///< bounding box of the subtree's points, including erased ones
+        };
+
+        /** Read-only forward iterator over the points that are not erased, in depth-first pre-order.
+        Climbs back up via the nodes' parent links, so it needs neither recursion nor a stack, and holds a raw node pointer,
+        so stepping causes no refcount traffic. Steps over subtrees whose points are all erased.
+        Yields points, not nodes. They cannot be written through it, since that would leave the bounding boxes stale;
+        points are moved with refit().
+        TODO make bidirectional
+        */
+        class const_iterator {
+
+        public: // inner typedefs
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = data_t;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const data_t*;
+            using reference = const data_t&;
+
+        private: // vars
+            const node_t* curr_ = nullptr;  ///< the node of the current point, nullptr at the end
+
+        public: // operations
+
+            // ctors
+            const_iterator() noexcept {}
+            explicit const_iterator(const node_t* root) noexcept : curr_(has_points(root) ? root : nullptr) {
+                if (curr_ != nullptr && curr_->erased)
+                    advance();
+            }
+
+            // increment operations
+            inline const_iterator& operator++() noexcept { advance(); return *this; } // prefix++
+            inline const_iterator  operator++(int) noexcept { const_iterator tmp(*this); advance(); return tmp; } // postfix++
+
+            // equality / inequality operations
+            inline bool operator==(const const_iterator& other) const noexcept { return curr_ == other.curr_; }
+            inline bool operator!=(const const_iterator& other) const noexcept { return curr_ != other.curr_; }
+
+            // dereference operations
+            inline reference operator*() const noexcept { return curr_->data; }
+            inline pointer operator->() const noexcept { return &curr_->data; }
+
+        private: // helpers
+
+            /** Moves the iterator to the next node in pre-order that holds a point that is not erased.
+            */
+            inline void advance() noexcept {
+                do {
+                    curr_ = next_node(curr_);
+                } while (curr_ != nullptr && curr_->erased);
+            }
+        };
+
+        /// Points are read-only, see const_iterator.
+        using iterator = const_iterator;
+
+    private: // vars
+
+        node_ptr root_ = nullptr;       ///< the root node
+        kd_build_options options_;      ///< parameters for building and rebalancing
+        size_t n_erased_ = 0;           ///< number of erased nodes still in the tree
+
+    public: // methods
+
+        /** Creates a balanced hierarchy from the given elements.
+        CAUTION: Reorders the given range.
+        */
+        template< typename iter_t>
+        inline void build(const iter_t start, const iter_t end, const kd_build_options& options = kd_build_options()) {
+            options_ = options;
+            n_erased_ = 0;
+            root_ = create_kd_node_hierarchy(start, end, 0, options);
+        }
+
+        /** Sets the parameters for later inserts without touching the tree.
+        */
+        inline void set_options(const kd_build_options& options) {
+            options_ = options;
+        }
+
+        /** Returns the parameters for building and rebalancing.
+        */
+        inline const kd_build_options& options() const noexcept {
+            return options_;
+        }
+
+        /** Marks one point with the given coordinates for which match(point) holds as erased.
+        @return Returns whether such a point was found.
+        */
+        template< typename match_t>
+        inline bool erase(const data_t& data, const match_t& match) {
+            if (!do_erase(root_.get(), data, match))
+                return false;
+            ++n_erased_;
+            return true;
+        }
+
+        /** Moves points to new values, keeping the tree's topology where possible.
+        A point that stays on its side of every splitting plane above it and, as its node's point defines the node's
+        splitting plane, between the node's children, is moved in place, and the bounding boxes on its path are refit.
+        Otherwise the smallest subtree on its path whose cell holds the new value is rebuilt if it holds at most
+        kd_build_options::max_refit_rebuild points, once for all points moved into it; larger ones get the point erased
+        and its new value appended to reinserts for the caller to insert.
+        @param first, last Pairs of a point of the tree and its new value.
+        @param moved Called with the old and the new value of every point found before it is moved.
+        @return Returns the number of points found.
+        */
+        template< typename iter_t, typename moved_t>
+        size_t refit(const iter_t first, const iter_t last, std::vector<data_t>& reinserts, moved_t&& moved) {
+            size_t ret = 0;
+            std::vector<node_t*> path;
+            std::vector<std::vector<node_t*>> rebuilds; // the paths to the subtrees to rebuild
+            for (iter_t it = first; it != last; ++it) {
+                const data_t* element = it->first;
+                const data_t to(it->second);
+                path.clear();
+                if (!find_path(root_.get(), element, path) || path.back()->erased)
+                    continue;
+                ++ret;
+                moved(*element, to);
+
+                node_t* n = path.back();
+                const size_t cell = cell_of(path, to);
+                if (cell == path.size()) {
+                    n->data = to;
+                    for (size_t i = path.size(); i-- > 0;)
+                        refit_bounds(path[i]);
+                }
+                else if (path[cell]->size <= options_.max_refit_rebuild) {
+                    n->data = to;
+                    for (node_t* p : path)
+                        p->bounds.extend(to);
+                    rebuilds.emplace_back(path.begin(), path.begin() + cell + 1);
+                }
+                else {
+                    n->erased = true;
+                    ++n_erased_;
+                    for (node_t* p : path)
+                        --p->size;
+                    reinserts.push_back(to);
+                }
+            }
+
+            // sorted, the paths into a subtree follow the path to it; they are skipped as its nodes are gone once rebuilt
+            std::sort(rebuilds.begin(), rebuilds.end());
+            const std::vector<node_t*>* outer = nullptr;
+            for (const auto& p : rebuilds) {
+                if (outer != nullptr && p.size() >= outer->size() && std::equal(outer->begin(), outer->end(), p.begin()))
+                    continue;
+                outer = &p;
+                node_t* parent = p.size() > 1 ? p[p.size() - 2] : nullptr;
+                rebuild(parent == nullptr ? root_ : parent->left.get() == p.back() ? parent->left : parent->right, p.back()->axis);
+            }
+            return ret;
+        }
+
+        /** Returns the number of erased points still in the tree.
+        */
+        inline size_t erased_count() const noexcept {
+            return n_erased_;
+        }
+
+        /** Returns copies of all points that are not erased.
+        */
+        std::vector<data_t> live_points() const {
+            std::vector<data_t> ret;
+            if (root_ != nullptr)
+                ret.reserve(root_->size);
+            detail::kd_stack<const node_t*> stack;
+            if (root_ != nullptr)
+                stack.push(root_.get());
+            while (!stack.empty()) {
+                const node_t* n = stack.pop();
+                if (!n->erased)
+                    ret.push_back(n->data);
+                if (n->left != nullptr)
+                    stack.push(n->left.get());
+                if (n->right != nullptr)
+                    stack.push(n->right.get());
+            }
+            return ret;
+        }
+
+        /** Rebuilds the whole tree without its erased points.
+        */
+        inline void compact() {
+            if (n_erased_ == 0)
+                return;
+            std::vector<data_t> points = live_points();
+            build(points.begin(), points.end(), options_);
+        }
+
+        /** Inserts a node into the tree structure.
+        If kd_build_options::balance is set, rebuilds the topmost subtree on the insertion path that became unbalanced.
+        CAUTION: Without kd_build_options::balance the tree may not be balanced.
+        CAUTION: Rebuilding replaces the subtree's nodes, pointers to their points are invalidated.
+        @return Returns the root node.
+        */
+        inline node_ptr insert(const data_t& data) {
+            node_ptr* scapegoat = nullptr;
+            size_t scapegoat_axis = 0;
+            do_insert(data, root_, nullptr, 0, scapegoat, scapegoat_axis);
+            if (scapegoat != nullptr)
+                rebuild(*scapegoat, scapegoat_axis);
+            return root_;
+        }
+
+        // node access used by the tree algorithms; handles are raw pointers, so traversals cause no refcount traffic
+        static constexpr size_t max_bucket_size = 1;
+        inline node_handle root() const noexcept { return root_.get(); }
+        static inline bool is_null(const node_handle n) noexcept { return n == nullptr; }
+        static inline node_handle left(const node_handle n) noexcept { return n->left.get(); }
+        static inline node_handle right(const node_handle n) noexcept { return n->right.get(); }
+        static inline size_t axis(const node_handle n) noexcept { return n->axis; }
+        static inline coord_t split(const node_handle n) { return n->data[n->axis]; }
+        static inline size_t point_count(const node_handle) noexcept { return 1; }
+        static inline data_t& point(const node_handle n, size_t) noexcept { return n->data; }
+        static inline bool is_erased(const node_handle n, size_t) noexcept { return n->erased; }
+        static inline size_t subtree_size(const node_handle n) noexcept { return n->size; }
+        static inline const box_t& bounds(const node_handle n) noexcept { return n->bounds; }
+
+        /** Writes the reduced distance between the node's point and the center to out.
+        The bound only matters for quantized storages, see kd_flat_storage::distances().
+        @return Returns the number of points of the node, i.e. 1.
+        */
+        template< typename metric_t>
+        static inline size_t distances(
+            const node_handle n,
+            const data_t& center,
+            const metric_t& metric,
+            coord_t* out,
+            const coord_t = std::numeric_limits<coord_t>::max()) {
+            *out = detail::kd_distance<n_dims, coord_t>(metric, n->data, center);
+            return 1;
+        }
+
+        /** Returns the number of bytes allocated by the tree.
+        Assumes one control block plus node per std::make_shared call.
+        */
+        size_t memory_footprint() const {
+            struct control_block_estimate { void* vtable; int use_count; int weak_count; };
+            size_t n_nodes = 0;
+            count_nodes(root_.get(), n_nodes);
+            return n_nodes * (sizeof(node_t) + sizeof(control_block_estimate));
+        }
+
+        /** Calls f with every point that is not erased, in depth-first pre-order, like iterating the storage.
+        */
+        template< typename func_t>
+        void for_each_point(func_t&& f) const {
+            for (const node_t* n = has_points(root_.get()) ? root_.get() : nullptr; n != nullptr; n = next_node(n))
+                if (!n->erased)
+                    f(n->data);
+        }
+
+        // iterator methods
+        inline const_iterator begin() const noexcept { return const_iterator(root_.get()); }
+        inline const_iterator end() const noexcept { return const_iterator(); }
+
+    private: // helpers
+
+        /** Tells whether the given subtree exists and holds points that are not erased.
+        */
+        static inline bool has_points(const node_t* n) noexcept {
+            return n != nullptr && n->size > 0;
+        }
+
+        /** Returns the node after the given one in depth-first pre-order, skipping subtrees without points that are not
+        erased, or nullptr after the last one. Climbs via the parent links instead of keeping a stack.
+        */
+        static const node_t* next_node(const node_t* n) noexcept {
+            if (has_points(n->left.get()))
+                return n->left.get();
+            if (has_points(n->right.get()))
+                return n->right.get();
+            for (const node_t* parent = n->parent; parent != nullptr; n = parent, parent = n->parent)
+                if (n == parent->left.get() && has_points(parent->right.get()))
+                    return parent->right.get();
+            return nullptr;
+        }
+
+        /** Recursively creates a kd tree hierarchy from the elements in the given ranges.
+        */
+        template< typename iter_t>
+        node_ptr create_kd_node_hierarchy(
+            const iter_t start,
+            const iter_t end,
+            size_t axis,
+            const kd_build_options& options,
+            const size_t depth = 0,
+            node_t* const parent = nullptr) {
+
+            assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+
+            const auto n_points = std::distance(start, end);
+            if (n_points < 1)
+                return nullptr;
+
+            iter_t middle = detail::kd_split_range<data_t, n_dims>(start, end, axis, options.split);
+
+            node_ptr ret = create_node();
+            ret->data = *middle;
+            ret->axis = static_cast<std::uint8_t>(axis);
+            ret->parent = parent;
+
+            axis = (axis + 1) % n_dims;
+            if (options.fork(depth, static_cast<size_t>(n_points))) {
+                // the partitions are disjoint, so the left one can be built concurrently
+                auto left = std::async(std::launch::async, [&]() {
+                    return create_kd_node_hierarchy(start, middle, axis, options, depth + 1, ret.get()); });
+                ret->right = create_kd_node_hierarchy(std::next(middle, 1), end, axis, options, depth + 1, ret.get());
+                ret->left = left.get();
+            }
+            else {
+                ret->left = create_kd_node_hierarchy(start, middle, axis, options, depth + 1, ret.get());
+                ret->right = create_kd_node_hierarchy(std::next(middle, 1), end, axis, options, depth + 1, ret.get());
+            }
+
+            ret->bounds.extend(ret->data);
+            for (const node_t* child : { ret->left.get(), ret->right.get() })
+                if (child != nullptr) {
+                    ret->size += child->size;
+                    ret->bounds.extend(child->bounds);
+                }
+            return ret;
+        }
+
+        /** Factory method for node pointers.
+        */
+        inline node_ptr create_node() {
+            return std::make_shared<node_t>();
+        }
+
+        /** Recursively inserts a node at the right place.
+        Does not rebalance the tree itself, but reports the topmost subtree on the insertion path that became unbalanced.
+        @param scapegoat Set to the owning pointer of that subtree, if any and not set yet.
+        @param scapegoat_axis Set to the splitting axis of that subtree's root.
+        @param axis The splitting axis of a new node.
+        */
+        node_ptr do_insert(
+            const data_t& data,
+            node_ptr& current_node,
+            node_t* const parent_node,
+            const size_t axis,
+            node_ptr*& scapegoat,
+            size_t& scapegoat_axis) {
+
+            assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+
+            if (current_node == nullptr) {
+                current_node = create_node();
+                current_node->data = data;
+                current_node->axis = static_cast<std::uint8_t>(axis);
+                current_node->parent = parent_node;
+                current_node->bounds.extend(data);
+                return current_node;
+            }
+
+            ++current_node->size;
+            current_node->bounds.extend(data);
+            const size_t node_axis = current_node->axis;
+            const bool go_left = data[node_axis] <= current_node->data[node_axis];
+            const size_t left_size = (current_node->left == nullptr ? 0 : current_node->left->size) + go_left;
+            const size_t right_size = (current_node->right == nullptr ? 0 : current_node->right->size) + !go_left;
+            if (scapegoat == nullptr && options_.unbalanced(std::max(left_size, right_size), current_node->size)) {
+                scapegoat = &current_node;
+                scapegoat_axis = node_axis;
+            }
+
+            if (go_left) {
+                current_node->left = do_insert(data, current_node->left, current_node.get(), (node_axis + 1) % n_dims, scapegoat, scapegoat_axis);
+            }
+            else {
+                current_node->right = do_insert(data, current_node->right, current_node.get(), (node_axis + 1) % n_dims, scapegoat, scapegoat_axis);
+            }
+
+            return current_node;
+        }
+
+        /** Recursively searches the subtree for a point to erase and updates the subtree sizes on the way back.
+        */
+        template< typename match_t>
+        static bool do_erase(node_t* n, const data_t& data, const match_t& match) {
+            if (n == nullptr || n->size == 0 || !n->bounds.contains(data))
+                return false;
+
+            if (!n->erased && detail::kd_equal_coordinates<n_dims>(n->data, data) && match(n->data))
+                n->erased = true;
+            else if (!do_erase(n->left.get(), data, match) && !do_erase(n->right.get(), data, match))
+                return false;
+            --n->size;
+            return true;
+        }
+
+        /** Recursively searches the subtree for the node holding the given point and appends the nodes on the way to it
+        to path, the subtree's root first.
+        @return Returns whether the point was found.
+        */
+        static bool find_path(node_t* n, const data_t* element, std::vector<node_t*>& path) {
+            if (n == nullptr || !n->bounds.contains(*element))
+                return false;
+            path.push_back(n);
+            if (&n->data == element || find_path(n->left.get(), element, path) || find_path(n->right.get(), element, path))
+                return true;
+            path.pop_back();
+            return false;
+        }
+
+        /** Returns the position on the given path, from the root to a point's node, of the smallest subtree whose cell holds
+        the given new value of the point, or the path's length if the point can take the value in place.
+        */
+        static size_t cell_of(const std::vector<node_t*>& path, const data_t& to) {
+            for (size_t i = 0; i + 1 < path.size(); ++i) {
+                const size_t axis = path[i]->axis;
+                const coord_t split = path[i]->data[axis];
+                if (path[i]->left.get() == path[i + 1] ? !(to[axis] <= split) : !(to[axis] >= split))
+                    return i;
+            }
+            const node_t* n = path.back();
+            const size_t axis = n->axis;
+            if ((n->left != nullptr && n->left->bounds.hi[axis] > to[axis]) || (n->right != nullptr && n->right->bounds.lo[axis] < to[axis]))
+                return path.size() - 1;
+            return path.size();
+        }
+
+        /** Recomputes the node's bounding box from its point and its children's boxes.
+        */
+        static inline void refit_bounds(node_t* n) {
+            n->bounds = box_t();
+            n->bounds.extend(n->data);
+            if (n->left != nullptr)
+                n->bounds.extend(n->left->bounds);
+            if (n->right != nullptr)
+                n->bounds.extend(n->right->bounds);
+        }
+
+        /** Replaces the given subtree with a balanced one holding the same points, dropping erased ones.
+        */
+        void rebuild(node_ptr& subtree, const size_t axis) {
+            std::vector<data_t> points;
+            points.reserve(subtree->size);
+
+            detail::kd_stack<node_t*> stack;
+            stack.push(subtree.get());
+            while (!stack.empty()) {
+                node_t* n = stack.pop();
+                if (n->erased)
+                    --n_erased_;
+                else
+                    points.push_back(n->data);
+                if (n->left != nullptr)
+                    stack.push(n->left.get());
+                if (n->right != nullptr)
+                    stack.push(n->right.get());
+            }
+
+            node_t* const parent = subtree->parent;
+            subtree = create_kd_node_hierarchy(points.begin(), points.end(), axis, options_, 0, parent);
+        }
+
+
+        /** Recursively counts the nodes of the given subtree.
+        */
+        static void count_nodes(const node_t* n, size_t& count) {
+            if (n == nullptr)
+                return;
+            ++count;
+            count_nodes(n->left.get(), count);
+            count_nodes(n->right.get(), count);
+        }
+    };
+
+
+    /** Stores all kd-tree nodes in one contiguous array.
+    Nodes are linked via 32 bit indices and laid out in depth-first pre-order when built in bulk,
+    so the near child usually follows its parent in memory. Points are kept in a separate array
+    whose coordinates are mirrored structure-of-arrays for cache friendly distance computations.
+    Every node owns a contiguous run of points: inner nodes the point on their splitting plane,
+    leaves a bucket of up to bucket_size points that is scanned with a vectorized distance kernel.
+    Every node also keeps the size and bounding box of its subtree.
+    Inserted nodes and points are appended at the end of their arrays, and so are subtrees rebuilt to keep the tree
+    balanced. The arrays are compacted once more than half of the points are left over from rebuilds.
+    Erased points are flagged and stay in place until the tree is compacted, and so are the leftovers.
+    With kd_build_options::quantize, the structure-of-arrays coordinates of bucket points are 16 bit fixed point relative
+    to their node's bounding box, and requantized whenever it changes; see distances(). This only shrinks the coordinate
+    copies, by about a sixth of the footprint for 3D float points; the points, nodes and bounding boxes are kept in full.
+    CAUTION: Pointers to points and iterators are invalidated by insert().
+    */
+    template< typename data_t, size_t n_dims>
+    class kd_flat_storage {
+    public: // inner typedefs
+        using index_t = std::uint32_t;
+        using node_ptr = index_t;
+        using node_handle = index_t;
+        using element_t = data_t;   ///< the type of the points queries hand out
+        using coord_t = detail::kd_coord_t<data_t>;
+        using box_t = detail::kd_box<coord_t, n_dims>;
+
+        /** Forward iterator over the points that are not erased, in memory order, without compacting.
+        Leftovers from rebuilds are flagged as erased, so it only has to skip the erased flags.
+        */
+        class const_iterator {
+        public: // inner typedefs
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = data_t;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const data_t*;
+            using reference = const data_t&;
+
+        private: // vars
+            const kd_flat_storage* storage_ = nullptr;  ///< the iterated storage
+            size_t i_ = 0;                              ///< the index of the current point
+
+        public: // operations
+
+            // ctors
+            const_iterator() noexcept {}
+            const_iterator(const kd_flat_storage& storage, const size_t i) noexcept : storage_(&storage), i_(i) {
+                skip_erased();
+            }
+
+            // increment operations
+            inline const_iterator& operator++() noexcept { ++i_; skip_erased(); return *this; } // prefix++
+            inline const_iterator  operator++(int) noexcept { const_iterator tmp(*this); ++(*this); return tmp; } // postfix++
+
+            // equality / inequality operations
+            inline bool operator==(const const_iterator& other) const noexcept { return i_ == other.i_; }
+            inline bool operator!=(const const_iterator& other) const noexcept { return i_ != other.i_; }
+
+            // dereference operations
+            inline reference operator*() const noexcept { return storage_->points_[i_]; }
+            inline pointer operator->() const noexcept { return &storage_->points_[i_]; }
+
+        private: // helpers
+
+            /** Moves the iterator to the next point that is not erased, unless it is at one.
+            */
+            inline void skip_erased() noexcept {
+                const size_t n = storage_->points_.size();
+                while (i_ < n && storage_->erased_[i_])
+                    ++i_;
+            }
+        };
+
+        /// Points are read-only: writing one would leave its coordinates and the bounding boxes stale; see refit().
+        using iterator = const_iterator;
+
+        static constexpr index_t null_index = std::numeric_limits<index_t>::max();
+        static constexpr size_t max_bucket_size = kd_max_bucket_size;
+        static constexpr std::uint16_t max_quantized = std::numeric_limits<std::uint16_t>::max();
+
+    public: // inner classes
+
+        /** Represents nodes in the kd-tree.
+        The node's own points may lie on either side of the split, the children's points may not.
+        */
+        struct node_t {
+            coord_t split;              ///< the position of the splitting plane on the splitting axis
+            index_t left = null_index;  ///< index of the left child
+            index_t right = null_index; ///< index of the right child
+            index_t first = null_index; ///< index of the node's first point
+            std::uint16_t count = 0;    ///< number of the node's points, at most kd_max_bucket_size
+            std::uint16_t axis = 0;     ///< the splitting axis
+            index_t size = 0;           ///< number of points in the subtree that are not erased
+            box_t bounds;               ///< bounding box of the subtree's points, including erased ones
+        };
+
+    private: // inner classes
+
+        /** Scratch state of a bulk build of the points appended to the point arrays from position offset on.
+        The points' coordinates are sorted once per axis. Splitting a node partitions each axis' run stably into
+        the left subtree's, the node's and the right subtree's, so the runs stay sorted and every subtree's runs cover
+        the positions its points finally take. The points themselves are only gathered once the hierarchy is built.
+        */
+        struct presorted_t {
+
+            /** A point's coordinate on one axis.
+            */
+            struct entry_t {
+                coord_t coord;  ///< the coordinate
+                index_t index;  ///< the point's number
+
+                inline bool operator<(const entry_t& other) const noexcept {
+                    return coord < other.coord || (!(other.coord < coord) && index < other.index);
+                }
+            };
+
+            /// Per axis the coordinates, sorted within every subtree's run.
+            using runs_t = std::array<std::vector<entry_t>, n_dims>;
+
+            size_t offset = 0;                                  ///< position of the first point in the point arrays
+            std::array<runs_t, 2> runs;                         ///< the runs of even and odd tree levels, each level
+                                                                ///< partitions into the other's, saving the copies back
+            std::array<std::vector<coord_t>, n_dims> coords;    ///< per axis and point the coordinate, kd_split::cost_model only
+            std::vector<index_t> sources;                       ///< per position the point's number
+        };
+
+    private: // vars
+
+        std::vector<node_t> nodes_;                         ///< all nodes, the root is at index 0
+        std::vector<data_t> points_;                        ///< the points
+        std::array<std::vector<coord_t>, n_dims> coords_;   ///< the points' coordinates, one array per axis; empty if quantized
+        std::array<std::vector<std::uint16_t>, n_dims> quantized_; ///< if quantized, the coordinates of the bucket points
+                                                            ///< as fixed point within their node's bounding box, one array per axis
+        size_t bucket_size_ = 1;                            ///< maximum number of points per leaf
+        bool quantize_ = false;                             ///< whether coordinates are quantized instead of copied
+        kd_build_options options_;                          ///< parameters for building and rebalancing
+        std::vector<std::uint8_t> erased_;                  ///< per point whether it is erased or left over from a rebuild
+        size_t n_erased_ = 0;                               ///< number of erased points still in the tree
+        size_t stale_points_ = 0;                           ///< number of point array entries left over from rebuilds
+
+    public: // methods
+
+        /** Creates a balanced hierarchy from the given elements.
+        The elements are copied, the given range is not modified.
+        */
+        template< typename iter_t>
+        void build(const iter_t start, const iter_t end, const kd_build_options& options = kd_build_options()) {
+            assert(options.bucket_size >= 1 && options.bucket_size <= max_bucket_size && "unsupported bucket size");
+
+            set_options(options);
+            nodes_.clear();
+            points_.clear();
+            erased_.clear();
+            n_erased_ = 0;
+            stale_points_ = 0;
+            if (quantize_)
+                coords_ = {};
+            else
+                quantized_ = {};
+
+            if (options.presort)
+                build_presorted(start, end, typename std::iterator_traits<iter_t>::iterator_category());
+            else {
+                points_.assign(start, end);
+                assert(points_.size() < null_index && "too many points for 32 bit node indices");
+                nodes_.reserve(std::min(points_.size(), points_.size() / bucket_size_ * 2 + 1));
+                create_kd_node_hierarchy(0, points_.size(), 0, options, 0, nodes_);
+                append_coordinates(0);
+            }
+            quantize_nodes(0);
+        }
+
+        /** Sets the parameters for later inserts without touching the tree.
+        */
+        inline void set_options(const kd_build_options& options) {
+            options_ = options;
+            bucket_size_ = std::max(size_t(1), std::min(options.bucket_size, max_bucket_size));
+            quantize_ = options.quantize && std::is_floating_point<coord_t>::value;
+        }
+
+        /** Returns the parameters for building and rebalancing.
+        */
+        inline const kd_build_options& options() const noexcept {
+            return options_;
+        }
+
+        /** Flags one point with the given coordinates for which match(point) holds as erased.
+        @return Returns whether such a point was found.
+        */
+        template< typename match_t>
+        inline bool erase(const data_t& data, const match_t& match) {
+            if (!do_erase(root(), data, match))
+                return false;
+            ++n_erased_;
+            return true;
+        }
+
+        /** Moves points to new values, keeping the tree's topology where possible.
+        A point that stays on its side of every splitting plane above it is moved in place, and the bounding boxes
+        on its path are refit. Otherwise the smallest subtree on its path whose cell holds the new value is rebuilt if it
+        holds at most kd_build_options::max_refit_rebuild points, once for all points moved into it; larger ones get the
+        point erased and its new value appended to reinserts for the caller to insert.
+        @param first, last Pairs of a point of the tree and its new value.
+        @param moved Called with the old and the new value of every point found before it is moved.
+        @return Returns the number of points found.
+        */
+        template< typename iter_t, typename moved_t>
+        size_t refit(const iter_t first, const iter_t last, std::vector<data_t>& reinserts, moved_t&& moved) {
+            size_t ret = 0;
+            std::vector<index_t> path;
+            std::vector<std::vector<index_t>> rebuilds; // the paths to the subtrees to rebuild
+            for (iter_t it = first; it != last; ++it) {
+                const data_t* element = it->first;
+                const data_t to(it->second);
+                if (element < points_.data() || element >= points_.data() + points_.size())
+                    continue;
+                const index_t i = static_cast<index_t>(element - points_.data());
+                path.clear();
+                if (erased_[i] || !find_path(root(), i, path))
+                    continue;
+                ++ret;
+                moved(*element, to);
+
+                const size_t cell = cell_of(path, to);
+                if (cell == path.size()) {
+                    set_point(i, to);
+                    for (size_t p = path.size(); p-- > 0;)
+                        refit_bounds(path[p]);
+                }
+                else if (nodes_[path[cell]].size <= options_.max_refit_rebuild) {
+                    set_point(i, to);
+                    for (const index_t p : path)
+                        extend_bounds(p, to);
+                    rebuilds.emplace_back(path.begin(), path.begin() + cell + 1);
+                }
+                else {
+                    erased_[i] = 1;
+                    ++n_erased_;
+                    for (const index_t p : path)
+                        --nodes_[p].size;
+                    reinserts.push_back(to);
+                }
+            }
+
+            // sorted, the paths into a subtree follow the path to it and are skipped once it is rebuilt
+            std::sort(rebuilds.begin(), rebuilds.end());
+            const std::vector<index_t>* outer = nullptr;
+            for (const auto& p : rebuilds) {
+                if (outer != nullptr && p.size() >= outer->size() && std::equal(outer->begin(), outer->end(), p.begin()))
+                    continue;
+                outer = &p;
+                const index_t parent = p.size() > 1 ? p[p.size() - 2] : null_index;
+                const index_t subtree = p.back();
+                // rebuilding the root, or too many stale points, rebuilds the whole tree
+                if (rebuild(subtree, parent, parent != null_index && nodes_[parent].left == subtree, nodes_[subtree].axis) == root())
+                    break;
+            }
+            return ret;
+        }
+
+        /** Returns the number of erased points still in the tree.
+        */
+        inline size_t erased_count() const noexcept {
+            return n_erased_;
+        }
+
+        /** Returns copies of all points that are not erased.
+        */
+        std::vector<data_t> live_points() const {
+            std::vector<data_t> ret;
+            if (nodes_.empty())
+                return ret;
+            ret.reserve(nodes_[root()].size);
+            detail::kd_stack<index_t> stack;
+            stack.push(root());
+            while (!stack.empty()) {
+                const node_t& node = nodes_[stack.pop()];
+                for (index_t i = node.first; i < node.first + node.count; ++i)
+                    if (!erased_[i])
+                        ret.push_back(points_[i]);
+                if (node.left != null_index)
+                    stack.push(node.left);
+                if (node.right != null_index)
+                    stack.push(node.right);
+            }
+            return ret;
+        }
+
+        /** Rebuilds the whole tree if it holds erased points or rebuilds left points over in the arrays.
+        */
+        inline void compact() {
+            if (n_erased_ > 0 || stale_points_ > 0)
+                rebuild_all();
+        }
+
+        /** Inserts a point into the tree structure.
+        The point is appended to the leaf it falls into if that leaf's bucket has room and ends at the
+        end of the point arrays, otherwise it becomes a new leaf.
+        If kd_build_options::balance is set, rebuilds the topmost subtree on the insertion path that became unbalanced.
+        CAUTION: Without kd_build_options::balance the tree may not be balanced.
+        @return Returns the index of the node holding the point, or the root of the subtree rebuilt to rebalance the tree.
+        */
+        node_ptr insert(const data_t& data) {
+            assert(points_.size() + 1 < null_index && "too many points for 32 bit node indices");
+
+            index_t parent = null_index;
+            bool go_left = false;
+            size_t axis = 0;
+            index_t scapegoat = null_index;
+            index_t scapegoat_parent = null_index;
+            bool scapegoat_left = false;
+            size_t scapegoat_axis = 0;
+            for (index_t n = root(); n != null_index;) {
+                node_t& node = nodes_[n];
+                axis = node.axis;
+                ++node.size;
+                extend_bounds(n, data);
+                if (node.left == null_index && node.right == null_index
+                    && node.count < bucket_size_ && node.first + node.count == points_.size()) {
+                    push_point(data);
+                    ++node.count;
+                    quantize_node(n);
+                    if (scapegoat != null_index)
+                        return rebuild(scapegoat, scapegoat_parent, scapegoat_left, scapegoat_axis);
+                    return n;
+                }
+
+                const bool left_of_parent = go_left;
+                go_left = data[axis] <= node.split;
+                const size_t left_size = (node.left == null_index ? 0 : nodes_[node.left].size) + go_left;
+                const size_t right_size = (node.right == null_index ? 0 : nodes_[node.right].size) + !go_left;
+                if (scapegoat == null_index && options_.unbalanced(std::max(left_size, right_size), node.size)) {
+                    scapegoat = n;
+                    scapegoat_parent = parent;
+                    scapegoat_left = left_of_parent;
+                    scapegoat_axis = axis;
+                }
+
+                parent = n;
+                n = go_left ? node.left : node.right;
+            }
+
+            if (parent != null_index)
+                axis = (axis + 1) % n_dims;
+            const index_t ret = create_node(push_point(data), 1, axis, nodes_);
+            if (parent != null_index)
+                (go_left ? nodes_[parent].left : nodes_[parent].right) = ret;
+            if (scapegoat != null_index)
+                return rebuild(scapegoat, scapegoat_parent, scapegoat_left, scapegoat_axis);
+            return ret;
+        }
+
+        // node access used by the tree algorithms
+        inline node_handle root() const noexcept { return nodes_.empty() ? null_index : 0; }
+        static inline bool is_null(const node_handle n) noexcept { return n == null_index; }
+        inline node_handle left(const node_handle n) const noexcept { return nodes_[n].left; }
+        inline node_handle right(const node_handle n) const noexcept { return nodes_[n].right; }
+        inline size_t axis(const node_handle n) const noexcept { return nodes_[n].axis; }
+        inline coord_t split(const node_handle n) const noexcept { return nodes_[n].split; }
+        inline size_t point_count(const node_handle n) const noexcept { return nodes_[n].count; }
+        inline bool is_erased(const node_handle n, const size_t i) const noexcept { return erased_[nodes_[n].first + i] != 0; }
+        inline size_t subtree_size(const node_handle n) const noexcept { return nodes_[n].size; }
+        inline const box_t& bounds(const node_handle n) const noexcept { return nodes_[n].bounds; }
+
+        /** Returns the i-th point of the node.
+        Points are handed out mutable to keep the tree's find_* API unchanged; do not alter their coordinates.
+        */
+        inline data_t& point(const node_handle n, const size_t i) const noexcept {
+            return const_cast<data_t&>(points_[nodes_[n].first + i]);
+        }
+
+        /** Writes the reduced distances between the node's points and the center to out.
+        Quantized trees write exact distances only for the points that may lie within the given bound, and for the others
+        a lower bound of their distance that exceeds it, see quantized_distances().
+        @param bound The largest distance the caller accepts, e.g. the reduced radius of a range query.
+        @return Returns the number of points of the node.
+        */
+        template< typename metric_t>
+        inline size_t distances(
+            const node_handle n,
+            const data_t& center,
+            const metric_t& metric,
+            coord_t* out,
+            const coord_t bound = std::numeric_limits<coord_t>::max()) const {
+
+            const node_t& node = nodes_[n];
+            if (quantize_) {
+                quantized_distances(node, center, metric, out, bound);
+                return node.count;
+            }
+            // without buckets, a point's coordinates are fetched from one cache line instead of one per axis
+            if (detail::kd_is_coord_array<data_t, coord_t, n_dims>::value && bucket_size_ == 1 && node.count == 1) {
+                *out = detail::kd_distance<n_dims, coord_t>(metric, points_[node.first], center);
+                return 1;
+            }
+            std::array<const coord_t*, n_dims> coords;
+            for (size_t d = 0; d < n_dims; ++d)
+                coords[d] = coords_[d].data() + node.first;
+            detail::kd_bucket_kernel<metric_t, coord_t, n_dims>::distances(metric, coords, node.count, center, out);
+            return node.count;
+        }
+
+        /** Returns the number of bytes allocated by the tree.
+        */
+        size_t memory_footprint() const {
+            size_t ret = nodes_.capacity() * sizeof(node_t) + points_.capacity() * sizeof(data_t) + erased_.capacity();
+            for (const auto& c : coords_)
+                ret += c.capacity() * sizeof(coord_t);
+            for (const auto& q : quantized_)
+                ret += q.capacity() * sizeof(std::uint16_t);
+            return ret;
+        }
+
+        // raw arrays, e.g. for serialization
+        inline const std::vector<node_t>& nodes() const noexcept { return nodes_; }
+        inline const std::vector<data_t>& points() const noexcept { return points_; }
+        inline const std::vector<coord_t>& coords(const size_t axis) const noexcept { return coords_[axis]; } // empty if quantized
+
+        /** Calls f with every point that is not erased, in memory order, like iterating the storage read-only.
+        */
+        template< typename func_t>
+        void for_each_point(func_t&& f) const {
+            for (size_t i = 0; i < points_.size(); ++i)
+                if (!erased_[i])
+                    f(points_[i]);
+        }
+
+        // iterator methods; iterates the points in memory order, skipping erased points and leftovers from rebuilds
+        inline const_iterator begin() const noexcept { return const_iterator(*this, 0); }
+        inline const_iterator end() const noexcept { return const_iterator(*this, points_.size()); }
+
+    private: // helpers
+
+        /** Recursively creates the nodes for the points in [start, end) and appends them to the given node array
+        in depth-first pre-order. Concurrently built subtrees are assembled in separate arrays and appended
+        afterwards, so the result is identical to the sequential build.
+        @return Returns the index of the subtree's root node within the given array.
+        */
+        index_t create_kd_node_hierarchy(
+            const size_t start,
+            const size_t end,
+            size_t axis,
+            const kd_build_options& options,
+            const size_t depth,
+            std::vector<node_t>& nodes) {
+
+            assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+
+            if (start >= end)
+                return null_index;
+
+            const size_t middle = static_cast<size_t>(std::distance(points_.begin(), detail::kd_split_range<data_t, n_dims>(
+                std::next(points_.begin(), start),
+                std::next(points_.begin(), end),
+                axis,
+                options.split)));
+
+            if (end - start <= bucket_size_) {
+                // leaf; the split only determines where later inserts go
+                const index_t ret = create_node(static_cast<index_t>(start), static_cast<index_t>(end - start), axis, nodes);
+                nodes[ret].split = points_[middle][axis];
+                return ret;
+            }
+
+            const index_t ret = create_node(static_cast<index_t>(middle), 1, axis, nodes);
+            const size_t next_axis = (axis + 1) % n_dims;
+            index_t left, right;
+            if (options.fork(depth, end - start)) {
+                // the partitions are disjoint, so the left one can be built concurrently
+                std::vector<node_t> left_nodes, right_nodes;
+                auto left_task = std::async(std::launch::async, [&]() {
+                    create_kd_node_hierarchy(start, middle, next_axis, options, depth + 1, left_nodes); });
+                create_kd_node_hierarchy(middle + 1, end, next_axis, options, depth + 1, right_nodes);
+                left_task.get();
+                left = append_nodes(left_nodes, nodes);
+                right = append_nodes(right_nodes, nodes);
+            }
+            else {
+                left = create_kd_node_hierarchy(start, middle, next_axis, options, depth + 1, nodes);
+                right = create_kd_node_hierarchy(middle + 1, end, next_axis, options, depth + 1, nodes);
+            }
+            node_t& node = nodes[ret];
+            node.left = left;
+            node.right = right;
+            for (const index_t child : { left, right })
+                if (child != null_index) {
+                    node.size += nodes[child].size;
+                    node.bounds.extend(nodes[child].bounds);
+                }
+            return ret;
+        }
+
+        /** Builds the hierarchy of the elements in [start, end) of a random-access range with kd_build_options::presort.
+        */
+        template< typename iter_t>
+        inline void build_presorted(const iter_t start, const iter_t end, std::random_access_iterator_tag) {
+            const size_t n = static_cast<size_t>(std::distance(start, end));
+            assert(n < null_index && "too many points for 32 bit node indices");
+            nodes_.reserve(std::min(n, n / bucket_size_ * 2 + 1));
+            append_presorted(start, n, 0, options_, nodes_);
+        }
+
+        /** Builds the hierarchy of the elements in [start, end) of any other range with kd_build_options::presort.
+        */
+        template< typename iter_t>
+        inline void build_presorted(const iter_t start, const iter_t end, std::input_iterator_tag) {
+            const std::vector<data_t> points(start, end);
+            build_presorted(points.begin(), points.end(), std::random_access_iterator_tag());
+        }
+
+        /** Fills the coordinate arrays and erased flags of the points from the given position on.
+        Quantized coordinates are only sized here and filled by quantize_nodes() once the points' nodes are in place.
+        */
+        inline void append_coordinates(const size_t start) {
+            for (size_t d = 0; d < n_dims; ++d) {
+                if (quantize_) {
+                    if (bucket_size_ > 1)
+                        quantized_[d].resize(points_.size());
+                    continue;
+                }
+                coords_[d].resize(points_.size());
+                for (size_t i = start; i < points_.size(); ++i)
+                    coords_[d][i] = points_[i][d];
+            }
+            erased_.resize(points_.size(), 0);
+        }
+
+        /** Appends the given points to the point arrays in the order of a new balanced hierarchy, whose nodes
+        are appended to the given node array in depth-first pre-order.
+        Sorts the points' coordinates once per axis and partitions them down the tree, instead of selecting the
+        median of the points themselves on every level; the points are copied exactly once.
+        @param src The first of the n points, random access.
+        @param axis The root's splitting axis under kd_split::round_robin.
+        @return Returns the index of the hierarchy's root node within the given array.
+        */
+        template< typename iter_t>
+        index_t append_presorted(
+            const iter_t src,
+            const size_t n,
+            const size_t axis,
+            const kd_build_options& options,
+            std::vector<node_t>& nodes) {
+
+            presorted_t presorted;
+            presorted.offset = points_.size();
+            assert(presorted.offset + n < null_index && "too many points for 32 bit node indices");
+            typename presorted_t::runs_t& runs = presorted.runs[0];
+            for (size_t d = 0; d < n_dims; ++d)
+                runs[d].resize(n);
+            for (size_t i = 0; i < n; ++i)
+                for (size_t d = 0; d < n_dims; ++d)
+                    runs[d][i] = { src[i][d], static_cast<index_t>(i) };
+            detail::parallel_for(n_dims, options.n_threads, [&runs](const size_t d, size_t) {
+                // entries come in ascending indices, so the stable radix sort breaks ties like entry_t::operator<
+                detail::kd_sort_by_coord(runs[d], std::integral_constant<bool, detail::kd_radix_key<coord_t>::enabled>());
+            });
+
+            // number the points by their rank on the first axis, so that a subtree's points have close numbers
+            // and the accesses to their sides stay local
+            std::vector<index_t> origins(n);
+            presorted.sources.resize(n);
+            for (size_t i = 0; i < n; ++i) {
+                origins[i] = runs[0][i].index;
+                presorted.sources[runs[0][i].index] = static_cast<index_t>(i);
+                runs[0][i].index = static_cast<index_t>(i);
+            }
+            for (size_t d = 1; d < n_dims; ++d)
+                for (auto& e : runs[d])
+                    e.index = presorted.sources[e.index];
+            for (size_t d = 0; d < n_dims; ++d)
+                presorted.runs[1][d].resize(n);
+            if (options.split == kd_split::cost_model)
+                for (size_t d = 0; d < n_dims; ++d) {
+                    presorted.coords[d].resize(n);
+                    for (size_t i = 0; i < n; ++i)
+                        presorted.coords[d][i] = src[origins[i]][d];
+                }
+
+            std::vector<std::uint64_t> sides((n + 63) / 64);
+            const index_t ret = create_kd_node_hierarchy(0, n, axis, options, 0, nodes, presorted, sides);
+            presorted.runs = {};
+
+            points_.reserve(presorted.offset + n);
+            for (const index_t i : presorted.sources)
+                points_.push_back(src[origins[i]]);
+            append_coordinates(presorted.offset);
+            return ret;
+        }
+
+        /** Recursively creates the nodes for the presorted points in the runs [start, end) and appends them
+        to the given node array in depth-first pre-order. Concurrently built subtrees are assembled
+        in separate arrays and appended afterwards, so the result is identical to the sequential build.
+        @param sides Per point a bit to partition with, not shared with concurrently built subtrees.
+        @return Returns the index of the subtree's root node within the given array.
+        */
+        index_t create_kd_node_hierarchy(
+            const size_t start,
+            const size_t end,
+            size_t axis,
+            const kd_build_options& options,
+            const size_t depth,
+            std::vector<node_t>& nodes,
+            presorted_t& presorted,
+            std::vector<std::uint64_t>& sides) {
+
+            assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+
+            if (start >= end)
+                return null_index;
+
+            const typename presorted_t::runs_t& runs = presorted.runs[depth % 2];
+            const size_t middle = start + split_rank(start, end, axis, options.split, runs, presorted.coords);
+
+            if (end - start <= bucket_size_) {
+                // leaf; the split only determines where later inserts go
+                const index_t ret = create_node(start, end - start, axis, nodes, presorted, depth % 2);
+                nodes[ret].split = runs[axis][middle].coord;
+                return ret;
+            }
+
+            partition(start, middle, end, axis, runs, presorted.runs[(depth + 1) % 2], sides);
+            const index_t ret = create_node(middle, 1, axis, nodes, presorted, (depth + 1) % 2);
+            const size_t next_axis = (axis + 1) % n_dims;
+            index_t left, right;
+            if (options.fork(depth, end - start)) {
+                // the runs are disjoint, so the left one can be built concurrently
+                std::vector<node_t> left_nodes, right_nodes;
+                auto left_task = std::async(std::launch::async, [&]() {
+                    std::vector<std::uint64_t> left_sides(sides.size());
+                    create_kd_node_hierarchy(start, middle, next_axis, options, depth + 1, left_nodes, presorted, left_sides); });
+                create_kd_node_hierarchy(middle + 1, end, next_axis, options, depth + 1, right_nodes, presorted, sides);
+                left_task.get();
+                left = append_nodes(left_nodes, nodes);
+                right = append_nodes(right_nodes, nodes);
+            }
+            else {
+                left = create_kd_node_hierarchy(start, middle, next_axis, options, depth + 1, nodes, presorted, sides);
+                right = create_kd_node_hierarchy(middle + 1, end, next_axis, options, depth + 1, nodes, presorted, sides);
+            }
+            node_t& node = nodes[ret];
+            node.left = left;
+            node.right = right;
+            for (const index_t child : { left, right })
+                if (child != null_index) {
+                    node.size += nodes[child].size;
+                    node.bounds.extend(nodes[child].bounds);
+                }
+            return ret;
+        }
+
+        /** Chooses the splitting axis of a node holding the presorted points in the given runs [start, end)
+        like detail::kd_split_range().
+        @param axis The axis the node has under kd_split::round_robin; set to the chosen axis.
+        @param coords The points' coordinates for kd_split::cost_model.
+        @return Returns the rank of the node's point on the chosen axis within the run: the points ranked lower are
+        not greater on that axis, the points ranked higher not smaller.
+        */
+        static size_t split_rank(
+            const size_t start,
+            const size_t end,
+            size_t& axis,
+            const kd_split split,
+            const typename presorted_t::runs_t& runs,
+            const std::array<std::vector<coord_t>, n_dims>& coords) {
+
+            const size_t n = end - start;
+            if (split == kd_split::round_robin || n < 2)
+                return n / 2;
+
+            const box_t bounds = presorted_bounds(start, end, runs);
+            for (size_t d = 0; d < n_dims; ++d)
+                if (bounds.hi[d] - bounds.lo[d] > bounds.hi[axis] - bounds.lo[axis])
+                    axis = d;
+
+            coord_t value = bounds.lo[axis] + (bounds.hi[axis] - bounds.lo[axis]) / 2;
+            if (split == kd_split::cost_model) {
+                const auto point_of = [&coords](const typename presorted_t::entry_t& e) {
+                    return detail::kd_coords_ref<coord_t, n_dims>{ &coords, e.index }; };
+                double cost = std::numeric_limits<double>::max();
+                for (size_t d = 0; d < n_dims; ++d) {
+                    coord_t cut;
+                    if (detail::kd_cheapest_cut(runs[0].begin() + start, runs[0].begin() + end, point_of, bounds, d, cost, cut)) {
+                        axis = d;
+                        value = cut;
+                    }
+                }
+            }
+
+            if (split == kd_split::widest_spread || !(bounds.lo[axis] < bounds.hi[axis]))
+                return n / 2;
+
+            // the node's point is the lowest one at or above the plane, or the highest if all lie below
+            const auto run = runs[axis].begin();
+            const size_t ret = static_cast<size_t>(std::lower_bound(run + start, run + end, value,
+                [](const typename presorted_t::entry_t& e, const coord_t v) { return e.coord < v; }) - (run + start));
+            return std::min(ret, n - 1);
+        }
+
+        /** Returns the bounding box of the presorted points in the given runs [start, end), spanned by the runs' ends.
+        */
+        static inline box_t presorted_bounds(const size_t start, const size_t end, const typename presorted_t::runs_t& runs) noexcept {
+            box_t ret;
+            for (size_t d = 0; d < n_dims; ++d) {
+                ret.lo[d] = runs[d][start].coord;
+                ret.hi[d] = runs[d][end - 1].coord;
+            }
+            return ret;
+        }
+
+        /** Stably partitions every axis' run [start, end) of the presorted points into the other level's runs so that
+        the points ranked below middle on the given axis come first, followed by the point ranked middle and the points
+        ranked above. The sides are kept in bits, which keeps their random accesses within the cache for large runs.
+        */
+        static void partition(
+            const size_t start,
+            const size_t middle,
+            const size_t end,
+            const size_t axis,
+            const typename presorted_t::runs_t& from,
+            typename presorted_t::runs_t& to,
+            std::vector<std::uint64_t>& sides) {
+
+            for (size_t i = start; i < end; ++i) {
+                const index_t p = from[axis][i].index;
+                if (i > middle)
+                    sides[p / 64] |= std::uint64_t(1) << (p % 64);
+                else
+                    sides[p / 64] &= ~(std::uint64_t(1) << (p % 64));
+                to[axis][i] = from[axis][i];
+            }
+
+            const index_t node = from[axis][middle].index;
+            for (size_t d = 0; d < n_dims; ++d) {
+                if (d == axis)
+                    continue;
+                size_t next[2] = { start, middle + 1 };
+                for (size_t i = start; i < end; ++i) {
+                    const index_t p = from[d][i].index;
+                    if (p == node)
+                        to[d][middle] = from[d][i];
+                    else
+                        to[d][next[sides[p / 64] >> (p % 64) & 1]++] = from[d][i];
+                }
+            }
+        }
+
+        /** Recursively searches the subtree for a point to erase and updates the subtree sizes on the way back.
+        */
+        template< typename match_t>
+        bool do_erase(const index_t n, const data_t& data, const match_t& match) {
+            if (n == null_index || nodes_[n].size == 0 || !nodes_[n].bounds.contains(data))
+                return false;
+
+            node_t& node = nodes_[n];
+            for (index_t i = node.first; i < node.first + node.count; ++i)
+                if (!erased_[i] && detail::kd_equal_coordinates<n_dims>(points_[i], data) && match(points_[i])) {
+                    erased_[i] = 1;
+                    --node.size;
+                    return true;
+                }
+
+            if (!do_erase(node.left, data, match) && !do_erase(node.right, data, match))
+                return false;
+            --node.size;
+            return true;
+        }
+
+        /** Recursively searches the subtree for the node holding the point at the given index and appends the nodes
+        on the way to it to path, the subtree's root first.
+        @return Returns whether the point was found.
+        */
+        bool find_path(const index_t n, const index_t i, std::vector<index_t>& path) const {
+            if (n == null_index || !nodes_[n].bounds.contains(points_[i]))
+                return false;
+            const node_t& node = nodes_[n];
+            path.push_back(n);
+            if ((i >= node.first && i < node.first + node.count) || find_path(node.left, i, path) || find_path(node.right, i, path))
+                return true;
+            path.pop_back();
+            return false;
+        }
+
+        /** Returns the position on the given path, from the root to a point's node, of the smallest subtree whose cell holds
+        the given new value of the point, or the path's length if the point can take the value in place.
+        */
+        size_t cell_of(const std::vector<index_t>& path, const data_t& to) const {
+            for (size_t p = 0; p + 1 < path.size(); ++p) {
+                const node_t& node = nodes_[path[p]];
+                if (node.left == path[p + 1] ? !(to[node.axis] <= node.split) : !(to[node.axis] >= node.split))
+                    return p;
+            }
+            return path.size();
+        }
+
+        /** Overwrites the point at the given index and its coordinates.
+        */
+        inline void set_point(const index_t i, const data_t& data) {
+            points_[i] = data;
+            if (!quantize_)
+                for (size_t d = 0; d < n_dims; ++d)
+                    coords_[d][i] = data[d];
+        }
+
+        /** Recomputes the node's bounding box from its points and its children's boxes.
+        */
+        inline void refit_bounds(const index_t n) {
+            node_t& node = nodes_[n];
+            node.bounds = box_t();
+            for (index_t i = node.first; i < node.first + node.count; ++i)
+                node.bounds.extend(points_[i]);
+            if (node.left != null_index)
+                node.bounds.extend(nodes_[node.left].bounds);
+            if (node.right != null_index)
+                node.bounds.extend(nodes_[node.right].bounds);
+            quantize_node(n);
+        }
+
+        /** Replaces the given subtree with a balanced one holding the same points without the erased ones,
+        appended to the arrays. The old subtree's nodes and points are left over until the next compaction.
+        @param parent The subtree root's parent, null_index for the root of the tree.
+        @param is_left Whether the subtree is the left child of its parent.
+        @return Returns the index of the new subtree's root.
+        */
+        index_t rebuild(const index_t subtree, const index_t parent, const bool is_left, const size_t axis) {
+            if (parent == null_index) {
+                rebuild_all();
+                return root();
+            }
+
+            // presorting builds from a copy, otherwise the points are appended and partitioned in place
+            const size_t start = points_.size();
+            std::vector<data_t> copy;
+            std::vector<data_t>& points = options_.presort ? copy : points_;
+            points.reserve(points.size() + nodes_[subtree].size);
+            detail::kd_stack<index_t> stack;
+            stack.push(subtree);
+            while (!stack.empty()) {
+                const node_t& node = nodes_[stack.pop()];
+                stale_points_ += node.count;
+                for (index_t i = node.first; i < node.first + node.count; ++i) {
+                    if (erased_[i])
+                        --n_erased_;
+                    else
+                        points.push_back(points_[i]);
+                    erased_[i] = 1; // flags the leftover, so scans in memory order skip it; not counted as erased
+                }
+                if (node.left != null_index)
+                    stack.push(node.left);
+                if (node.right != null_index)
+                    stack.push(node.right);
+            }
+
+            std::vector<node_t> nodes;
+            if (options_.presort)
+                append_presorted(copy.begin(), copy.size(), axis, options_, nodes);
+            else {
+                create_kd_node_hierarchy(start, points_.size(), axis, options_, 0, nodes);
+                append_coordinates(start);
+            }
+            const index_t ret = append_nodes(nodes, nodes_);
+            (is_left ? nodes_[parent].left : nodes_[parent].right) = ret;
+            quantize_nodes(ret);
+
+            if (stale_points_ > points_.size() / 2) {
+                rebuild_all();
+                return root();
+            }
+            return ret;
+        }
+
+        /** Rebuilds the whole tree from its points that are not erased.
+        */
+        void rebuild_all() {
+            std::vector<data_t> points = live_points();
+            build(points.begin(), points.end(), options_);
+        }
+
+        /** Appends a separately built subtree to the given node array and relocates its child indices.
+        @return Returns the index of the subtree's root node within the target array.
+        */
+        static index_t append_nodes(const std::vector<node_t>& subtree, std::vector<node_t>& nodes) {
+            if (subtree.empty())
+                return null_index;
+
+            const index_t offset = static_cast<index_t>(nodes.size());
+            for (node_t n : subtree) {
+                if (n.left != null_index)
+                    n.left += offset;
+                if (n.right != null_index)
+                    n.right += offset;
+                nodes.push_back(n);
+            }
+            return offset;
+        }
+
+        /** Appends a node for the given run of points to the given node array.
+        Its split is the first point's coordinate on the given axis, its subtree the run itself.
+        */
+        inline index_t create_node(const index_t first, const index_t count, const size_t axis, std::vector<node_t>& nodes) const {
+            node_t n;
+            n.split = points_[first][axis];
+            n.axis = static_cast<std::uint16_t>(axis);
+            n.first = first;
+            n.count = static_cast<std::uint16_t>(count);
+            n.size = count;
+            for (index_t i = first; i < first + count; ++i)
+                n.bounds.extend(points_[i]);
+            nodes.push_back(n);
+            return static_cast<index_t>(nodes.size() - 1);
+        }
+
+        /** Appends a node for the presorted points in the runs [start, start + count) of the given level
+        to the given node array and records where their points go.
+        Its split is the first point's coordinate on the given axis, its subtree the run itself.
+        */
+        static inline index_t create_node(
+            const size_t start,
+            const size_t count,
+            const size_t axis,
+            std::vector<node_t>& nodes,
+            presorted_t& presorted,
+            const size_t level) {
+
+            const typename presorted_t::runs_t& runs = presorted.runs[level];
+            node_t n;
+            n.split = runs[axis][start].coord;
+            n.axis = static_cast<std::uint16_t>(axis);
+            n.first = static_cast<index_t>(presorted.offset + start);
+            n.count = static_cast<std::uint16_t>(count);
+            n.size = static_cast<index_t>(count);
+            n.bounds = presorted_bounds(start, start + count, runs);
+            for (size_t i = start; i < start + count; ++i)
+                presorted.sources[i] = runs[0][i].index;
+            nodes.push_back(n);
+            return static_cast<index_t>(nodes.size() - 1);
+        }
+
+        /** Appends a point to the point arrays.
+        */
+        inline index_t push_point(const data_t& data) {
+            points_.push_back(data);
+            erased_.push_back(0);
+            for (size_t d = 0; d < n_dims; ++d) {
+                if (!quantize_)
+                    coords_[d].push_back(data[d]);
+                else if (bucket_size_ > 1)
+                    quantized_[d].push_back(0); // set by quantize_node() once the point belongs to a bucket
+            }
+            return static_cast<index_t>(points_.size() - 1);
+        }
+
+        /** Returns the distance between two consecutive fixed point values on the given axis of the given box.
+        */
+        static inline coord_t quantization_step(const box_t& bounds, const size_t axis) noexcept {
+            return (bounds.hi[axis] - bounds.lo[axis]) / coord_t(max_quantized);
+        }
+
+        /** Stores the coordinates of the node's points as fixed point within its bounding box, if the tree is quantized
+        and the node has a bucket of several points; single points are always compared exactly.
+        */
+        inline void quantize_node(const index_t n) {
+            const node_t& node = nodes_[n];
+            if (!quantize_ || node.count < 2)
+                return;
+            for (size_t d = 0; d < n_dims; ++d) {
+                const coord_t step = quantization_step(node.bounds, d);
+                for (index_t i = node.first; i < node.first + node.count; ++i) {
+                    const coord_t q = std::round((points_[i][d] - node.bounds.lo[d]) / step);
+                    quantized_[d][i] = !(q > 0) ? 0 : q >= coord_t(max_quantized) ? max_quantized : static_cast<std::uint16_t>(q);
+                }
+            }
+        }
+
+        /** Quantizes the points of all nodes from the given index on, e.g. of a subtree that was just appended.
+        */
+        inline void quantize_nodes(const index_t first) {
+            if (quantize_)
+                for (size_t n = first; n < nodes_.size(); ++n)
+                    quantize_node(static_cast<index_t>(n));
+        }
+
+        /** Extends the node's bounding box by the given point and requantizes its points if the box grew.
+        */
+        inline void extend_bounds(const index_t n, const data_t& data) {
+            box_t& bounds = nodes_[n].bounds;
+            if (!quantize_) {
+                bounds.extend(data);
+                return;
+            }
+            const box_t before = bounds;
+            bounds.extend(data);
+            if (before.lo != bounds.lo || before.hi != bounds.hi)
+                quantize_node(n);
+        }
+
+        /** Writes the reduced distances between the node's points and the center to out, for quantized trees.
+        First bounds every bucket point's distance from below by its quantized coordinates, widened by a quantization
+        step and the rounding errors of the comparison; only the points whose bound is within the given one get their exact
+        distance computed from the points themselves, which yields exactly the distances of an unquantized tree.
+        The others get their lower bound, which exceeds the given one.
+        */
+        template< typename metric_t>
+        void quantized_distances(const node_t& node, const data_t& center, const metric_t& metric, coord_t* out, const coord_t bound) const {
+            if (node.count < 2 || !(bound < std::numeric_limits<coord_t>::max())) {
+                for (index_t i = 0; i < node.count; ++i)
+                    out[i] = detail::kd_distance<n_dims, coord_t>(metric, points_[node.first + i], center);
+                return;
+            }
+
+            // a dequantized coordinate is off by at most half a step plus the rounding of the arithmetic on the box corners;
+            // shrinking the differences by a few ulps per axis keeps the bound below the exact distance's rounded arithmetic
+            constexpr coord_t eps = std::numeric_limits<coord_t>::epsilon();
+            std::array<const std::uint16_t*, n_dims> quantized;
+            std::array<coord_t, n_dims> relative_center, step, tolerance;
+            for (size_t d = 0; d < n_dims; ++d) {
+                quantized[d] = quantized_[d].data() + node.first;
+                relative_center[d] = center[d] - node.bounds.lo[d];
+                step[d] = quantization_step(node.bounds, d);
+                tolerance[d] = step[d] + 8 * eps * (std::abs(node.bounds.lo[d]) + std::abs(node.bounds.hi[d]));
+            }
+            detail::kd_quantized_kernel<metric_t, coord_t, n_dims>::lower_bounds(
+                metric, quantized, node.count, relative_center, step, tolerance, 1 - (n_dims + 8) * eps, out);
+            for (index_t i = 0; i < node.count; ++i)
+                if (!(out[i] > bound))
+                    out[i] = detail::kd_distance<n_dims, coord_t>(metric, points_[node.first + i], center);
+        }
+    };
+
+
+    /// Storage layouts for barn::kd_tree.
+    namespace kd_layout {
+
+        /** One shared_ptr-linked heap object per node. Default.
+        */
+        struct linked {
+            template< typename data_t, size_t n_dims>
+            using storage = kd_linked_storage<data_t, n_dims>;
+        };
+
+        /** All nodes in one contiguous index-linked array, coordinates stored structure-of-arrays.
+        */
+        struct flat {
+            template< typename data_t, size_t n_dims>
+            using storage = kd_flat_storage<data_t, n_dims>;
+        };
+
+    } // END namespace kd_layout
+
+
+
+    /** Implements a kd-tree for fast region search.
+    */
+    template<
+        typename data_t /*data type*/,
+        size_t n_dims = 2 /*number of dimensions of the data type*/,
+        typename layout_t = kd_layout::linked /*node storage layout, see barn::kd_layout*/,
+        typename metric_t = kd_metric::l2 /*distance metric, see barn::kd_metric*/>
+    class kd_tree {
+        static_assert(n_dims > 0 && n_dims < 256, "nodes store their splitting axis in 8 bits");
+
+    public: // inner typedefs
+        using storage_t = typename layout_t::template storage<data_t, n_dims>;
+        using element_t = typename storage_t::element_t;   ///< data_t, or const data_t for read-only layouts
+        using node_t = typename storage_t::node_t;
+        using node_ptr = typename storage_t::node_ptr;
+        using node_handle = typename storage_t::node_handle;
+        using iterator = typename storage_t::iterator;
+        using const_iterator = typename storage_t::const_iterator;
+        using coord_t = typename storage_t::coord_t;
+        using box_t = typename storage_t::box_t;
+        using pair_t = std::pair<element_t*, element_t*>;
+
+        /// Maximum number of queries k_nearest_join() answers with one traversal.
+        static constexpr size_t knn_join_group_size = 16;
+
+    private: // inner typedefs
+        using neighbor_t = std::pair<coord_t /*reduced distance*/, element_t*>;
+        using queued_node_t = std::pair<coord_t /*reduced distance of the bounding box*/, node_handle>;
+
+        /** A pair of subtrees of a dual-tree join whose point pairs are still to be found.
+        A self task joins the subtree of a with itself, finding every unordered pair once.
+        */
+        struct join_task_t {
+            node_handle a;  ///< the subtree in this tree
+            node_handle b;  ///< the subtree in the other tree; unused for self tasks
+            bool self;      ///< whether the task joins a with itself
+        };
+
+        /** Per-thread buffers of k_nearest_join(), reused across the query groups.
+        */
+        struct knn_join_scratch_t {
+            std::vector<std::vector<neighbor_t>> heaps;     ///< the max-heap of every query of the group
+            std::vector<std::uint32_t> active;              ///< the queries of the visited nodes, see knn_join_step()
+        };
+
+        /** A compaction running on a background thread, plus the mutations to replay on its result.
+        Erased elements are logged as a whole, so replaying erases the same element among ones with equal coordinates,
+        see detail::kd_same_element().
+        Copies of a tree do not take over its running compaction.
+        */
+        struct compaction_t {
+            std::future<storage_t> result;                  ///< the compacted nodes; valid while a compaction runs
+            std::vector<std::pair<bool, data_t>> log;       ///< inserted (true) and erased (false) elements since it started
+
+            compaction_t() = default;
+            compaction_t(compaction_t&&) = default;
+            compaction_t& operator=(compaction_t&&) = default;
+            compaction_t(const compaction_t&) {}
+            compaction_t& operator=(const compaction_t&) { result = std::future<storage_t>(); log.clear(); return *this; }
+        };
+
+    public: // inner classes
+
+        /** Yields the data elements in ascending distance to a center, searching only as much of the tree as it is advanced.
+        Keeps the pending nodes, by the distances of their bounding boxes, and the points of the checked nodes in one
+        min-heap. A point on top of it is no farther than anything left, so it is the next one.
+        Invalidated by any change of the tree, including the end of a background compaction.
+        */
+        class nearest_iterator {
+
+        public: // inner typedefs
+            using iterator_category = std::input_iterator_tag;
+            using value_type = data_t;
+            using difference_type = std::ptrdiff_t;
+            using pointer = element_t*;
+            using reference = element_t&;
+
+        private: // inner typedefs
+
+            /// A pending node, or a point of a checked node if point is set.
+            struct entry_t {
+                coord_t distance;   ///< reduced distance of the point, or of the node's bounding box
+                node_handle node;   ///< the node, or the node holding the point
+                element_t* point;   ///< the point, or nullptr
+            };
+
+        private: // vars
+            const kd_tree* tree_ = nullptr;     ///< the searched tree
+            data_t center_;                     ///< the center
+            std::vector<entry_t> heap_;         ///< pending nodes and points, closest on top
+
+        public: // ctors
+
+            /** Creates an end iterator.
+            */
+            nearest_iterator() = default;
+
+            /** Creates an iterator at the element of the given tree closest to the given center.
+            */
+            nearest_iterator(const kd_tree& tree, const data_t& center)
+                : tree_(&tree), center_(center) {
+                const storage_t& storage = tree.storage_;
+                if (tree.size() > 0)
+                    push({ storage.bounds(storage.root()).min_distance(tree.metric_, center), storage.root(), nullptr });
+                settle();
+            }
+
+        public: // operations
+
+            // increment operations
+            inline nearest_iterator& operator++() { pop(); settle(); return *this; } // prefix++
+            inline nearest_iterator  operator++(int) { nearest_iterator tmp(*this); ++(*this); return tmp; } // postfix++
+
+            // equality / inequality operations; iterators at the same tree's same element and all end iterators are equal
+            inline bool operator==(const nearest_iterator& other) const {
+                return heap_.empty() ? other.heap_.empty()
+                    : !other.heap_.empty() && tree_ == other.tree_ && heap_.size() == other.heap_.size() && heap_.front().point == other.heap_.front().point;
+            }
+            inline bool operator!=(const nearest_iterator& other) const { return !(*this == other); }
+
+            // dereference operations
+            inline element_t& operator*() const { return *heap_.front().point; }
+            inline element_t* operator->() const { return heap_.front().point; }
+
+            /** Returns the distance of the current element to the center.
+            */
+            inline coord_t distance() const {
+                return tree_->metric_.from_reduced(heap_.front().distance);
+            }
+
+        private: // helpers
+
+            inline void push(const entry_t& e) {
+                heap_.push_back(e);
+                std::push_heap(heap_.begin(), heap_.end(), farther);
+            }
+
+            inline void pop() {
+                std::pop_heap(heap_.begin(), heap_.end(), farther);
+                heap_.pop_back();
+            }
+
+            /** Checks pending nodes until a point is on top of the heap, or nothing is left.
+            */
+            void settle() {
+                std::array<coord_t, storage_t::max_bucket_size> dist;
+                while (!heap_.empty() && heap_.front().point == nullptr) {
+                    const storage_t& storage = tree_->storage_;
+                    const node_handle n = heap_.front().node;
+                    pop();
+
+                    const size_t count = storage.distances(n, center_, tree_->metric_, dist.data());
+                    for (size_t i = 0; i < count; ++i)
+                        if (!storage.is_erased(n, i))
+                            push({ dist[i], n, &storage.point(n, i) });
+                    for (const node_handle child : { storage.left(n), storage.right(n) })
+                        if (!storage_t::is_null(child) && storage.subtree_size(child) > 0)
+                            push({ storage.bounds(child).min_distance(tree_->metric_, center_), child, nullptr });
+                }
+            }
+
+            /** Orders the entries so that a heap yields the closest first, points before nodes at the same distance.
+            */
+            static inline bool farther(const entry_t& a, const entry_t& b) {
+                return a.distance > b.distance || (!(b.distance > a.distance) && a.point == nullptr && b.point != nullptr);
+            }
+        };
+
+    private: // vars
+
+        storage_t storage_;         ///< the nodes
+        metric_t metric_;           ///< the distance metric
+        compaction_t compaction_;   ///< the running background compaction, if any
+
+    public: // ctors & dtor
+
+        /** Creates an empty tree.
+        */
+        kd_tree() noexcept
+        {}
+
+        /** Creates an empty tree that measures distances with the given metric.
+        */
+        explicit kd_tree(const metric_t& metric)
+            : metric_(metric)
+        {}
+
+        /** Creates an empty tree whose inserts follow the given parameters, e.g. kd_build_options::balance.
+        */
+        explicit kd_tree(const kd_build_options& options, const metric_t& metric = metric_t())
+            : metric_(metric) {
+            storage_.set_options(options);
+        }
+
+        /** Creates a balanced tree from the given elements.
+        */
+        template< typename iter_t>
+        kd_tree(const iter_t start, const iter_t end, const metric_t& metric = metric_t())
+            : metric_(metric) {
+            storage_.build(start, end);
+        }
+
+        /** Creates a balanced tree from the given elements with the given construction parameters,
+        e.g. concurrently on several threads. The resulting tree is the same as the one built sequentially.
+        */
+        template< typename iter_t>
+        kd_tree(const iter_t start, const iter_t end, const kd_build_options& options, const metric_t& metric = metric_t())
+            : metric_(metric) {
+            storage_.build(start, end, options);
+        }
+
+    public: // methods
+
+        /** Inserts a node into the tree structure.
+        Keeps the tree's depth logarithmic by rebuilding unbalanced subtrees if the tree was created with
+        kd_build_options::balance, at an amortized cost of O(log^2 n) per insert.
+        CAUTION: Without kd_build_options::balance the tree may not be balanced.
+        CAUTION: Rebuilding moves points, pointers to the points of rebuilt subtrees are invalidated,
+        and so are all pointers if a finished background compaction is swapped in.
+        */
+        inline node_ptr insert(const data_t& data) {
+            const data_t copy(data); // data may belong to the nodes swapped out below
+            finish_compaction(false);
+            if (compaction_.result.valid())
+                compaction_.log.emplace_back(true, copy);
+            return storage_.insert(copy);
+        }
+
+        /** Erases one data element with the same coordinates as the given one.
+        The element is only marked as erased; queries skip it and the tree's subtree sizes no longer count it.
+        Once the share of erased elements exceeds kd_build_options::max_erased, the tree is rebuilt without them,
+        on a background thread for large trees. Queries never wait for that; the rebuilt tree is swapped in
+        by a later insert() or erase() once it is finished, or by compact().
+        CAUTION: Swapping in the rebuilt tree invalidates all pointers to elements.
+        @return Returns whether such an element was found.
+        */
+        inline bool erase(const data_t& data) {
+            const data_t copy(data);
+            return erase_matching(copy, [](const data_t&) { return true; });
+        }
+
+        /** Erases the given data element, e.g. one retrieved by a query. See erase(const data_t&).
+        @return Returns whether the element was found.
+        */
+        inline bool erase(const data_t* element) {
+            assert(element != nullptr && "element must not be null");
+            const data_t copy(*element);
+            return erase_matching(copy, [element](const data_t& candidate) { return &candidate == element; });
+        }
+
+        /** Moves elements to new values, e.g. points that moved a little since the last frame, at a cost proportional to
+        the number of moved elements instead of rebuilding the tree.
+        Keeps the tree's topology for elements that stay on their side of every splitting plane above them and refits the
+        bounding boxes on their paths. For elements that cross a plane, the smallest subtree whose cell holds the new value
+        is rebuilt if it holds at most kd_build_options::max_refit_rebuild elements; elements crossing planes higher up
+        are erased and inserted anew, like with erase() and insert().
+        @param first, last A range of pairs of an element of the tree, e.g. one retrieved by a query, and its new value,
+        e.g. std::pair<const data_t*, data_t>. Elements not found in the tree are skipped.
+        CAUTION: Rebuilding moves elements, pointers to the elements of rebuilt subtrees are invalidated, and so are all
+        pointers if the tree is compacted.
+        @return Returns the number of elements found.
+        */
+        template< typename iter_t>
+        size_t refit(const iter_t first, const iter_t last) {
+            std::vector<data_t> reinserts;
+            // logs the moved element as a whole, so a running compaction replays the move on that very element
+            const size_t ret = storage_.refit(first, last, reinserts, [this](const data_t& from, const data_t& to) {
+                if (compaction_.result.valid()) {
+                    compaction_.log.emplace_back(false, from);
+                    compaction_.log.emplace_back(true, to);
+                }
+            });
+            for (const data_t& data : reinserts)
+                storage_.insert(data);
+            finish_compaction(false);
+            compact_if_needed();
+            return ret;
+        }
+
+        /** Rebuilds the tree without its erased elements now.
+        Waits for a running background compaction and swaps it in instead, if there is one.
+        CAUTION: Invalidates all pointers to elements.
+        */
+        void compact() {
+            finish_compaction(true);
+            storage_.compact();
+        }
+
+        /** Retrieves all data elements that lie in the circle given by the center and radius parameters.
+        The circle is a ball of the tree's metric; the radius is given as a real, not a reduced, distance.
+        just bragging about the type of radius.. I know, a plain template param would do ...maybe better
+        */
+        inline std::vector<element_t*> find_points_within_range(const data_t& center, const typename std::remove_reference<decltype(center[0])>::type radius) const {
+            std::vector<element_t*> ret;
+            find_points_within_range(center, radius, std::back_inserter(ret));
+            return ret;
+        }
+
+        /** Writes pointers to all data elements that lie in the circle given by the center and radius parameters
+        to the given output iterator, e.g. into a caller-owned buffer that is reused across queries.
+        @return Returns the output iterator past the last written element.
+        */
+        template< typename out_iter_t>
+        inline out_iter_t find_points_within_range(const data_t& center, const coord_t radius, out_iter_t out) const {
+            for_each_in_range(center, radius, [&out](element_t& data) { *out++ = &data; });
+            return out;
+        }
+
+        /** Calls the given visitor with every data element that lies in the circle given by the center and radius parameters.
+        Traverses the tree with an explicit stack; does not allocate unless the tree is deeper than kd_stack's inline capacity.
+        @param f Callable with the signature void(element_t&).
+        */
+        template< typename visitor_t>
+        inline void for_each_in_range(const data_t& center, const coord_t radius, visitor_t&& f) const {
+            BARN_KD_STATS(detail::kd_begin_query_stats();)
+            if (!storage_t::is_null(storage_.root()))
+                do_for_each_in_range(center, metric_.to_reduced(radius), metric_, storage_.root(), f);
+        }
+
+        /** Retrieves all data elements that lie in the axis-aligned box given by its minimum and maximum corner,
+        boundary included.
+        */
+        inline std::vector<element_t*> find_points_in_box(const data_t& min_corner, const data_t& max_corner) const {
+            std::vector<element_t*> ret;
+            find_points_in_box(min_corner, max_corner, std::back_inserter(ret));
+            return ret;
+        }
+
+        /** Writes pointers to all data elements that lie in the axis-aligned box given by its minimum and maximum corner
+        to the given output iterator.
+        @return Returns the output iterator past the last written element.
+        */
+        template< typename out_iter_t>
+        inline out_iter_t find_points_in_box(const data_t& min_corner, const data_t& max_corner, out_iter_t out) const {
+            for_each_in_box(min_corner, max_corner, [&out](element_t& data) { *out++ = &data; });
+            return out;
+        }
+
+        /** Calls the given visitor with every data element that lies in the axis-aligned box given by its minimum
+        and maximum corner. Subtrees whose bounding box lies within the query box are visited without further tests.
+        @param f Callable with the signature void(element_t&).
+        */
+        template< typename visitor_t>
+        void for_each_in_box(const data_t& min_corner, const data_t& max_corner, visitor_t&& f) const {
+            if (storage_t::is_null(storage_.root()))
+                return;
+
+            BARN_KD_STATS(kd_query_stats& stats = detail::kd_begin_query_stats();)
+            const box_t query(min_corner, max_corner);
+            detail::kd_stack<node_handle> stack;
+            stack.push(storage_.root());
 
+            while (!stack.empty()) {
+                const node_handle current_node = stack.pop();
+                const box_t& bounds = storage_.bounds(current_node);
+                if (storage_.subtree_size(current_node) == 0 || !query.intersects(bounds)) {
+                    BARN_KD_STATS(++stats.subtrees_pruned;)
+                    continue;
+                }
+                BARN_KD_STATS(++stats.nodes_visited;)
+                if (query.contains(bounds)) {
+                    for_each_in_subtree(current_node, f);
+                    continue;
+                }
 
-    /** Implements a kd-tree for fast region search.
-    */
-    template< typename data_t /*data type*/, size_t n_dims = 2 /*number of dimensions of the data type*/>
-    class kd_tree {
-    public: // inner typedefs
-        struct node_t;
-        using node_ptr = std::shared_ptr<node_t>;
+                BARN_KD_STATS(stats.distance_evaluations += storage_.point_count(current_node);)
+                for (size_t i = 0; i < storage_.point_count(current_node); ++i)
+                    if (query.contains(storage_.point(current_node, i)) && !storage_.is_erased(current_node, i))
+                        f(storage_.point(current_node, i));
+                push_children(stack, current_node);
+                BARN_KD_STATS(stats.max_stack_depth = std::max(stats.max_stack_depth, stack.size());)
+            }
+        }
 
-    public: // inner classes
+        /** Counts the data elements that lie in the axis-aligned box given by its minimum and maximum corner,
+        boundary included. Subtrees whose bounding box lies within the query box are counted by their stored size,
+        which makes the query roughly O(log n) instead of O(number of results).
+        */
+        size_t count_in_box(const data_t& min_corner, const data_t& max_corner) const {
+            if (storage_t::is_null(storage_.root()))
+                return 0;
 
-        /** Represents nodes in the kd-tree.
+            BARN_KD_STATS(kd_query_stats& stats = detail::kd_begin_query_stats();)
+            const box_t query(min_corner, max_corner);
+            size_t ret = 0;
+            detail::kd_stack<node_handle> stack;
+            stack.push(storage_.root());
+
+            while (!stack.empty()) {
+                const node_handle current_node = stack.pop();
+                const box_t& bounds = storage_.bounds(current_node);
+                if (storage_.subtree_size(current_node) == 0 || !query.intersects(bounds)) {
+                    BARN_KD_STATS(++stats.subtrees_pruned;)
+                    continue;
+                }
+                BARN_KD_STATS(++stats.nodes_visited;)
+                if (query.contains(bounds)) {
+                    ret += storage_.subtree_size(current_node);
+                    continue;
+                }
+
+                BARN_KD_STATS(stats.distance_evaluations += storage_.point_count(current_node);)
+                for (size_t i = 0; i < storage_.point_count(current_node); ++i)
+                    ret += query.contains(storage_.point(current_node, i)) && !storage_.is_erased(current_node, i);
+                push_children(stack, current_node);
+                BARN_KD_STATS(stats.max_stack_depth = std::max(stats.max_stack_depth, stack.size());)
+            }
+            return ret;
+        }
+
+        /** Counts the data elements that lie in the circle given by the center and radius parameters,
+        i.e. the ones find_points_within_range() would retrieve. Subtrees whose bounding box lies within the circle
+        are counted by their stored size.
         */
-        struct node_t {
-            data_t data;                ///< data field
-            node_ptr parent = nullptr;  ///< parent
-            node_ptr left = nullptr;    ///< left child
-            node_ptr right = nullptr;   ///< right child
-        };
+        size_t count_in_range(const data_t& center, const coord_t radius) const {
+            if (storage_t::is_null(storage_.root()))
+                return 0;
 
-        /** Forward iterator.
-        Iterates in a depth-first-manner from the root node via the left side to the right leaves leaves.
-        TODO make bidirectional
-        TODO add const_iterator
+            BARN_KD_STATS(kd_query_stats& stats = detail::kd_begin_query_stats();)
+            const coord_t reduced_radius = metric_.to_reduced(radius);
+            std::array<coord_t, storage_t::max_bucket_size> dist;
+            size_t ret = 0;
+            detail::kd_stack<node_handle> stack;
+            stack.push(storage_.root());
+
+            while (!stack.empty()) {
+                const node_handle current_node = stack.pop();
+                const box_t& bounds = storage_.bounds(current_node);
+                if (storage_.subtree_size(current_node) == 0 || bounds.min_distance(metric_, center) > reduced_radius) {
+                    BARN_KD_STATS(++stats.subtrees_pruned;)
+                    continue;
+                }
+                BARN_KD_STATS(++stats.nodes_visited;)
+                if (bounds.max_distance(metric_, center) <= reduced_radius) {
+                    ret += storage_.subtree_size(current_node);
+                    continue;
+                }
+
+                const size_t count = storage_.distances(current_node, center, metric_, dist.data(), reduced_radius);
+                BARN_KD_STATS(stats.distance_evaluations += count;)
+                for (size_t i = 0; i < count; ++i)
+                    ret += dist[i] <= reduced_radius && !storage_.is_erased(current_node, i);
+                push_children(stack, current_node);
+                BARN_KD_STATS(stats.max_stack_depth = std::max(stats.max_stack_depth, stack.size());)
+            }
+            return ret;
+        }
+
+        /** Retrieves the k data elements closest to the given center, sorted by ascending distance.
+        Fewer elements are returned if the tree holds less than k elements.
         */
-        class iterator : public std::iterator<std::forward_iterator_tag, node_ptr> {
+        std::vector<element_t*> find_k_nearest(const data_t& center, const size_t k) const {
+            std::vector<neighbor_t> heap;
+            find_k_nearest(center, k, heap);
 
-        private: // vars
-            node_ptr curr_ = nullptr;
-            node_ptr prev_ = nullptr;
+            std::vector<element_t*> ret;
+            ret.reserve(heap.size());
+            for (const auto& n : heap)
+                ret.push_back(n.second);
+            return ret;
+        }
 
-        public: // operations
+        /** Retrieves k data elements close to the given center, sorted by ascending distance, within the
+        accuracy budget of the given search options.
+        Fewer elements are returned if the tree holds less than k elements.
+        */
+        std::vector<element_t*> find_k_nearest(const data_t& center, const size_t k, const kd_search_options& search) const {
+            std::vector<neighbor_t> heap;
+            std::vector<queued_node_t> queue;
+            find_k_nearest(center, k, search, heap, queue);
 
-            // ctors
-            iterator() noexcept {}
-            iterator(node_ptr n) : curr_(n), prev_(curr_ == nullptr ? nullptr : curr_->parent) {}
+            std::vector<element_t*> ret;
+            ret.reserve(heap.size());
+            for (const auto& n : heap)
+                ret.push_back(n.second);
+            return ret;
+        }
 
-            // increment / decrement operations
-            inline iterator& operator++() { return advance(); } // prefix++
-            inline iterator  operator++(int) { iterator tmp(*this); ++(*this); return tmp; } // postfix++
+        /** Retrieves the data element closest to the given center.
+        @return Returns nullptr if the tree is empty.
+        */
+        inline element_t* find_nearest(const data_t& center) const {
+            BARN_KD_STATS(detail::kd_begin_query_stats();)
+            neighbor_t best(std::numeric_limits<coord_t>::max(), nullptr);
+            std::array<coord_t, storage_t::max_bucket_size> dist;
+            do_find_nearest(center, storage_.root(), best, dist.data());
+            return best.second;
+        }
 
-            // equality / inequality operations
-            inline bool operator==(const iterator& other) const { return  curr_ == other.curr_ && prev_ == other.prev_; }
-            inline bool operator!=(const iterator& other) const { return  curr_ != other.curr_ || prev_ != other.prev_; }
+        /** Returns an iterator over the data elements in ascending distance to the given center.
+        It searches the tree lazily, as far as it is advanced, so consumers may stop at any point.
+        */
+        inline nearest_iterator nearest_begin(const data_t& center) const {
+            return nearest_iterator(*this, center);
+        }
 
-            // dereference operations
-            inline node_t& operator*() { return *curr_; }
-            inline node_ptr operator->() { return curr_; }
+        /** Returns the end of the iterations started by nearest_begin().
+        */
+        inline nearest_iterator nearest_end() const {
+            return nearest_iterator();
+        }
 
-            /** Makes the iterator a canonical end iterator.
-            Functions main purpose is not breaking client code in case of refactoring.
-            */
-            inline iterator& make_end() noexcept {
-                curr_ = nullptr;
-                prev_ = nullptr;
-                return *this;
-            }
+        /** Answers a radius query for every center in [first, last), spread across threads.
+        @return Returns the results in CSR layout, grouped in the order of the given centers.
+        */
+        template< typename iter_t>
+        kd_batch_result<element_t> find_points_within_range(
+            const iter_t first,
+            const iter_t last,
+            const coord_t radius,
+            const kd_batch_options& options = kd_batch_options()) const {
 
-        private: // helpers
+            const size_t n = static_cast<size_t>(std::distance(first, last));
+            const std::vector<size_t> order = batch_order(first, n, options);
+            const size_t grain_size = std::max(options.grain_size, size_t(1));
+            const size_t n_chunks = (n + grain_size - 1) / grain_size;
 
-            /** Traverses the iterator to the next node in a depth-first-manner.
-            */
-            iterator& advance() {
+            // every thread collects its results in its own buffer: per query its index and result count
+            struct thread_buffer_t {
+                std::vector<std::pair<size_t, size_t>> queries;
+                std::vector<element_t*> neighbors;
+            };
+            std::vector<thread_buffer_t> buffers(std::max(size_t(1), std::min(options.n_threads, n_chunks)));
 
-                if (curr_->left == nullptr && curr_->right == nullptr) {
-                    prev_ = curr_;
-                    curr_ = curr_->parent;
-                    return advance();
+            detail::parallel_for(n_chunks, buffers.size(), [&](const size_t chunk, const size_t thread) {
+                thread_buffer_t& buffer = buffers[thread];
+                const size_t chunk_end = std::min(n, (chunk + 1) * grain_size);
+                for (size_t i = chunk * grain_size; i < chunk_end; ++i) {
+                    const size_t query = order.empty() ? i : order[i];
+                    const size_t count_before = buffer.neighbors.size();
+                    find_points_within_range(first[query], radius, std::back_inserter(buffer.neighbors));
+                    buffer.queries.emplace_back(query, buffer.neighbors.size() - count_before);
                 }
+            });
+
+            kd_batch_result<element_t> ret;
+            ret.offsets.assign(n + 1, 0);
+            for (const auto& buffer : buffers)
+                for (const auto& q : buffer.queries)
+                    ret.offsets[q.first + 1] = q.second;
+            for (size_t i = 0; i < n; ++i)
+                ret.offsets[i + 1] += ret.offsets[i];
 
-                if (prev_ == curr_->parent) {
-                    prev_ = curr_;
-                    curr_ = curr_->left;
-                    return *this;
+            ret.neighbors.resize(ret.offsets[n]);
+            detail::parallel_for(buffers.size(), buffers.size(), [&](const size_t b, size_t) {
+                auto src = buffers[b].neighbors.begin();
+                for (const auto& q : buffers[b].queries) {
+                    std::copy(src, src + q.second, ret.neighbors.begin() + ret.offsets[q.first]);
+                    src += q.second;
                 }
-                else if (prev_ == curr_->left) {
-                    prev_ == curr_;
-                    curr_ = curr_->right;
-                    return *this;
+            });
+            return ret;
+        }
+
+        /** Answers a k-nearest-neighbor query for every center in [first, last), spread across threads,
+        within the accuracy budget of the given search options.
+        @return Returns the results in CSR layout, grouped in the order of the given centers,
+        each query's results sorted by ascending distance.
+        */
+        template< typename iter_t>
+        kd_batch_result<element_t> find_k_nearest(
+            const iter_t first,
+            const iter_t last,
+            const size_t k,
+            const kd_batch_options& options = kd_batch_options(),
+            const kd_search_options& search = kd_search_options()) const {
+
+            const size_t n = static_cast<size_t>(std::distance(first, last));
+            const std::vector<size_t> order = batch_order(first, n, options);
+            const size_t grain_size = std::max(options.grain_size, size_t(1));
+            const size_t n_chunks = (n + grain_size - 1) / grain_size;
+
+            // every query yields the same number of results, so the offsets are known upfront
+            std::vector<std::vector<neighbor_t>> heaps(std::max(size_t(1), std::min(options.n_threads, n_chunks)));
+            std::vector<std::vector<queued_node_t>> queues(heaps.size());
+            std::vector<size_t> counts(n);
+            kd_batch_result<element_t> ret;
+            ret.neighbors.resize(n * k);
+
+            detail::parallel_for(n_chunks, heaps.size(), [&](const size_t chunk, const size_t thread) {
+                std::vector<neighbor_t>& heap = heaps[thread];
+                const size_t chunk_end = std::min(n, (chunk + 1) * grain_size);
+                for (size_t i = chunk * grain_size; i < chunk_end; ++i) {
+                    const size_t query = order.empty() ? i : order[i];
+                    if (search.exact())
+                        find_k_nearest(first[query], k, heap);
+                    else
+                        find_k_nearest(first[query], k, search, heap, queues[thread]);
+                    for (size_t j = 0; j < heap.size(); ++j)
+                        ret.neighbors[query * k + j] = heap[j].second;
+                    counts[query] = heap.size();
                 }
-                else if (prev_ == curr_->right) /*prev_ == curr_->right*/ {
-                    if (curr_->parent == nullptr)
-                        return make_end();
-                    prev_ = curr_;
-                    curr_ = curr_->parent;
-                    return advance();
+            });
+
+            set_offsets(ret, counts, k);
+            return ret;
+        }
+
+        /** Finds every pair of data elements of the tree within the given radius of each other, e.g. collision candidates.
+        Traverses pairs of subtrees instead of answering one radius query per element, skipping pairs whose bounding
+        boxes are too far apart and taking subtrees whose bounding boxes are close enough as a whole. The pairs below
+        the top levels of the tree are found in parallel, every thread into its own buffer.
+        @return Returns every unordered pair of distinct elements once, in no particular order.
+        */
+        std::vector<pair_t> radius_self_join(const coord_t radius, const kd_batch_options& options = kd_batch_options()) const {
+            if (storage_t::is_null(storage_.root()))
+                return std::vector<pair_t>();
+            return join(*this, join_task_t{ storage_.root(), storage_.root(), true }, metric_.to_reduced(radius), options);
+        }
+
+        /** Finds every pair of a data element of this tree and one of the other tree within the given radius of each other,
+        by the metric of this tree. Traverses pairs of subtrees in parallel like radius_self_join().
+        @return Returns the pairs, the elements of this tree first, in no particular order. Joining a tree with itself
+        yields every element paired with itself and every other pair in both orders.
+        */
+        std::vector<pair_t> radius_join(const kd_tree& other, const coord_t radius, const kd_batch_options& options = kd_batch_options()) const {
+            if (storage_t::is_null(storage_.root()) || storage_t::is_null(other.storage_.root()))
+                return std::vector<pair_t>();
+            return join(other, join_task_t{ storage_.root(), other.storage_.root(), false }, metric_.to_reduced(radius), options);
+        }
+
+        /** For every data element of the given query tree, finds the k data elements of this tree closest to it, by the metric
+        of this tree, e.g. to match the points of one scan against another.
+        Traverses both trees together: cuts the query tree into subtrees of at most knn_join_group_size elements and
+        walks this tree once for each, pruning node pairs. A node of this tree is skipped for a query subtree if the
+        distance between their bounding boxes is no less than the largest distance of the subtree's k-th neighbors so far.
+        Otherwise it is visited once for all queries of the subtree that may still find neighbors below it, i.e. that lie
+        on its side of the parent's splitting plane or whose k-th neighbor so far lies beyond it. The bounding box of a
+        query subtree shrinks to the queries still visiting on the way down. The query subtrees are spread across threads.
+        @param options Only n_threads is considered.
+        @return Returns the results in CSR layout, grouped like kd_batch_result::queries, each query's results sorted by
+        ascending distance. Joining a tree with itself finds every element as one of its own nearest neighbors.
+        */
+        kd_batch_result<element_t> k_nearest_join(const kd_tree& queries, const size_t k, const kd_batch_options& options = kd_batch_options()) const {
+            BARN_KD_STATS(detail::kd_begin_query_stats();)
+            kd_batch_result<element_t> ret;
+            std::vector<size_t> groups(1, 0);
+            queries.collect_query_groups(knn_join_group_size, ret.queries, groups);
+
+            const size_t n = ret.queries.size();
+            const size_t n_groups = groups.size() - 1;
+            std::vector<size_t> counts(n, 0);
+            ret.neighbors.resize(n * k);
+            if (k > 0 && size() > 0) {
+                std::vector<knn_join_scratch_t> scratch(std::max(size_t(1), std::min(options.n_threads, n_groups)));
+                detail::parallel_for(n_groups, scratch.size(), [&](const size_t group, const size_t thread) {
+                    BARN_KD_STATS(detail::kd_begin_query_stats();)
+                    const size_t first = groups[group];
+                    const size_t count = groups[group + 1] - first;
+                    std::vector<std::vector<neighbor_t>>& group_heaps = scratch[thread].heaps;
+                    std::vector<std::uint32_t>& active = scratch[thread].active;
+                    group_heaps.resize(std::max(group_heaps.size(), count));
+                    active.clear();
+                    for (size_t q = 0; q < count; ++q) {
+                        group_heaps[q].clear();
+                        active.push_back(static_cast<std::uint32_t>(q));
+                    }
+
+                    std::array<coord_t, storage_t::max_bucket_size> dist;
+                    knn_join_step(&ret.queries[first], k, storage_.root(), group_heaps.data(), active, 0, count, dist.data());
+                    for (size_t q = 0; q < count; ++q) {
+                        std::vector<neighbor_t>& heap = group_heaps[q];
+                        std::sort_heap(heap.begin(), heap.end(), neighbor_less);
+                        for (size_t j = 0; j < heap.size(); ++j)
+                            ret.neighbors[(first + q) * k + j] = heap[j].second;
+                        counts[first + q] = heap.size();
+                    }
+                });
+            }
+            set_offsets(ret, counts, k);
+            return ret;
+        }
+
+        /** Calls f(element) with every data element, like iterating the tree read-only: in memory order for flat and
+        mapped trees, in depth-first pre-order for linked ones. Uses neither recursion nor, for linked trees, a stack.
+        */
+        template< typename func_t>
+        inline void for_each_point(func_t&& f) const {
+            storage_.for_each_point(f);
+        }
+
+        /** Calls f(element, thread) with every data element, spread across threads; thread is a dense index in
+        [0, n_threads), e.g. for per-thread accumulators. The order of the elements is unspecified.
+        Expands the top levels of the tree breadth-first on the calling thread, which passes their own elements with
+        thread 0, until there are enough subtrees to spread across the threads, then walks those with explicit stacks.
+        Single threaded, walks the tree like for_each_point(f).
+        */
+        template< typename func_t>
+        void for_each_point(func_t&& f, const kd_batch_options& options) const {
+            const size_t n_threads = std::max(options.n_threads, size_t(1));
+            if (n_threads == 1) {
+                storage_.for_each_point([&f](const data_t& element) { f(element, size_t(0)); });
+                return;
+            }
+
+            std::vector<node_handle> tasks;
+            const node_handle root = storage_.root();
+            if (!storage_t::is_null(root) && storage_.subtree_size(root) > 0)
+                tasks.push_back(root);
+            while (!tasks.empty() && tasks.size() < 16 * n_threads) {
+                std::vector<node_handle> next;
+                for (const node_handle n : tasks) {
+                    for (size_t i = 0; i < storage_.point_count(n); ++i)
+                        if (!storage_.is_erased(n, i))
+                            f(static_cast<const data_t&>(storage_.point(n, i)), size_t(0));
+                    for (const node_handle child : { storage_.left(n), storage_.right(n) })
+                        if (!storage_t::is_null(child) && storage_.subtree_size(child) > 0)
+                            next.push_back(child);
                 }
+                tasks.swap(next);
             }
-        };
 
-    private: // vars
+            detail::parallel_for(tasks.size(), n_threads, [&](const size_t task, const size_t thread) {
+                auto visit = [&f, thread](const data_t& element) { f(element, thread); };
+                for_each_in_subtree(tasks[task], visit);
+            });
+        }
 
-        node_ptr root_ = nullptr;    ///< the root node
+        /** Returns the number of data elements in the tree.
+        */
+        inline size_t size() const noexcept {
+            return storage_t::is_null(storage_.root()) ? 0 : storage_.subtree_size(storage_.root());
+        }
 
-    public: // ctors & dtor
+        /** Returns the number of nodes on the longest path from the root to a leaf, 0 for an empty tree.
+        */
+        size_t depth() const {
+            size_t ret = 0;
+            detail::kd_stack<std::pair<node_handle, size_t>> stack;
+            if (!storage_t::is_null(storage_.root()))
+                stack.push({ storage_.root(), 1 });
+            while (!stack.empty()) {
+                const auto current = stack.pop();
+                ret = std::max(ret, current.second);
+                if (!storage_t::is_null(storage_.left(current.first)))
+                    stack.push({ storage_.left(current.first), current.second + 1 });
+                if (!storage_t::is_null(storage_.right(current.first)))
+                    stack.push({ storage_.right(current.first), current.second + 1 });
+            }
+            return ret;
+        }
 
-        /** Creates an empty tree.
+        /** Gives access to the node storage, e.g. for serialization.
+        CAUTION: Modifying the storage directly bypasses a running background compaction.
         */
-        kd_tree() noexcept
-        {}
+        inline const storage_t& storage() const noexcept { return storage_; }
+        inline storage_t& storage() noexcept { return storage_; }
 
-        /** Creates a balanced tree from the given elements.
+        /** Returns the tree's distance metric.
         */
-        template< typename iter_t>
-        kd_tree(const iter_t start, const iter_t end) {
-            root_ = create_kd_node_hierarchy(start, end, 0);
+        inline const metric_t& metric() const noexcept {
+            return metric_;
         }
 
-    public: // methods
+        /** Returns the number of bytes the tree's nodes and points occupy on the heap.
+        */
+        inline size_t memory_footprint() const {
+            return storage_.memory_footprint();
+        }
 
-        /** Inserts a node into the tree structure.
-        CAUTION: Tree may not be balanced.
+        /** Returns the shape of the tree: its depth and depth histogram, balance, erased elements and bytes used.
+        Traverses all nodes.
         */
-        inline node_ptr insert(const data_t& data) {
-            return do_insert(data, root_, nullptr, 0);
+        kd_tree_stats stats() const {
+            const size_t min_balanced_size = 16; // smaller subtrees are unbalanced by nature, e.g. a node with one child
+            kd_tree_stats ret;
+            ret.size = size();
+            ret.bytes = memory_footprint();
+            detail::kd_stack<std::pair<node_handle, size_t>> stack;
+            if (!storage_t::is_null(storage_.root()))
+                stack.push({ storage_.root(), 1 });
+
+            while (!stack.empty()) {
+                const auto current = stack.pop();
+                const node_handle n = current.first;
+                ++ret.nodes;
+                for (size_t i = 0; i < storage_.point_count(n); ++i)
+                    ret.erased += storage_.is_erased(n, i);
+
+                const node_handle left = storage_.left(n);
+                const node_handle right = storage_.right(n);
+                if (storage_t::is_null(left) && storage_t::is_null(right)) {
+                    if (ret.depth_histogram.size() < current.second)
+                        ret.depth_histogram.resize(current.second, 0);
+                    ++ret.depth_histogram[current.second - 1];
+                    continue;
+                }
+                const size_t child_size = std::max(
+                    storage_t::is_null(left) ? 0 : storage_.subtree_size(left),
+                    storage_t::is_null(right) ? 0 : storage_.subtree_size(right));
+                if (storage_.subtree_size(n) >= min_balanced_size)
+                    ret.balance = std::max(ret.balance, float(child_size) / storage_.subtree_size(n));
+                if (!storage_t::is_null(right))
+                    stack.push({ right, current.second + 1 });
+                if (!storage_t::is_null(left))
+                    stack.push({ left, current.second + 1 });
+            }
+            ret.depth = ret.depth_histogram.size();
+            return ret;
         }
 
-        /** Retrieves all data elements that lie in the circle given by the center and radius parameters.
-        just bragging about the type of radius.. I know, a plain template param would do ...maybe better
+        /** Returns the counters of the last query the calling thread ran on any kd_tree, see kd_query_stats.
+        Recorded by radius, box, nearest and k-nearest queries, and by every single query of a batch on the thread that
+        answers it; every task of a join counts as one query. All 0 unless BARN_KD_TREE_STATS is defined.
         */
-        inline std::vector<data_t*> find_points_within_range(const data_t& center, const typename std::remove_reference<decltype(center[0])>::type radius) const {
-            return do_find_points_within_range(center, radius, root_, 0);
+        static inline const kd_query_stats& last_query_stats() noexcept {
+            return detail::kd_thread_query_stats();
         }
 
         /** For debugging purposes.
         */
         std::ostream& __to_stream(std::ostream& os, const size_t layer = 0) {
-            if (root_->left != nullptr)
-                to_stream(os, root_->left, layer + 1);
-            os << root_->data << " layer: " << layer << "\n";
-            if (root_->right != nullptr)
-                to_stream(os, root_->right, layer + 1);
-
+            if (!storage_t::is_null(storage_.root()))
+                do_to_stream(os, storage_.root(), layer);
             return os;
         }
 
-        /** For debugging purposes.
+        // iterator methods; iterates the points read-only, see the storages' iterators
+        inline const_iterator begin() const { return storage_.begin(); }
+        inline const_iterator end() const { return storage_.end(); }
+
+    private: // helpers
+
+        /** Marks one element with the given coordinates for which match(element) holds as erased and
+        starts a compaction if too many elements are erased.
         */
-        std::ostream& __to_stream(std::ostream& os, node_ptr n, const size_t layer = 0) {
-            if (n->left != nullptr)
-                to_stream(os, n->left, layer + 1);
-            os << n->data << " layer: " << layer << "\n";
-            if (n->right != nullptr)
-                to_stream(os, n->right, layer + 1);
+        template< typename match_t>
+        bool erase_matching(const data_t& data, const match_t& match) {
+            const bool logging = compaction_.result.valid();
+            const bool erased = storage_.erase(data, [this, logging, &match](const data_t& candidate) {
+                if (!match(candidate))
+                    return false;
+                if (logging)
+                    compaction_.log.emplace_back(false, candidate);
+                return true;
+            });
+            if (!erased)
+                return false;
+            finish_compaction(false);
+            compact_if_needed();
+            return true;
+        }
 
-            return os;
+        /** Starts a compaction if the share of erased elements exceeds kd_build_options::max_erased and none is running.
+        */
+        inline void compact_if_needed() {
+            const kd_build_options& options = storage_.options();
+            const size_t n_erased = storage_.erased_count();
+            if (!compaction_.result.valid() && options.max_erased > 0.f && n_erased > options.max_erased * (n_erased + size()))
+                start_compaction();
         }
 
-        // iterator methods
-        inline iterator begin() { return iterator(root_); }
-        inline iterator end() { iterator i; return i.make_end(); }
+        /** Rebuilds the tree without its erased elements, on a background thread from a copy of the remaining
+        elements if the tree holds at least kd_build_options::grain_size elements.
+        */
+        void start_compaction() {
+            const kd_build_options options = storage_.options();
+            if (size() + storage_.erased_count() < options.grain_size) {
+                storage_.compact();
+                return;
+            }
 
-    private: // helpers
+            compaction_.result = std::async(std::launch::async, [options](std::vector<data_t> points) {
+                storage_t ret;
+                ret.build(points.begin(), points.end(), options);
+                return ret;
+            }, storage_.live_points());
+        }
 
-        /** Recursively creates a kd tree hierarchy from the elements in the given ranges.
+        /** Swaps in the result of the background compaction after replaying the mutations since it started.
+        @param wait Whether to wait for a running compaction; otherwise returns if it is not finished yet.
         */
-        template< typename iter_t>
-        node_ptr create_kd_node_hierarchy(const iter_t start, const iter_t end, size_t axis, const node_ptr& parent = nullptr) {
-            assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+        void finish_compaction(const bool wait) {
+            if (!compaction_.result.valid())
+                return;
+            if (!wait && compaction_.result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                return;
 
-            if (std::distance(start, end) < 1)
-                return nullptr;
+            storage_t compacted = compaction_.result.get();
+            for (const auto& mutation : compaction_.log) {
+                if (mutation.first)
+                    compacted.insert(mutation.second);
+                else
+                    compacted.erase(mutation.second, [&mutation](const data_t& candidate) {
+                        return detail::kd_same_element<n_dims>(candidate, mutation.second); });
+            }
+            compaction_.log.clear();
+            storage_ = std::move(compacted);
+        }
+
+        /** Collects the k nearest neighbors of the given center in the given buffer, sorted by ascending distance.
+        */
+        inline void find_k_nearest(const data_t& center, const size_t k, std::vector<neighbor_t>& heap) const {
+            BARN_KD_STATS(detail::kd_begin_query_stats();)
+            heap.clear();
+            heap.reserve(k);
+            std::array<coord_t, storage_t::max_bucket_size> dist;
+            if (k > 0)
+                do_find_k_nearest(center, k, storage_.root(), heap, dist.data());
+            std::sort_heap(heap.begin(), heap.end(), neighbor_less);
+        }
 
-            iter_t middle = std::next(start, std::distance(start, end) / 2);
+        /** Collects k neighbors of the given center in the given buffer within the accuracy budget of the given
+        search options, sorted by ascending distance.
+        Visits the nodes best bin first, i.e. in the order of their bounding boxes' distances to the center, keeping the
+        pending ones in the given min-heap. A node is skipped once 1 + epsilon times its distance is no closer than
+        the current k-th neighbor, and the search stops after checking the points of max_leaves nodes.
+        */
+        void find_k_nearest(
+            const data_t& center,
+            const size_t k,
+            const kd_search_options& search,
+            std::vector<neighbor_t>& heap,
+            std::vector<queued_node_t>& queue) const {
 
-            std::nth_element(
-                start,
-                middle,
-                end,
-                [&axis](const data_t& i, const data_t& j) { return i[axis] < j[axis]; });
+            BARN_KD_STATS(kd_query_stats& stats = detail::kd_begin_query_stats();)
+            heap.clear();
+            heap.reserve(k);
+            queue.clear();
+            if (k == 0 || size() == 0)
+                return;
 
-            axis = (axis + 1) % n_dims;
+            // reduced distances of the supported metrics scale with a power of the distance
+            const double tolerance = metric_.to_reduced(1. + std::max(search.epsilon, 0.f));
+            const size_t max_leaves = search.max_leaves == 0 ? std::numeric_limits<size_t>::max() : search.max_leaves;
+            const auto pruned = [&](const coord_t lower_bound) {
+                return heap.size() == k && tolerance * lower_bound >= heap.front().first;
+            };
 
-            node_ptr ret = create_node();
-            ret->data = *middle;
-            ret->parent = parent;
-            ret->left = create_kd_node_hierarchy(start, middle, axis);
-            ret->right = create_kd_node_hierarchy(std::next(middle, 1), end, axis);
+            std::array<coord_t, storage_t::max_bucket_size> dist;
+            size_t n_leaves = 0;
+            queue.emplace_back(storage_.bounds(storage_.root()).min_distance(metric_, center), storage_.root());
+
+            while (!queue.empty()) {
+                std::pop_heap(queue.begin(), queue.end(), queued_node_farther);
+                const queued_node_t current = queue.back();
+                queue.pop_back();
+                if (pruned(current.first)) {
+                    BARN_KD_STATS(stats.subtrees_pruned += queue.size() + 1;)
+                    break; // all other queued nodes are at least as far away
+                }
+
+                BARN_KD_STATS(++stats.nodes_visited;)
+                const size_t count = storage_.distances(current.second, center, metric_, dist.data(), worst_neighbor(heap, k));
+                BARN_KD_STATS(stats.distance_evaluations += count;)
+                for (size_t i = 0; i < count; ++i)
+                    if (!storage_.is_erased(current.second, i))
+                        push_neighbor(heap, k, dist[i], &storage_.point(current.second, i));
+                if (count > 0 && ++n_leaves >= max_leaves && heap.size() == k)
+                    break;
+
+                for (const node_handle child : { storage_.left(current.second), storage_.right(current.second) }) {
+                    if (storage_t::is_null(child) || storage_.subtree_size(child) == 0)
+                        continue;
+                    const coord_t lower_bound = storage_.bounds(child).min_distance(metric_, center);
+                    if (pruned(lower_bound)) {
+                        BARN_KD_STATS(++stats.subtrees_pruned;)
+                        continue;
+                    }
+                    queue.emplace_back(lower_bound, child);
+                    std::push_heap(queue.begin(), queue.end(), queued_node_farther);
+                }
+                BARN_KD_STATS(stats.max_stack_depth = std::max(stats.max_stack_depth, queue.size());)
+            }
+            std::sort_heap(heap.begin(), heap.end(), neighbor_less);
+        }
+
+        /** Returns the distance a point must not exceed to enter the given max-heap of the k nearest neighbors found so far.
+        */
+        static inline coord_t worst_neighbor(const std::vector<neighbor_t>& heap, const size_t k) noexcept {
+            return heap.size() < k ? std::numeric_limits<coord_t>::max() : heap.front().first;
+        }
+
+        /** Adds the given element to the given max-heap of the k nearest neighbors found so far, if it is closer.
+        */
+        static inline void push_neighbor(std::vector<neighbor_t>& heap, const size_t k, const coord_t distance, element_t* const point) {
+            if (heap.size() < k) {
+                heap.emplace_back(distance, point);
+                std::push_heap(heap.begin(), heap.end(), neighbor_less);
+            }
+            else if (distance < heap.front().first) {
+                std::pop_heap(heap.begin(), heap.end(), neighbor_less);
+                heap.back() = neighbor_t(distance, point);
+                std::push_heap(heap.begin(), heap.end(), neighbor_less);
+            }
+        }
+
+        /** Finds the pairs of the given join task and all tasks below it, with other as the tree of the b subtrees.
+        Expands the task breadth-first until there are enough tasks to spread across the threads.
+        */
+        std::vector<pair_t> join(const kd_tree& other, const join_task_t& root, const coord_t reduced_radius, const kd_batch_options& options) const {
+            BARN_KD_STATS(detail::kd_begin_query_stats();)
+            const size_t n_threads = std::max(options.n_threads, size_t(1));
+            std::vector<std::vector<pair_t>> buffers(n_threads);
+
+            // the top levels' own points are joined right away
+            std::vector<join_task_t> tasks(1, root);
+            while (n_threads > 1 && !tasks.empty() && tasks.size() < 16 * n_threads) {
+                std::vector<join_task_t> next;
+                for (const join_task_t& task : tasks)
+                    join_step(other, task, reduced_radius, buffers[0], [&next](const join_task_t& t) { next.push_back(t); });
+                tasks.swap(next);
+            }
+
+            detail::parallel_for(tasks.size(), n_threads, [&](const size_t task, const size_t thread) {
+                BARN_KD_STATS(detail::kd_begin_query_stats();)
+                do_join(other, tasks[task], reduced_radius, buffers[thread]);
+            });
+
+            std::vector<size_t> offsets(n_threads + 1, 0);
+            for (size_t b = 0; b < n_threads; ++b)
+                offsets[b + 1] = offsets[b] + buffers[b].size();
+            std::vector<pair_t> ret(offsets[n_threads]);
+            detail::parallel_for(n_threads, n_threads, [&](const size_t b, size_t) {
+                std::copy(buffers[b].begin(), buffers[b].end(), ret.begin() + offsets[b]);
+                std::vector<pair_t>().swap(buffers[b]);
+            });
             return ret;
         }
 
-        /** Factory method for node pointers.
+        /** Recursively finds the pairs of the given join task and all tasks below it.
         */
-        inline node_ptr create_node() {
-            return std::make_shared<node_t>();
+        void do_join(const kd_tree& other, const join_task_t& task, const coord_t reduced_radius, std::vector<pair_t>& out) const {
+            join_step(other, task, reduced_radius, out, [&](const join_task_t& t) { do_join(other, t, reduced_radius, out); });
         }
 
-        /** Recursively inserts a node at the right place.
-        CAUTION: Does not auto-balance the tree.
+        /** Finds the pairs of the given join task that involve the points of its nodes and hands the tasks for the pairs
+        of their children to emit.
+        A self task pairs the node's points among each other and with the subtrees below, then emits the self tasks
+        of both children and the task joining them. A task of two subtrees is dropped if their bounding boxes are too far
+        apart and taken as a whole if they are close enough; otherwise the points of the root of the larger subtree are
+        searched for in the other subtree, and the tasks joining its children with the other subtree are emitted.
+        @param emit Callable with the signature void(const join_task_t&).
         */
-        node_ptr do_insert(const data_t& data, node_ptr& current_node, node_ptr parent_node, const size_t axis) {
-            assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+        template< typename emit_t>
+        void join_step(const kd_tree& other, const join_task_t& task, const coord_t reduced_radius, std::vector<pair_t>& out, emit_t&& emit) const {
+            const node_handle a = task.a;
+            const node_handle b = task.b;
+            if (storage_.subtree_size(a) == 0 || other.storage_.subtree_size(b) == 0)
+                return;
 
-            if (current_node == nullptr) {
-                current_node = create_node();
-                current_node->data = data;
-                current_node->parent = parent_node;
+            if (task.self) {
+                std::array<coord_t, storage_t::max_bucket_size> dist;
+                const node_handle left = storage_.left(a);
+                const node_handle right = storage_.right(a);
+                for (size_t i = 0; i < storage_.point_count(a); ++i) {
+                    if (storage_.is_erased(a, i))
+                        continue;
+                    element_t& p = storage_.point(a, i);
+                    storage_.distances(a, p, metric_, dist.data(), reduced_radius);
+                    for (size_t j = i + 1; j < storage_.point_count(a); ++j)
+                        if (dist[j] <= reduced_radius && !storage_.is_erased(a, j))
+                            out.emplace_back(&p, &storage_.point(a, j));
+
+                    auto visit = [&out, &p](element_t& q) { out.emplace_back(&p, &q); };
+                    if (!storage_t::is_null(left))
+                        do_for_each_in_range(p, reduced_radius, metric_, left, visit);
+                    if (!storage_t::is_null(right))
+                        do_for_each_in_range(p, reduced_radius, metric_, right, visit);
+                }
+                if (!storage_t::is_null(left))
+                    emit(join_task_t{ left, left, true });
+                if (!storage_t::is_null(right))
+                    emit(join_task_t{ right, right, true });
+                if (!storage_t::is_null(left) && !storage_t::is_null(right))
+                    emit(join_task_t{ left, right, false });
+                return;
+            }
+
+            const box_t& a_bounds = storage_.bounds(a);
+            const box_t& b_bounds = other.storage_.bounds(b);
+            if (a_bounds.min_distance(metric_, b_bounds) > reduced_radius)
+                return;
+            if (a_bounds.max_distance(metric_, b_bounds) <= reduced_radius) {
+                auto visit_a = [&](element_t& p) {
+                    auto visit_b = [&out, &p](element_t& q) { out.emplace_back(&p, &q); };
+                    other.for_each_in_subtree(b, visit_b);
+                };
+                for_each_in_subtree(a, visit_a);
+                return;
             }
-            else if (data[axis] <= current_node->data[axis]) {
-                current_node->left = do_insert(data, current_node->left, current_node, (axis + 1) % n_dims);
+
+            if (storage_.subtree_size(a) >= other.storage_.subtree_size(b)) {
+                for (size_t i = 0; i < storage_.point_count(a); ++i) {
+                    if (storage_.is_erased(a, i))
+                        continue;
+                    element_t& p = storage_.point(a, i);
+                    auto visit = [&out, &p](element_t& q) { out.emplace_back(&p, &q); };
+                    other.do_for_each_in_range(p, reduced_radius, metric_, b, visit);
+                }
+                if (!storage_t::is_null(storage_.left(a)))
+                    emit(join_task_t{ storage_.left(a), b, false });
+                if (!storage_t::is_null(storage_.right(a)))
+                    emit(join_task_t{ storage_.right(a), b, false });
             }
             else {
-                current_node->right = do_insert(data, current_node->right, current_node, (axis + 1) % n_dims);
+                for (size_t i = 0; i < other.storage_.point_count(b); ++i) {
+                    if (other.storage_.is_erased(b, i))
+                        continue;
+                    element_t& q = other.storage_.point(b, i);
+                    auto visit = [&out, &q](element_t& p) { out.emplace_back(&p, &q); };
+                    do_for_each_in_range(q, reduced_radius, metric_, a, visit);
+                }
+                if (!storage_t::is_null(other.storage_.left(b)))
+                    emit(join_task_t{ a, other.storage_.left(b), false });
+                if (!storage_t::is_null(other.storage_.right(b)))
+                    emit(join_task_t{ a, other.storage_.right(b), false });
             }
-
-            return current_node;
         }
 
-        /** Recursively retrieves all data elements that lie in the circle given by the center and radius parameters.
+        /** Recursively adds the data elements of the given subtree to the k-nearest-neighbor max-heaps of the queries of
+        a group that may still find neighbors in it.
+        Prunes by node pairs first: a child is skipped for all these queries at once if the distance between its
+        bounding box and theirs is no less than the largest distance of their k-th neighbors so far. Otherwise only the
+        queries that lie on the child's side of the splitting plane or whose k-th neighbor so far lies beyond it visit
+        it. The child on the side of the queries' bounding box's center is visited first.
+        @param active Holds the indices of these queries in the group at [first, last); the indices of the queries that
+        may still find neighbors in a child are appended while it is visited.
         */
-        std::vector<data_t*> do_find_points_within_range(
-            const data_t& center,
-            const typename std::remove_reference<decltype(center[0])>::type radius,
-            const node_ptr& current_node,
-            const size_t axis) const {
+        void knn_join_step(
+            element_t* const* group,
+            const size_t k,
+            const node_handle current_node,
+            std::vector<neighbor_t>* heaps,
+            std::vector<std::uint32_t>& active,
+            const size_t first,
+            const size_t last,
+            coord_t* dist) const {
+
+            BARN_KD_STATS(const detail::kd_recursion_stats level;)
+            BARN_KD_STATS(kd_query_stats& stats = detail::kd_thread_query_stats(); ++stats.nodes_visited;)
+            // a bucket's box is its own, so queries it cannot improve skip its distances
+            const bool bucket = storage_.point_count(current_node) > 1;
+            for (size_t a = first; a < last && storage_.point_count(current_node) > 0; ++a) {
+                const data_t& q = *group[active[a]];
+                std::vector<neighbor_t>& heap = heaps[active[a]];
+                if (bucket && heap.size() == k && !(storage_.bounds(current_node).min_distance(metric_, q) < heap.front().first))
+                    continue;
+                const size_t count = storage_.distances(current_node, q, metric_, dist, worst_neighbor(heap, k));
+                BARN_KD_STATS(stats.distance_evaluations += count;)
+                for (size_t i = 0; i < count; ++i)
+                    if (!storage_.is_erased(current_node, i))
+                        push_neighbor(heap, k, dist[i], &storage_.point(current_node, i));
+            }
+
+            const node_handle left_child = storage_.left(current_node);
+            const node_handle right_child = storage_.right(current_node);
+            if (storage_t::is_null(left_child) && storage_t::is_null(right_child))
+                return;
 
+            // the bounding box of the queries and the bound of the node pairs they form with the children
+            box_t bounds;
+            coord_t bound = 0;
+            for (size_t a = first; a < last; ++a) {
+                bounds.extend(*group[active[a]]);
+                bound = std::max(bound, worst_neighbor(heaps[active[a]], k));
+            }
+
+            const size_t axis = storage_.axis(current_node);
             assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+            const coord_t split = storage_.split(current_node);
+            const bool left_first = bounds.lo[axis] + (bounds.hi[axis] - bounds.lo[axis]) / 2 <= split;
+            for (const bool left : { left_first, !left_first }) {
+                const node_handle child = left ? left_child : right_child;
+                if (storage_t::is_null(child) || storage_.subtree_size(child) == 0)
+                    continue;
+                if (!(bounds.min_distance(metric_, storage_.bounds(child)) < bound)) {
+                    BARN_KD_STATS(++stats.subtrees_pruned;)
+                    continue;
+                }
+                // the queries on the child's side of the splitting plane, and those whose k-th neighbor so far lies beyond it
+                const size_t child_first = active.size();
+                for (size_t a = first; a < last; ++a) {
+                    const coord_t plane_distance = (*group[active[a]])[axis] - split;
+                    const std::vector<neighbor_t>& heap = heaps[active[a]];
+                    if ((plane_distance <= 0) == left || heap.size() < k || metric_.axis_distance(plane_distance, axis) < heap.front().first)
+                        active.push_back(active[a]);
+                }
+                if (active.size() > child_first)
+                    knn_join_step(group, k, child, heaps, active, child_first, active.size(), dist);
+                else {
+                    BARN_KD_STATS(++stats.subtrees_pruned;)
+                }
+                active.resize(child_first);
+            }
+        }
+
+        /** Cuts the tree into groups of nearby data elements for k_nearest_join(): the elements of every subtree with at
+        most group_size elements form one group, those of every node above these subtrees another.
+        @param groups Receives the offsets of the groups in points, followed by the total number of points.
+        */
+        void collect_query_groups(const size_t group_size, std::vector<element_t*>& points, std::vector<size_t>& groups) const {
+            auto collect = [&points](element_t& p) { points.push_back(&p); };
+            detail::kd_stack<node_handle> stack;
+            if (!storage_t::is_null(storage_.root()))
+                stack.push(storage_.root());
+            while (!stack.empty()) {
+                const node_handle n = stack.pop();
+                if (storage_.subtree_size(n) <= group_size)
+                    for_each_in_subtree(n, collect);
+                else {
+                    for (size_t i = 0; i < storage_.point_count(n); ++i)
+                        if (!storage_.is_erased(n, i))
+                            collect(storage_.point(n, i));
+                    push_children(stack, n);
+                }
+                if (points.size() > groups.back())
+                    groups.push_back(points.size());
+            }
+        }
 
-            std::vector<data_t*> ret;
+        /** Sets the offsets of batched k-nearest-neighbor results stored at k slots per query, and closes the gaps of
+        queries that found less than k elements because the tree holds less.
+        */
+        static void set_offsets(kd_batch_result<element_t>& ret, const std::vector<size_t>& counts, const size_t k) {
+            const size_t n = counts.size();
+            ret.offsets.assign(n + 1, 0);
+            for (size_t i = 0; i < n; ++i)
+                ret.offsets[i + 1] = ret.offsets[i] + counts[i];
+            if (ret.offsets[n] != n * k) {
+                for (size_t i = 0; i < n; ++i)
+                    std::copy_n(ret.neighbors.begin() + i * k, counts[i], ret.neighbors.begin() + ret.offsets[i]);
+                ret.neighbors.resize(ret.offsets[n]);
+            }
+        }
 
-            if (current_node == nullptr)
-                return ret;
+        /** Calls the given visitor with every data element in the given subtree that lies within the given reduced
+        distance of the center by the given metric. Traverses the subtree with an explicit stack.
+        */
+        template< typename visitor_t>
+        void do_for_each_in_range(
+            const data_t& center,
+            const coord_t reduced_radius,
+            const metric_t& metric,
+            const node_handle subtree,
+            visitor_t& f) const {
 
-            data_t &current_data = current_node->data;
+            BARN_KD_STATS(kd_query_stats& stats = detail::kd_thread_query_stats();)
+            std::array<coord_t, storage_t::max_bucket_size> dist;
+            detail::kd_stack<node_handle> stack;
+            stack.push(subtree);
 
-            const auto axis_projected_distance = current_data[axis] - center[axis];
-            if (axis_projected_distance > radius) {
-                // *** current point lies not in range ***
+            while (!stack.empty()) {
+                const node_handle current_node = stack.pop();
+                const size_t axis = storage_.axis(current_node);
+                assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
 
-                if (current_data[axis] > center[axis])
-                    // *** current point too big ** => go left
-                    ret = do_find_points_within_range(center, radius, current_node->left, (axis + 1) % n_dims);
-                else
-                    // *** current point too small *** => go right
-                    ret = do_find_points_within_range(center, radius, current_node->right, (axis + 1) % n_dims);
+                const size_t count = storage_.distances(current_node, center, metric, dist.data(), reduced_radius);
+                BARN_KD_STATS(++stats.nodes_visited; stats.distance_evaluations += count;)
+                for (size_t i = 0; i < count; ++i)
+                    if (dist[i] <= reduced_radius && !storage_.is_erased(current_node, i))
+                        f(storage_.point(current_node, i));
+
+                // left subtree holds coordinates <= the split, right subtree coordinates >= the split
+                const coord_t axis_projected_distance = center[axis] - storage_.split(current_node);
+                const bool plane_in_range = metric.axis_distance(axis_projected_distance, axis) <= reduced_radius;
+                const bool visit_right = axis_projected_distance >= 0 || plane_in_range;
+                const bool visit_left = axis_projected_distance <= 0 || plane_in_range;
+                const node_handle right = storage_.right(current_node);
+                if (!storage_t::is_null(right) && visit_right)
+                    stack.push(right);
+                const node_handle left = storage_.left(current_node);
+                if (!storage_t::is_null(left) && visit_left)
+                    stack.push(left);
+                BARN_KD_STATS(
+                    stats.subtrees_pruned += (!storage_t::is_null(right) && !visit_right) + (!storage_t::is_null(left) && !visit_left);
+                    stats.max_stack_depth = std::max(stats.max_stack_depth, stack.size());)
             }
-            else {
-                // *** current point lies in bounding area ***
-                if (distance(current_data, center) <= radius)
-                    ret.push_back(&current_data);
+        }
 
-                auto left = do_find_points_within_range(center, radius, current_node->left, (axis + 1) % n_dims);
-                auto right = do_find_points_within_range(center, radius, current_node->right, (axis + 1) % n_dims);
-                ret.insert(ret.end(), left.begin(), left.end());
-                ret.insert(ret.end(), right.begin(), right.end());
+        /** Calls the given visitor with every data element in the given subtree.
+        */
+        template< typename visitor_t>
+        void for_each_in_subtree(const node_handle n, visitor_t& f) const {
+            detail::kd_stack<node_handle> stack;
+            stack.push(n);
+            while (!stack.empty()) {
+                const node_handle current_node = stack.pop();
+                for (size_t i = 0; i < storage_.point_count(current_node); ++i)
+                    if (!storage_.is_erased(current_node, i))
+                        f(storage_.point(current_node, i));
+                push_children(stack, current_node);
             }
+        }
 
-            return ret;
+        /** Pushes the existing children of the given node onto the given traversal stack, the left one on top.
+        */
+        inline void push_children(detail::kd_stack<node_handle>& stack, const node_handle n) const {
+            if (!storage_t::is_null(storage_.right(n)))
+                stack.push(storage_.right(n));
+            if (!storage_t::is_null(storage_.left(n)))
+                stack.push(storage_.left(n));
+        }
+
+        /** Returns the order in which a batch of queries is answered; empty for the given order.
+        */
+        template< typename iter_t>
+        inline std::vector<size_t> batch_order(const iter_t first, const size_t n, const kd_batch_options& options) const {
+            if (!options.spatial_order)
+                return std::vector<size_t>();
+            return detail::morton_order<data_t, n_dims>(first, n);
+        }
+
+        /** For debugging purposes.
+        */
+        std::ostream& do_to_stream(std::ostream& os, const node_handle n, const size_t layer) {
+            if (!storage_t::is_null(storage_.left(n)))
+                do_to_stream(os, storage_.left(n), layer + 1);
+            for (size_t i = 0; i < storage_.point_count(n); ++i)
+                if (!storage_.is_erased(n, i))
+                    os << storage_.point(n, i) << " layer: " << layer << "\n";
+            if (!storage_t::is_null(storage_.right(n)))
+                do_to_stream(os, storage_.right(n), layer + 1);
+
+            return os;
         }
 
+        /** Recursively collects the k nearest neighbors in the given max-heap.
+        Descends into the child on the center's side of the splitting plane first and visits the other one
+        only if the plane is closer than the current k-th neighbor.
+        @param dist Scratch buffer for the distances of one node's points, shared by all recursion levels.
+        */
+        void do_find_k_nearest(
+            const data_t& center,
+            const size_t k,
+            const node_handle current_node,
+            std::vector<neighbor_t>& heap,
+            coord_t* dist) const {
+
+            if (storage_t::is_null(current_node))
+                return;
+
+            const size_t axis = storage_.axis(current_node);
+            assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+            const coord_t plane_distance = center[axis] - storage_.split(current_node);
+            const node_handle near_node = plane_distance <= 0 ? storage_.left(current_node) : storage_.right(current_node);
+            const node_handle far_node = plane_distance <= 0 ? storage_.right(current_node) : storage_.left(current_node);
+
+            BARN_KD_STATS(const detail::kd_recursion_stats level;)
+            do_find_k_nearest(center, k, near_node, heap, dist);
+
+            const size_t count = storage_.distances(current_node, center, metric_, dist, worst_neighbor(heap, k));
+            BARN_KD_STATS(kd_query_stats& stats = detail::kd_thread_query_stats(); ++stats.nodes_visited; stats.distance_evaluations += count;)
+            for (size_t i = 0; i < count; ++i)
+                if (!storage_.is_erased(current_node, i))
+                    push_neighbor(heap, k, dist[i], &storage_.point(current_node, i));
+
+            const bool visit_far = heap.size() < k || metric_.axis_distance(plane_distance, axis) < heap.front().first;
+            if (visit_far)
+                do_find_k_nearest(center, k, far_node, heap, dist);
+            BARN_KD_STATS(stats.subtrees_pruned += !visit_far && !storage_t::is_null(far_node);)
+        }
 
-        /** Calculates the euclidean distance between two data elements.
-        I'd like to discuss this with you. (Scope, encapsulation, independence and of course sqrt).
+        /** Recursively searches the nearest neighbor, the k == 1 fast path of do_find_k_nearest().
         */
-        auto distance(const data_t& a, const data_t& b) const {
+        void do_find_nearest(
+            const data_t& center,
+            const node_handle current_node,
+            neighbor_t& best,
+            coord_t* dist) const {
+
+            if (storage_t::is_null(current_node))
+                return;
+
+            const size_t axis = storage_.axis(current_node);
+            assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+            const coord_t plane_distance = center[axis] - storage_.split(current_node);
+            const node_handle near_node = plane_distance <= 0 ? storage_.left(current_node) : storage_.right(current_node);
+            const node_handle far_node = plane_distance <= 0 ? storage_.right(current_node) : storage_.left(current_node);
+
+            BARN_KD_STATS(const detail::kd_recursion_stats level;)
+            do_find_nearest(center, near_node, best, dist);
+
+            const size_t count = storage_.distances(current_node, center, metric_, dist, best.first);
+            BARN_KD_STATS(kd_query_stats& stats = detail::kd_thread_query_stats(); ++stats.nodes_visited; stats.distance_evaluations += count;)
+            for (size_t i = 0; i < count; ++i)
+                if (dist[i] < best.first && !storage_.is_erased(current_node, i))
+                    best = neighbor_t(dist[i], &storage_.point(current_node, i));
+
+            const bool visit_far = metric_.axis_distance(plane_distance, axis) < best.first;
+            if (visit_far)
+                do_find_nearest(center, far_node, best, dist);
+            BARN_KD_STATS(stats.subtrees_pruned += !visit_far && !storage_t::is_null(far_node);)
+        }
 
-            typename std::decay<decltype(a[0])>::type dist(0);
+        /** Orders neighbors by their distance.
+        */
+        static inline bool neighbor_less(const neighbor_t& a, const neighbor_t& b) {
+            return a.first < b.first;
+        }
 
-            for (int i = 0; i < n_dims; ++i)
-                dist += (a[i] - b[i]) * (a[i] - b[i]);
-            return sqrt(dist);
+        /** Orders queued nodes so that a heap yields the closest one first.
+        */
+        static inline bool queued_node_farther(const queued_node_t& a, const queued_node_t& b) {
+            return a.first > b.first;
         }
     };
 
-} // END namespace barn
\ No newline at end of file
+} // END namespace barn
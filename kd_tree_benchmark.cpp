@@ -0,0 +1,798 @@
+/**
+ * @file Compares the node storage layouts of barn::kd_tree.
+ *
+ * Measures heap footprint (as reported by malloc, i.e. including allocator overhead), single and
+ * batched radius query latency as well as count-only radius query latency of the linked (one shared_ptr node per point) and the flat (one contiguous
+ * index-linked array, optionally with leaf buckets, built with or without presorting, with full or 16 bit quantized coordinate
+ * arrays) layout on uniformly distributed 3D points, and what the quantized arrays save per point against how much
+ * slower they make radius queries.
+ * Also measures streaming ingestion: amortized insert cost, tree depth and query latency after inserting
+ * points one by one in sweep order, i.e. sorted along the x axis, with and without rebalancing.
+ * Compares rebuilding a tree at startup with saving it once and mapping the file, finding all pairs of points within
+ * a radius with one query per point and with a self-join, the nearest neighbors of every point of another set with one
+ * query per point, one batch and a join of two trees, and refitting a tree to points that move a little per frame
+ * with rebuilding it. Measures query throughput while one writer keeps inserting, with a global mutex versus lock-free
+ * snapshots, and the insert rate of several producer threads into one such tree versus a forest of spatial shards.
+ * Compares the split policies by the number of nodes 8-nearest-neighbor queries check on clustered and on
+ * flat, anisotropic 3D points, such as LiDAR scans of the ground or road networks.
+ * Finally trades accuracy for speed: recall and latency of approximate 10-nearest-neighbor queries on
+ * clustered 16D points of lower intrinsic dimension, as with embeddings, for several error bounds and leaf caps.
+ *
+ * Build & run like:  g++ -std=c++17 -O2 -DNDEBUG -pthread kd_tree_benchmark.cpp -o kd_tree_benchmark
+ *                    ./kd_tree_benchmark [n_points [n_queries [n_threads [bucket_size]]]]
+ *
+ * @author langenhagen
+ */
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <malloc.h>
+#include <mutex>
+#include <new>
+#include <random>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "kd_forest.hpp"
+#include "kd_tree.hpp"
+#include "kd_tree_concurrent.hpp"
+#include "kd_tree_mmap.hpp"
+
+using namespace std;
+
+using point_t = array<float, 3>;
+
+/// Number of bytes currently allocated via operator new; atomic, since the parallel builds and the readers allocate too.
+static atomic<size_t> g_allocated_bytes{ 0 };
+
+void* operator new(size_t size) {
+    void* p = malloc(size);
+    if (p == nullptr)
+        throw bad_alloc();
+    g_allocated_bytes.fetch_add(malloc_usable_size(p), memory_order_relaxed);
+    return p;
+}
+
+// not inlined, or gcc mistakes the free() for a mismatched deallocation of new'ed memory
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    if (p != nullptr)
+        g_allocated_bytes.fetch_sub(malloc_usable_size(p), memory_order_relaxed);
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    operator delete(p);
+}
+
+
+/// Number of nodes whose points queries checked, counted by counting_layout.
+static size_t g_node_visits = 0;
+
+/** Wraps a storage layout so that every node whose points a query checks is counted in g_node_visits.
+*/
+template< typename layout_t>
+struct counting_layout {
+    template< typename data_t, size_t n_dims>
+    struct storage : layout_t::template storage<data_t, n_dims> {
+        using base_t = typename layout_t::template storage<data_t, n_dims>;
+
+        template< typename metric_t>
+        inline size_t distances(
+            const typename base_t::node_handle n,
+            const data_t& center,
+            const metric_t& metric,
+            typename base_t::coord_t* out,
+            const typename base_t::coord_t bound = numeric_limits<typename base_t::coord_t>::max()) const {
+
+            ++g_node_visits;
+            return base_t::distances(n, center, metric, out, bound);
+        }
+    };
+};
+
+
+/// Creates n uniformly distributed points in the unit cube.
+vector<point_t> make_uniform_points(const size_t n, const unsigned seed) {
+    mt19937 rng(seed);
+    uniform_real_distribution<float> dist(0.f, 1.f);
+    vector<point_t> ret(n);
+    for (auto& p : ret)
+        p = { dist(rng), dist(rng), dist(rng) };
+    return ret;
+}
+
+
+/// Heap bytes per point and radius query latency of one run().
+struct run_result_t {
+    double bytes_per_point;
+    double query_us;
+};
+
+
+/// Builds a tree with the given layout from the points and prints footprint and query latency.
+template< typename layout_t>
+run_result_t run(
+    const char* name,
+    const vector<point_t>& points,
+    const vector<point_t>& queries,
+    const float radius,
+    const barn::kd_build_options& options = barn::kd_build_options()) {
+
+    auto input = points;
+    const size_t bytes_before = g_allocated_bytes.load(memory_order_relaxed);
+
+    auto t0 = chrono::steady_clock::now();
+    barn::kd_tree<point_t, 3, layout_t> tree(input.begin(), input.end(), options);
+    auto t1 = chrono::steady_clock::now();
+    const size_t bytes = g_allocated_bytes.load(memory_order_relaxed) - bytes_before;
+
+    size_t n_found = 0;
+    auto t2 = chrono::steady_clock::now();
+    for (const auto& q : queries)
+        n_found += tree.find_points_within_range(q, radius).size();
+    auto t3 = chrono::steady_clock::now();
+
+    barn::kd_batch_options batch;
+    batch.n_threads = options.n_threads;
+    auto t4 = chrono::steady_clock::now();
+    const auto batch_result = tree.find_points_within_range(queries.begin(), queries.end(), radius, batch);
+    auto t5 = chrono::steady_clock::now();
+    if (batch_result.neighbors.size() != n_found)
+        cerr << "batch query result mismatch\n";
+
+    size_t n_counted = 0;
+    auto t6 = chrono::steady_clock::now();
+    for (const auto& q : queries)
+        n_counted += tree.count_in_range(q, radius);
+    auto t7 = chrono::steady_clock::now();
+    if (n_counted != n_found)
+        cerr << "count query result mismatch\n";
+
+    const double build_ms = chrono::duration<double, milli>(t1 - t0).count();
+    const double query_us = chrono::duration<double, micro>(t3 - t2).count() / queries.size();
+    const double batch_us = chrono::duration<double, micro>(t5 - t4).count() / queries.size();
+    const double count_us = chrono::duration<double, micro>(t7 - t6).count() / queries.size();
+
+    cout << left << setw(10) << name
+        << right << setw(14) << bytes
+        << setw(14) << fixed << setprecision(1) << double(bytes) / points.size()
+        << setw(14) << tree.memory_footprint()
+        << setw(12) << setprecision(1) << build_ms
+        << setw(14) << setprecision(2) << query_us
+        << setw(14) << setprecision(2) << batch_us
+        << setw(14) << setprecision(2) << count_us
+        << setw(12) << n_found << "\n";
+    return { double(bytes) / points.size(), query_us };
+}
+
+
+/// Prints how many bytes per point a quantized run saves over a full one, and its query time relative to it.
+void print_quantize_tradeoff(const char* name, const run_result_t& full, const run_result_t& quantized) {
+    cout << "  " << left << setw(10) << name << right << fixed
+        << setprecision(0) << setw(4) << 100. * (1. - quantized.bytes_per_point / full.bytes_per_point) << "% fewer bytes/point"
+        << setprecision(2) << setw(8) << quantized.query_us / full.query_us << "x the time per radius query\n";
+}
+
+
+/** Inserts the points one by one into an empty tree with the given layout and prints
+amortized insert cost, resulting depth and query latency.
+*/
+template< typename layout_t>
+void run_inserts(
+    const char* name,
+    const vector<point_t>& points,
+    const vector<point_t>& queries,
+    const float radius,
+    const barn::kd_build_options& options) {
+
+    barn::kd_tree<point_t, 3, layout_t> tree(options);
+    auto t0 = chrono::steady_clock::now();
+    for (const auto& p : points)
+        tree.insert(p);
+    auto t1 = chrono::steady_clock::now();
+
+    size_t n_found = 0;
+    auto t2 = chrono::steady_clock::now();
+    for (const auto& q : queries)
+        n_found += tree.count_in_range(q, radius);
+    auto t3 = chrono::steady_clock::now();
+
+    const double insert_ns = chrono::duration<double, nano>(t1 - t0).count() / points.size();
+    const double query_us = chrono::duration<double, micro>(t3 - t2).count() / queries.size();
+
+    cout << left << setw(14) << name
+        << right << setw(14) << fixed << setprecision(1) << insert_ns
+        << setw(10) << tree.depth()
+        << setw(14) << setprecision(2) << query_us
+        << setw(12) << n_found << "\n";
+}
+
+
+/** Saves a tree built from the points to a file, maps it and prints the time to save, to open
+and to answer the queries in place, next to the time a rebuild takes.
+*/
+void run_mapped(
+    const vector<point_t>& points,
+    const vector<point_t>& queries,
+    const float radius,
+    const barn::kd_build_options& options) {
+
+    const char* filename = "kd_tree_benchmark.kdt";
+    auto input = points;
+
+    auto t0 = chrono::steady_clock::now();
+    barn::kd_tree<point_t, 3, barn::kd_layout::flat> tree(input.begin(), input.end(), options);
+    auto t1 = chrono::steady_clock::now();
+    const bool saved = barn::save_kd_tree(filename, tree);
+    auto t2 = chrono::steady_clock::now();
+    barn::kd_tree<point_t, 3, barn::kd_layout::mapped> mapped;
+    const bool opened = saved && barn::open_kd_tree(filename, mapped);
+    auto t3 = chrono::steady_clock::now();
+    if (!opened)
+        cerr << "saving or mapping " << filename << " failed\n";
+
+    size_t n_found = 0;
+    auto t4 = chrono::steady_clock::now();
+    for (const auto& q : queries)
+        n_found += mapped.find_points_within_range(q, radius).size();
+    auto t5 = chrono::steady_clock::now();
+    remove(filename);
+
+    cout << "\nsaved & mapped flat/b tree: build " << fixed << setprecision(1)
+        << chrono::duration<double, milli>(t1 - t0).count() << " ms, save "
+        << chrono::duration<double, milli>(t2 - t1).count() << " ms, open "
+        << setprecision(3) << chrono::duration<double, milli>(t3 - t2).count() << " ms, first "
+        << queries.size() << " queries on the fresh mapping " << setprecision(2)
+        << chrono::duration<double, micro>(t5 - t4).count() / queries.size() << " us/query, found " << n_found << "\n";
+}
+
+
+/** Finds all pairs of points within the radius with one radius query per point and with a self-join,
+on one and on the given number of threads, and prints the times.
+*/
+template< typename layout_t>
+void run_self_join(const char* name, const vector<point_t>& points, const float radius, const barn::kd_build_options& options) {
+    auto input = points;
+    const barn::kd_tree<point_t, 3, layout_t> tree(input.begin(), input.end(), options);
+
+    size_t n_found = 0;
+    vector<point_t*> found;
+    auto t0 = chrono::steady_clock::now();
+    for (const auto& p : points) {
+        found.clear();
+        tree.find_points_within_range(p, radius, back_inserter(found));
+        n_found += found.size();
+    }
+    auto t1 = chrono::steady_clock::now();
+    const size_t n_pairs = tree.radius_self_join(radius).size();
+    auto t2 = chrono::steady_clock::now();
+    barn::kd_batch_options batch;
+    batch.n_threads = options.n_threads;
+    const size_t n_pairs_mt = tree.radius_self_join(radius, batch).size();
+    auto t3 = chrono::steady_clock::now();
+    if (n_found != points.size() + 2 * n_pairs || n_pairs_mt != n_pairs)
+        cerr << "self-join result mismatch\n";
+
+    cout << left << setw(10) << name
+        << right << setw(14) << fixed << setprecision(1) << chrono::duration<double, milli>(t1 - t0).count()
+        << setw(14) << chrono::duration<double, milli>(t2 - t1).count()
+        << setw(14) << chrono::duration<double, milli>(t3 - t2).count()
+        << setw(12) << n_pairs << "\n";
+}
+
+
+/** Finds the k nearest neighbors of every query point with one query per point, with one batch and with a join
+of a tree of the query points, and prints the times.
+*/
+template< typename layout_t>
+void run_knn_join(
+    const char* name,
+    const vector<point_t>& points,
+    const vector<point_t>& queries,
+    const size_t k,
+    const barn::kd_build_options& options) {
+
+    auto input = points;
+    const barn::kd_tree<point_t, 3, layout_t> tree(input.begin(), input.end(), options);
+    auto query_input = queries;
+    const barn::kd_tree<point_t, 3, layout_t> query_tree(query_input.begin(), query_input.end(), options);
+
+    size_t n_found = 0;
+    auto t0 = chrono::steady_clock::now();
+    for (const auto& q : queries)
+        n_found += tree.find_k_nearest(q, k).size();
+    auto t1 = chrono::steady_clock::now();
+    const size_t n_batch = tree.find_k_nearest(queries.begin(), queries.end(), k).neighbors.size();
+    auto t2 = chrono::steady_clock::now();
+    const size_t n_join = tree.k_nearest_join(query_tree, k).neighbors.size();
+    auto t3 = chrono::steady_clock::now();
+    if (n_batch != n_found || n_join != n_found)
+        cerr << "k-nearest join result mismatch\n";
+
+    cout << left << setw(10) << name
+        << right << setw(14) << fixed << setprecision(1) << chrono::duration<double, milli>(t1 - t0).count()
+        << setw(14) << chrono::duration<double, milli>(t2 - t1).count()
+        << setw(14) << chrono::duration<double, milli>(t3 - t2).count() << "\n";
+}
+
+
+/** Moves the given share of the points a little per frame, by a normally distributed offset of the given spread, and
+prints the time per frame to refit the tree versus rebuilding it, and the query latency after all frames.
+*/
+template< typename layout_t>
+void run_refit(
+    const char* name,
+    const vector<point_t>& points,
+    const vector<point_t>& queries,
+    const float radius,
+    const float moving,
+    const float spread,
+    const barn::kd_build_options& options) {
+
+    const size_t n_frames = 10;
+    auto input = points;
+    barn::kd_tree<point_t, 3, layout_t> tree(input.begin(), input.end(), options);
+    vector<point_t*> elements = tree.find_points_in_box(point_t{ -1.f, -1.f, -1.f }, point_t{ 2.f, 2.f, 2.f });
+
+    mt19937 rng(49);
+    normal_distribution<float> offset(0.f, spread);
+    double refit_ms = 0.;
+    double rebuild_ms = 0.;
+    vector<pair<point_t*, point_t>> moves;
+    for (size_t frame = 0; frame < n_frames; ++frame) {
+        moves.clear();
+        for (point_t* p : elements)
+            if (rng() < moving * mt19937::max())
+                moves.emplace_back(p, point_t{ (*p)[0] + offset(rng), (*p)[1] + offset(rng), (*p)[2] + offset(rng) });
+
+        auto t0 = chrono::steady_clock::now();
+        tree.refit(moves.begin(), moves.end());
+        auto t1 = chrono::steady_clock::now();
+        refit_ms += chrono::duration<double, milli>(t1 - t0).count();
+
+        // refitting may move points, so the next frame's points are retrieved anew
+        elements = tree.find_points_in_box(point_t{ -1.f, -1.f, -1.f }, point_t{ 2.f, 2.f, 2.f });
+        input.assign(elements.size(), point_t());
+        for (size_t i = 0; i < elements.size(); ++i)
+            input[i] = *elements[i];
+        auto t2 = chrono::steady_clock::now();
+        barn::kd_tree<point_t, 3, layout_t> rebuilt(input.begin(), input.end(), options);
+        auto t3 = chrono::steady_clock::now();
+        rebuild_ms += chrono::duration<double, milli>(t3 - t2).count();
+    }
+
+    size_t n_found = 0;
+    auto t4 = chrono::steady_clock::now();
+    for (const auto& q : queries)
+        n_found += tree.count_in_range(q, radius);
+    auto t5 = chrono::steady_clock::now();
+
+    cout << left << setw(10) << name
+        << right << setw(10) << fixed << setprecision(3) << moving
+        << setw(14) << setprecision(2) << refit_ms / n_frames
+        << setw(14) << rebuild_ms / n_frames
+        << setw(8) << tree.depth()
+        << setw(14) << chrono::duration<double, micro>(t5 - t4).count() / queries.size()
+        << setw(12) << n_found << "\n";
+}
+
+
+/** Queries a tree with the given number of reader threads while one writer thread inserts the given points,
+and prints the readers' query throughput and the writer's insert rate.
+@param query Answers one count query, given the center and radius.
+@param insert Inserts one point.
+*/
+template< typename query_t, typename insert_t>
+void run_concurrent(
+    const char* name,
+    const vector<point_t>& inserts,
+    const vector<point_t>& queries,
+    const float radius,
+    const size_t n_readers,
+    const query_t& query,
+    const insert_t& insert) {
+
+    atomic<bool> stop(false);
+    atomic<size_t> n_queries(0);
+    size_t n_inserted = 0;
+
+    auto t0 = chrono::steady_clock::now();
+    vector<thread> readers;
+    for (size_t r = 0; r < n_readers; ++r)
+        readers.emplace_back([&, r]() {
+            size_t n = 0;
+            for (size_t i = r % queries.size(); !stop; i = (i + n_readers) % queries.size(), ++n)
+                query(queries[i], radius);
+            n_queries += n;
+        });
+    thread writer([&]() {
+        for (const auto& p : inserts) {
+            insert(p);
+            ++n_inserted;
+        }
+        stop = true;
+    });
+    writer.join();
+    for (auto& t : readers)
+        t.join();
+    auto t1 = chrono::steady_clock::now();
+
+    const double seconds = chrono::duration<double>(t1 - t0).count();
+    cout << left << setw(14) << name
+        << right << setw(16) << fixed << setprecision(0) << n_queries / seconds
+        << setw(16) << n_inserted / seconds << "\n";
+}
+
+
+/** Inserts the given points with the given number of producer threads, each taking an interleaved share,
+and prints the insert rate and the latency of count queries afterwards.
+@param query Answers one count query, given the center and radius.
+@param insert Inserts one point.
+*/
+template< typename query_t, typename insert_t>
+void run_producers(
+    const char* name,
+    const vector<point_t>& inserts,
+    const vector<point_t>& queries,
+    const float radius,
+    const size_t n_producers,
+    const query_t& query,
+    const insert_t& insert) {
+
+    auto t0 = chrono::steady_clock::now();
+    vector<thread> producers;
+    for (size_t t = 0; t < n_producers; ++t)
+        producers.emplace_back([&, t]() {
+            for (size_t i = t; i < inserts.size(); i += n_producers)
+                insert(inserts[i]);
+        });
+    for (auto& t : producers)
+        t.join();
+    auto t1 = chrono::steady_clock::now();
+
+    size_t found = 0;
+    for (const auto& q : queries)
+        found += query(q, radius);
+    auto t2 = chrono::steady_clock::now();
+
+    cout << left << setw(14) << name
+        << right << setw(16) << fixed << setprecision(0) << inserts.size() / chrono::duration<double>(t1 - t0).count()
+        << setw(14) << setprecision(2) << chrono::duration<double, micro>(t2 - t1).count() / queries.size()
+        << setw(12) << found << "\n";
+}
+
+
+/** Creates n points around 256 random centers in the unit cube, or n points of a flat 100 x 1 strip with
+slight noise in z if flat is set.
+*/
+vector<point_t> make_split_test_points(const size_t n, const bool flat, const unsigned seed) {
+    mt19937 rng(seed);
+    uniform_real_distribution<float> uniform(0.f, 1.f);
+    normal_distribution<float> normal(0.f, 0.01f);
+
+    mt19937 cluster_rng(8); // the same clusters for points and queries
+    vector<point_t> clusters(256);
+    for (auto& c : clusters)
+        c = { uniform(cluster_rng), uniform(cluster_rng), uniform(cluster_rng) };
+
+    vector<point_t> ret(n);
+    for (auto& p : ret) {
+        if (flat)
+            p = { 100.f * uniform(rng), uniform(rng), normal(rng) };
+        else {
+            const point_t& c = clusters[rng() % clusters.size()];
+            p = { c[0] + normal(rng), c[1] + normal(rng), c[2] + normal(rng) };
+        }
+    }
+    return ret;
+}
+
+
+/** Builds a bucketed flat tree with each split policy and prints build time, depth, and the nodes checked by
+and latency of 8-nearest-neighbor queries.
+*/
+void run_splits(const char* name, const vector<point_t>& points, const vector<point_t>& queries, const size_t bucket_size) {
+    const pair<const char*, barn::kd_split> splits[] = {
+        { "round robin", barn::kd_split::round_robin },
+        { "widest", barn::kd_split::widest_spread },
+        { "sliding mid", barn::kd_split::sliding_midpoint },
+        { "cost model", barn::kd_split::cost_model } };
+
+    for (const auto& split : splits) {
+        barn::kd_build_options options;
+        options.bucket_size = bucket_size;
+        options.split = split.second;
+        auto input = points;
+
+        auto t0 = chrono::steady_clock::now();
+        barn::kd_tree<point_t, 3, counting_layout<barn::kd_layout::flat>> tree(input.begin(), input.end(), options);
+        auto t1 = chrono::steady_clock::now();
+
+        g_node_visits = 0;
+        auto t2 = chrono::steady_clock::now();
+        for (const auto& q : queries)
+            tree.find_k_nearest(q, 8);
+        auto t3 = chrono::steady_clock::now();
+
+        cout << left << setw(12) << name << setw(14) << split.first
+            << right << setw(12) << fixed << setprecision(1) << chrono::duration<double, milli>(t1 - t0).count()
+            << setw(8) << tree.depth()
+            << setw(14) << setprecision(1) << double(g_node_visits) / queries.size()
+            << setw(14) << setprecision(2) << chrono::duration<double, micro>(t3 - t2).count() / queries.size() << "\n";
+    }
+}
+
+
+/** Creates n points in 16D around a few random cluster centers, each cluster spread mostly along 4 random
+directions, roughly like embeddings, whose intrinsic dimension is lower than their number of coordinates.
+*/
+vector<array<float, 16>> make_clustered_points(const size_t n, const unsigned seed) {
+    using point16_t = array<float, 16>;
+    mt19937 rng(seed);
+    uniform_real_distribution<float> uniform(-1.f, 1.f);
+    normal_distribution<float> normal(0.f, 1.f);
+
+    mt19937 cluster_rng(7); // the same clusters for points and queries
+    vector<pair<point16_t, array<point16_t, 4>>> clusters(64);
+    for (auto& c : clusters) {
+        for (auto& x : c.first)
+            x = uniform(cluster_rng);
+        for (auto& direction : c.second)
+            for (auto& x : direction)
+                x = 0.1f * uniform(cluster_rng);
+    }
+
+    vector<point16_t> ret(n);
+    for (auto& p : ret) {
+        const auto& c = clusters[rng() % clusters.size()];
+        p = c.first;
+        for (const auto& direction : c.second) {
+            const float z = normal(rng);
+            for (size_t d = 0; d < p.size(); ++d)
+                p[d] += z * direction[d];
+        }
+        for (auto& x : p)
+            x += 0.005f * normal(rng);
+    }
+    return ret;
+}
+
+
+/** Answers approximate k-nearest-neighbor queries in 16D with several accuracy budgets and prints latency
+and recall, i.e. the share of the exact k nearest neighbors found.
+*/
+void run_approximate(const size_t n_points, const size_t n_queries, const size_t bucket_size) {
+    using point16_t = array<float, 16>;
+    const size_t k = 10;
+    auto points = make_clustered_points(n_points, 44);
+    const auto queries = make_clustered_points(n_queries, 45);
+
+    barn::kd_build_options options;
+    options.bucket_size = bucket_size;
+    const barn::kd_tree<point16_t, 16, barn::kd_layout::flat> tree(points.begin(), points.end(), options);
+
+    vector<unordered_set<const point16_t*>> exact(queries.size());
+    auto t0 = chrono::steady_clock::now();
+    for (size_t i = 0; i < queries.size(); ++i)
+        for (const point16_t* p : tree.find_k_nearest(queries[i], k))
+            exact[i].insert(p);
+    auto t1 = chrono::steady_clock::now();
+
+    cout << "\napproximate " << k << "-nearest neighbors in 16D: " << n_points << " clustered points, "
+        << queries.size() << " queries, bucket size " << bucket_size << ", exact search "
+        << fixed << setprecision(2) << chrono::duration<double, micro>(t1 - t0).count() / queries.size() << " us/query\n\n";
+    cout << right << setw(10) << "epsilon"
+        << setw(12) << "max leaves"
+        << setw(14) << "us/query"
+        << setw(10) << "recall" << "\n";
+
+    for (const float epsilon : { 0.f, 0.5f, 1.f, 2.f }) {
+        for (const size_t max_leaves : { size_t(0), size_t(256), size_t(64), size_t(16) }) {
+            barn::kd_search_options search;
+            search.epsilon = epsilon;
+            search.max_leaves = max_leaves;
+
+            size_t n_hits = 0;
+            auto t2 = chrono::steady_clock::now();
+            for (size_t i = 0; i < queries.size(); ++i)
+                for (const point16_t* p : tree.find_k_nearest(queries[i], k, search))
+                    n_hits += exact[i].count(p);
+            auto t3 = chrono::steady_clock::now();
+
+            cout << setw(10) << setprecision(1) << epsilon
+                << setw(12) << max_leaves
+                << setw(14) << setprecision(2) << chrono::duration<double, micro>(t3 - t2).count() / queries.size()
+                << setw(10) << setprecision(3) << double(n_hits) / (k * queries.size()) << "\n";
+        }
+    }
+}
+
+
+int main(int argc, char** argv) {
+
+    const size_t n_points = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    const size_t n_queries = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000;
+
+    barn::kd_build_options parallel;
+    parallel.n_threads = argc > 3 ? strtoul(argv[3], nullptr, 10) : max(1u, thread::hardware_concurrency());
+    const size_t bucket_size = argc > 4 ? strtoul(argv[4], nullptr, 10) : 16;
+
+    const auto points = make_uniform_points(n_points, 42);
+    const auto queries = make_uniform_points(n_queries, 43);
+    const float radius = cbrt(32.f / n_points); // roughly 32 * 4/3 pi points per query
+
+    cout << "points: " << n_points << "  queries: " << n_queries << "  radius: " << radius
+        << "  build & batch threads (*/mt): " << parallel.n_threads << "  bucket size (*/b): " << bucket_size << "\n\n";
+    cout << left << setw(10) << "layout"
+        << right << setw(14) << "heap bytes"
+        << setw(14) << "bytes/point"
+        << setw(14) << "footprint()"
+        << setw(12) << "build ms"
+        << setw(14) << "us/query"
+        << setw(14) << "batch us/q"
+        << setw(14) << "count us/q"
+        << setw(12) << "found" << "\n";
+
+    barn::kd_build_options bucketed;
+    bucketed.bucket_size = bucket_size;
+    barn::kd_build_options bucketed_parallel = parallel;
+    bucketed_parallel.bucket_size = bucket_size;
+    barn::kd_build_options bucketed_presorted = bucketed;
+    bucketed_presorted.presort = true;
+    barn::kd_build_options quantized;
+    quantized.quantize = true;
+    barn::kd_build_options bucketed_quantized = bucketed;
+    bucketed_quantized.quantize = true;
+
+    run<barn::kd_layout::linked>("linked", points, queries, radius);
+    const auto flat_result = run<barn::kd_layout::flat>("flat", points, queries, radius);
+    const auto bucketed_result = run<barn::kd_layout::flat>("flat/b", points, queries, radius, bucketed);
+    run<barn::kd_layout::flat>("flat/b/ps", points, queries, radius, bucketed_presorted);
+    const auto flat_quantized_result = run<barn::kd_layout::flat>("flat/q", points, queries, radius, quantized);
+    const auto bucketed_quantized_result = run<barn::kd_layout::flat>("flat/b/q", points, queries, radius, bucketed_quantized);
+    run<barn::kd_layout::linked>("linked/mt", points, queries, radius, parallel);
+    run<barn::kd_layout::flat>("flat/b/mt", points, queries, radius, bucketed_parallel);
+
+    // the points, nodes and bounding boxes stay full size, so quantizing only trims the coordinate arrays
+    cout << "\nquantized (*/q) vs full coordinate arrays:\n";
+    print_quantize_tradeoff("flat", flat_result, flat_quantized_result);
+    print_quantize_tradeoff("flat/b", bucketed_result, bucketed_quantized_result);
+
+    // unbalanced inserts in sweep order build deep trees that are slow to insert into, so this part uses fewer points
+    vector<point_t> sweep(points.begin(), points.begin() + min(n_points, max(size_t(1), n_points / 20)));
+    sort(sweep.begin(), sweep.end());
+    const vector<point_t> sweep_queries(queries.begin(), queries.begin() + min(n_queries, size_t(1000)));
+    const float sweep_radius = cbrt(32.f / sweep.size());
+
+    barn::kd_build_options balanced;
+    balanced.balance = 0.7f;
+    barn::kd_build_options bucketed_balanced = bucketed;
+    bucketed_balanced.balance = 0.7f;
+
+    cout << "\nstreaming inserts in sweep order: " << sweep.size() << " points, "
+        << sweep_queries.size() << " count queries, balance (*/bal): " << balanced.balance << "\n\n";
+    cout << left << setw(14) << "layout"
+        << right << setw(14) << "ns/insert"
+        << setw(10) << "depth"
+        << setw(14) << "us/query"
+        << setw(12) << "found" << "\n";
+
+    run_inserts<barn::kd_layout::linked>("linked", sweep, sweep_queries, sweep_radius, barn::kd_build_options());
+    run_inserts<barn::kd_layout::linked>("linked/bal", sweep, sweep_queries, sweep_radius, balanced);
+    run_inserts<barn::kd_layout::flat>("flat/b", sweep, sweep_queries, sweep_radius, bucketed);
+    run_inserts<barn::kd_layout::flat>("flat/b/bal", sweep, sweep_queries, sweep_radius, bucketed_balanced);
+
+    run_mapped(points, queries, radius, bucketed);
+
+    // every pair is stored, so this part uses fewer points and keeps the radius, i.e. finds few pairs per point
+    const vector<point_t> join_points(points.begin(), points.begin() + max(size_t(1), n_points / 10));
+    cout << "\nall pairs within the radius: " << join_points.size() << " points, radius " << radius
+        << ", threads (*/mt): " << parallel.n_threads << "\n\n";
+    cout << left << setw(10) << "layout"
+        << right << setw(14) << "queries ms"
+        << setw(14) << "join ms"
+        << setw(14) << "join/mt ms"
+        << setw(12) << "pairs" << "\n";
+    run_self_join<barn::kd_layout::linked>("linked", join_points, radius, parallel);
+    run_self_join<barn::kd_layout::flat>("flat/b", join_points, radius, bucketed_parallel);
+
+    // matching one point set against another, as in ICP
+    const vector<point_t> match_points = make_uniform_points(n_points, 49);
+    cout << "\n8 nearest neighbors of every point of another set: " << n_points << " query points, "
+        << n_points << " points, one thread\n\n";
+    cout << left << setw(10) << "layout"
+        << right << setw(14) << "queries ms"
+        << setw(14) << "batch ms"
+        << setw(14) << "join ms" << "\n";
+    run_knn_join<barn::kd_layout::linked>("linked", points, match_points, 8, barn::kd_build_options());
+    run_knn_join<barn::kd_layout::flat>("flat/b", points, match_points, 8, bucketed);
+
+    // points jitter by about a tenth of their mean spacing per frame
+    const float spread = 0.1f * cbrt(1.f / n_points);
+    cout << "\nmoving points: " << n_points << " points, 10 frames, offsets with standard deviation " << setprecision(6) << spread
+        << ", refit vs rebuild per frame, then " << n_queries << " count queries\n\n";
+    cout << left << setw(10) << "layout"
+        << right << setw(10) << "moving"
+        << setw(14) << "refit ms"
+        << setw(14) << "rebuild ms"
+        << setw(8) << "depth"
+        << setw(14) << "us/query"
+        << setw(12) << "found" << "\n";
+    for (const float moving : { 0.01f, 0.1f }) {
+        run_refit<barn::kd_layout::linked>("linked", points, queries, radius, moving, spread, barn::kd_build_options());
+        run_refit<barn::kd_layout::flat>("flat/b", points, queries, radius, moving, spread, bucketed);
+    }
+
+    // one writer streams in new points while the other threads answer count queries
+    const size_t n_readers = max(size_t(1), parallel.n_threads - 1);
+    const vector<point_t> inserts = make_uniform_points(max(size_t(1), n_points / 10), 46);
+    cout << "\nconcurrent count queries: " << n_readers << " reader threads, 1 writer inserting "
+        << inserts.size() << " points into " << n_points << ", balance " << balanced.balance << "\n\n";
+    cout << left << setw(14) << "sync"
+        << right << setw(16) << "queries/s"
+        << setw(16) << "inserts/s" << "\n";
+    {
+        auto input = points;
+        barn::kd_tree<point_t, 3> tree(input.begin(), input.end(), balanced);
+        mutex tree_mutex;
+        run_concurrent("mutex", inserts, queries, radius, n_readers,
+            [&](const point_t& q, const float r) { lock_guard<mutex> lock(tree_mutex); return tree.count_in_range(q, r); },
+            [&](const point_t& p) { lock_guard<mutex> lock(tree_mutex); tree.insert(p); });
+    }
+    {
+        auto input = points;
+        barn::concurrent_kd_tree<point_t, 3> tree(input.begin(), input.end(), balanced);
+        run_concurrent("snapshots", inserts, queries, radius, n_readers,
+            [&](const point_t& q, const float r) { return tree.snapshot()->count_in_range(q, r); },
+            [&](const point_t& p) { tree.insert(p); });
+    }
+
+    // the same stream from several producers, into one tree or into shards with a writer lock each
+    const size_t n_producers = max(size_t(2), parallel.n_threads);
+    barn::kd_forest_options sharded;
+    sharded.n_shards = 4 * n_producers;
+    cout << "\nconcurrent inserts: " << n_producers << " producer threads inserting " << inserts.size() << " points into "
+        << n_points << ", then " << n_queries << " count queries; forest of " << sharded.n_shards << " shards\n\n";
+    cout << left << setw(14) << "sync"
+        << right << setw(16) << "inserts/s"
+        << setw(14) << "us/query"
+        << setw(12) << "found" << "\n";
+    {
+        auto input = points;
+        barn::concurrent_kd_tree<point_t, 3> tree(input.begin(), input.end(), balanced);
+        run_producers("snapshots", inserts, queries, radius, n_producers,
+            [&](const point_t& q, const float r) { return tree.snapshot()->count_in_range(q, r); },
+            [&](const point_t& p) { tree.insert(p); });
+    }
+    {
+        barn::kd_forest<point_t, 3> forest(points.begin(), points.end(), sharded, balanced);
+        run_producers("forest", inserts, queries, radius, n_producers,
+            [&](const point_t& q, const float r) { return forest.count_in_range(q, r); },
+            [&](const point_t& p) { forest.insert(p); });
+    }
+
+    const size_t n_split_points = max(size_t(1), n_points / 10);
+    const size_t n_split_queries = min(n_queries, size_t(2000));
+    cout << "\nsplit policies: " << n_split_points << " points, " << n_split_queries
+        << " 8-nearest-neighbor queries, bucket size " << bucket_size << "\n\n";
+    cout << left << setw(12) << "data" << setw(14) << "split"
+        << right << setw(12) << "build ms"
+        << setw(8) << "depth"
+        << setw(14) << "nodes/query"
+        << setw(14) << "us/query" << "\n";
+    for (const bool flat : { false, true })
+        run_splits(flat ? "flat" : "clustered", make_split_test_points(n_split_points, flat, 47),
+            make_split_test_points(n_split_queries, flat, 48), bucket_size);
+
+    // exact searches in high dimensions visit most of the tree, so this part uses fewer points and queries
+    run_approximate(max(size_t(1), n_points / 10), min(n_queries, size_t(1000)), bucket_size);
+
+    return 0;
+}
@@ -0,0 +1,318 @@
+/**
+ * @file Measures the build and query paths of barn::kd_tree across data shapes, sizes and dimensions.
+ *
+ * For uniform, clustered and degenerate (collinear) point sets in 2, 3 and 8 dimensions and from 1e3 points
+ * up to the given maximum in powers of 10, times construction, one-by-one insert, radius queries at radii
+ * that hold about 1, 10 and 100 uniform points, 10-nearest-neighbor queries and read-only iteration over all points,
+ * by iterators and by for_each_point(), for the linked, the flat and the bucketed flat layout. A linear scan answers the same radius queries as a
+ * brute-force baseline.
+ *
+ * Prints one CSV row per measurement:
+ *   dims, data, points, layout, operation, radius, ops, seconds, ops_per_s, p50_us, p99_us, results, peak_rss_kb
+ * build, iterate and for_each count points as ops and have no per-op latencies; insert, range and knn count single calls.
+ * results is the number of points found by all queries of a row, equal for the trees, and for the baseline where it
+ * answers all queries; on large point sets it answers fewer.
+ * Every layout of every point set runs in a forked process, so peak_rss_kb is the peak resident set of
+ * generating the points and running that layout's measurements alone.
+ *
+ * Build & run like:  g++ -std=c++17 -O2 -DNDEBUG -pthread kd_tree_benchmark_suite.cpp -o kd_tree_benchmark_suite
+ *                    ./kd_tree_benchmark_suite [max_points [n_queries]] > results.csv
+ *
+ * 1e8 points need around 10 GB in 8 dimensions, so the default maximum is 1e6.
+ *
+ * @author langenhagen
+ */
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "kd_tree.hpp"
+
+using namespace std;
+
+template< size_t n_dims>
+using point_t = array<float, n_dims>;
+
+/// The shapes of the generated point sets.
+enum class dataset_kind {
+    uniform,    ///< uniformly distributed in the unit cube
+    clustered,  ///< normally distributed around 16 uniformly distributed centers
+    collinear   ///< uniformly distributed on the unit cube's main diagonal
+};
+
+const char* to_string(const dataset_kind data) {
+    return data == dataset_kind::uniform ? "uniform" : data == dataset_kind::clustered ? "clustered" : "collinear";
+}
+
+/// One measurement; latencies are negative where they do not apply.
+struct row_t {
+    const char* operation;
+    float radius = 0.f;
+    size_t ops = 0;
+    double seconds = 0.;
+    double p50_us = -1.;
+    double p99_us = -1.;
+    size_t results = 0;
+};
+
+
+/// Creates n points of the given shape.
+template< size_t n_dims>
+vector<point_t<n_dims>> make_points(const dataset_kind data, const size_t n, const unsigned seed) {
+    mt19937 rng(seed);
+    uniform_real_distribution<float> uniform(0.f, 1.f);
+    normal_distribution<float> normal(0.f, 0.02f);
+
+    vector<point_t<n_dims>> centers(16);
+    for (auto& c : centers)
+        for (auto& x : c)
+            x = uniform(rng);
+
+    vector<point_t<n_dims>> ret(n);
+    for (auto& p : ret) {
+        if (data == dataset_kind::uniform)
+            for (auto& x : p)
+                x = uniform(rng);
+        else if (data == dataset_kind::clustered) {
+            const auto& c = centers[rng() % centers.size()];
+            for (size_t d = 0; d < n_dims; ++d)
+                p[d] = c[d] + normal(rng);
+        }
+        else
+            p.fill(uniform(rng));
+    }
+    return ret;
+}
+
+/// Returns the radius of a ball that holds k of n uniformly distributed points in the unit cube on average.
+double radius_for(const size_t k, const size_t n, const size_t n_dims) {
+    const double unit_ball = pow(M_PI, n_dims / 2.) / tgamma(n_dims / 2. + 1.);
+    return pow(double(k) / (n * unit_ball), 1. / n_dims);
+}
+
+/// Fills in the median and 99th percentile of the given latencies in seconds.
+void set_percentiles(vector<double>& latencies, row_t& row) {
+    if (latencies.empty())
+        return;
+    const auto at = [&latencies](const double q) {
+        auto it = latencies.begin() + min(latencies.size() - 1, size_t(q * latencies.size()));
+        nth_element(latencies.begin(), it, latencies.end());
+        return *it * 1e6;
+    };
+    row.p50_us = at(.5);
+    row.p99_us = at(.99);
+}
+
+/// Times one call to f.
+template< typename func_t>
+inline double seconds_of(func_t&& f) {
+    const auto t0 = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+/// Times the radius queries one by one with the given query function.
+template< typename query_t>
+row_t time_range(const char* operation, const vector<double>& radii, const size_t i_radius,
+                 const size_t n_queries, const query_t& query) {
+    row_t row;
+    row.operation = operation;
+    row.radius = float(radii[i_radius]);
+    row.ops = n_queries;
+    vector<double> latencies(n_queries);
+    for (size_t q = 0; q < n_queries; ++q) {
+        size_t found = 0;
+        latencies[q] = seconds_of([&]() { found = query(q, row.radius); });
+        row.seconds += latencies[q];
+        row.results += found;
+    }
+    set_percentiles(latencies, row);
+    return row;
+}
+
+
+/// Times iterating the points read-only, by iterators and by for_each_point().
+template< typename tree_t>
+void time_iteration(const tree_t& tree, vector<row_t>& rows) {
+    float sum = 0.f;
+    const auto time = [&](const char* operation, const auto& iterate) {
+        row_t row;
+        row.operation = operation;
+        row.ops = tree.size();
+        row.seconds = seconds_of(iterate);
+        rows.push_back(row);
+    };
+    time("iterate", [&]() {
+        for (const auto& p : tree)
+            sum += p[0];
+    });
+    time("for_each", [&]() { tree.for_each_point([&sum](const auto& p) { sum += p[0]; }); });
+    if (sum < 0.f)
+        cerr << "unexpected sum\n"; // keeps the loops from being optimized away
+}
+
+/// Measures a tree with the given layout on the points.
+template< typename layout_t, size_t n_dims>
+vector<row_t> run_tree(
+    const vector<point_t<n_dims>>& points,
+    const vector<point_t<n_dims>>& queries,
+    const vector<double>& radii,
+    const barn::kd_build_options& options) {
+
+    vector<row_t> rows;
+
+    // build from 90% of the points, insert the rest
+    const size_t n_built = points.size() - points.size() / 10;
+    auto input = vector<point_t<n_dims>>(points.begin(), points.begin() + n_built);
+    const auto t0 = chrono::steady_clock::now();
+    barn::kd_tree<point_t<n_dims>, n_dims, layout_t> tree(input.begin(), input.end(), options);
+    {
+        row_t row;
+        row.operation = "build";
+        row.ops = n_built;
+        row.seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        rows.push_back(row);
+    }
+    input = vector<point_t<n_dims>>();
+    {
+        row_t row;
+        row.operation = "insert";
+        row.ops = points.size() - n_built;
+        vector<double> latencies(row.ops);
+        for (size_t i = 0; i < row.ops; ++i) {
+            latencies[i] = seconds_of([&]() { tree.insert(points[n_built + i]); });
+            row.seconds += latencies[i];
+        }
+        set_percentiles(latencies, row);
+        rows.push_back(row);
+    }
+
+    for (size_t r = 0; r < radii.size(); ++r)
+        rows.push_back(time_range("range", radii, r, queries.size(), [&](const size_t q, const float radius) {
+            return tree.find_points_within_range(queries[q], radius).size(); }));
+    {
+        row_t row;
+        row.operation = "knn";
+        row.ops = queries.size();
+        vector<double> latencies(row.ops);
+        for (size_t q = 0; q < row.ops; ++q) {
+            latencies[q] = seconds_of([&]() { row.results += tree.find_k_nearest(queries[q], 10).size(); });
+            row.seconds += latencies[q];
+        }
+        set_percentiles(latencies, row);
+        rows.push_back(row);
+    }
+
+    time_iteration(tree, rows);
+    return rows;
+}
+
+/// Measures a linear scan over the points; limits the queries to keep large point sets tractable.
+template< size_t n_dims>
+vector<row_t> run_brute_force(
+    const vector<point_t<n_dims>>& points,
+    const vector<point_t<n_dims>>& queries,
+    const vector<double>& radii) {
+
+    const size_t n_queries = max(size_t(1), min(queries.size(), size_t(1e9) / points.size()));
+    vector<row_t> rows;
+    for (size_t r = 0; r < radii.size(); ++r)
+        rows.push_back(time_range("range", radii, r, n_queries, [&](const size_t q, const float radius) {
+            vector<const point_t<n_dims>*> found;
+            for (const auto& p : points) {
+                float d2 = 0.f;
+                for (size_t d = 0; d < n_dims; ++d)
+                    d2 += (p[d] - queries[q][d]) * (p[d] - queries[q][d]);
+                if (d2 <= radius * radius)
+                    found.push_back(&p);
+            }
+            return found.size(); }));
+    return rows;
+}
+
+
+/// Runs f in a forked process and waits for it, so that its peak resident set is its own.
+template< typename func_t>
+void run_isolated(func_t&& f) {
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        f();
+        fflush(stdout);
+        _exit(0);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        cerr << "measurement process failed\n";
+}
+
+/// Measures every layout and the baseline on one point set.
+template< size_t n_dims>
+void run_case(const dataset_kind data, const size_t n_points, const size_t n_queries) {
+    const auto run = [&](const char* layout, const auto& measure) {
+        run_isolated([&]() {
+            const auto points = make_points<n_dims>(data, n_points, 42);
+            const auto queries = make_points<n_dims>(data, n_queries, 43);
+            vector<double> radii;
+            for (const size_t k : { 1, 10, 100 })
+                radii.push_back(radius_for(k, n_points, n_dims));
+
+            const vector<row_t> rows = measure(points, queries, radii);
+            rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            for (const row_t& row : rows) {
+                printf("%zu,%s,%zu,%s,%s,", n_dims, to_string(data), n_points, layout, row.operation);
+                if (row.radius > 0.f)
+                    printf("%g", row.radius);
+                printf(",%zu,%.6f,%.1f,", row.ops, row.seconds, row.seconds > 0. ? row.ops / row.seconds : 0.);
+                if (row.p50_us >= 0.)
+                    printf("%.3f,%.3f", row.p50_us, row.p99_us);
+                else
+                    printf(",");
+                printf(",%zu,%ld\n", row.results, usage.ru_maxrss);
+            }
+            fflush(stdout);
+        });
+    };
+
+    barn::kd_build_options bucketed;
+    bucketed.bucket_size = 16;
+    run("linked", [](const auto& points, const auto& queries, const auto& radii) {
+        return run_tree<barn::kd_layout::linked, n_dims>(points, queries, radii, barn::kd_build_options()); });
+    run("flat", [](const auto& points, const auto& queries, const auto& radii) {
+        return run_tree<barn::kd_layout::flat, n_dims>(points, queries, radii, barn::kd_build_options()); });
+    run("flat/b", [&bucketed](const auto& points, const auto& queries, const auto& radii) {
+        return run_tree<barn::kd_layout::flat, n_dims>(points, queries, radii, bucketed); });
+    run("brute", [](const auto& points, const auto& queries, const auto& radii) {
+        return run_brute_force<n_dims>(points, queries, radii); });
+}
+
+template< size_t n_dims>
+void run_dims(const size_t max_points, const size_t n_queries) {
+    for (const dataset_kind data : { dataset_kind::uniform, dataset_kind::clustered, dataset_kind::collinear })
+        for (size_t n = 1000; n <= max_points; n *= 10)
+            run_case<n_dims>(data, n, n_queries);
+}
+
+
+int main(int argc, char** argv) {
+
+    const size_t max_points = argc > 1 ? size_t(strtod(argv[1], nullptr)) : 1000000;
+    const size_t n_queries = argc > 2 ? strtoul(argv[2], nullptr, 10) : 1000;
+
+    printf("dims,data,points,layout,operation,radius,ops,seconds,ops_per_s,p50_us,p99_us,results,peak_rss_kb\n");
+    run_dims<2>(max_points, n_queries);
+    run_dims<3>(max_points, n_queries);
+    run_dims<8>(max_points, n_queries);
+    return 0;
+}
@@ -0,0 +1,538 @@
+/******************************************************************************
+/* @file Contains a kd tree that many threads query lock-free while others insert and erase.
+/*
+/* Readers query an immutable snapshot of the tree; writers publish new versions by copying the path
+/* from the root to the changed node, sharing all other nodes with the previous version:
+/*
+/*      barn::concurrent_kd_tree<point_t, 3> tree(points.begin(), points.end());
+/*
+/*      // any number of reader threads
+/*      auto snapshot = tree.snapshot();
+/*      auto neighbors = snapshot->find_k_nearest(center, 8);
+/*
+/*      // writer threads
+/*      tree.insert(point);
+/*
+/* Readers never lock and never wait for writers. Writers are serialized among each other.
+/* Nodes replaced by a write are freed once no snapshot taken before the write is alive anymore,
+/* tracked via epochs.
+/*
+/* @author langenhagen
+/* @version 161017
+/******************************************************************************/
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+//INCLUDES C/C++ standard library (and other external libraries)
+
+#include <algorithm>
+#include <atomic>
+#include <assert.h>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+//INCLUDES project headers
+
+#include "kd_tree.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// NAMESPACE, CONSTANTS and TYPE DECLARATIONS/IMPLEMENTATIONS
+
+
+namespace barn {
+
+    /** A read-only view of one version of a barn::concurrent_kd_tree.
+    Versions share their unchanged nodes, so the view does not own its nodes.
+    */
+    template< typename data_t, size_t n_dims>
+    class kd_snapshot_storage {
+    public: // inner typedefs
+        struct node_t;
+        using node_ptr = const node_t*;
+        using node_handle = const node_t*;
+        using element_t = const data_t;    ///< versions are shared between threads, so queries hand out read-only points
+        using const_iterator = const data_t*;
+        using iterator = const_iterator;
+        using coord_t = detail::kd_coord_t<data_t>;
+        using box_t = detail::kd_box<coord_t, n_dims>;
+
+    public: // inner classes
+
+        /** Represents nodes in the kd-tree; immutable once published.
+        */
+        struct node_t {
+            data_t data;                ///< data field
+            bool erased = false;        ///< tombstone; erased nodes stay in the tree until it is compacted
+            std::uint8_t axis = 0;      ///< the splitting axis
+            const node_t* left = nullptr;   ///< left child
+            const node_t* right = nullptr;  ///< right child
+            size_t size = 1;            ///< number of points in the subtree that are not erased
+            box_t bounds;               ///< bounding box of the subtree's points, including erased ones
+        };
+
+    private: // vars
+
+        const node_t* root_ = nullptr;  ///< the root node of the viewed version
+        kd_build_options options_;      ///< parameters the viewed version was built with
+
+    public: // methods
+
+        /** Views the version with the given root.
+        */
+        inline void reset(const node_t* root, const kd_build_options& options) noexcept {
+            root_ = root;
+            options_ = options;
+        }
+
+        /** Returns the parameters for building and rebalancing.
+        */
+        inline const kd_build_options& options() const noexcept { return options_; }
+
+        // node access used by the tree algorithms
+        static constexpr size_t max_bucket_size = 1;
+        inline node_handle root() const noexcept { return root_; }
+        static inline bool is_null(const node_handle n) noexcept { return n == nullptr; }
+        static inline node_handle left(const node_handle n) noexcept { return n->left; }
+        static inline node_handle right(const node_handle n) noexcept { return n->right; }
+        static inline size_t axis(const node_handle n) noexcept { return n->axis; }
+        static inline coord_t split(const node_handle n) { return n->data[n->axis]; }
+        static inline size_t point_count(const node_handle) noexcept { return 1; }
+        static inline bool is_erased(const node_handle n, size_t) noexcept { return n->erased; }
+        static inline size_t subtree_size(const node_handle n) noexcept { return n->size; }
+        static inline const box_t& bounds(const node_handle n) noexcept { return n->bounds; }
+
+        /** Returns the point of the node.
+        */
+        static inline const data_t& point(const node_handle n, size_t) noexcept { return n->data; }
+
+        /** Writes the reduced distance between the node's point and the center to out.
+        The bound only matters for quantized storages, see kd_flat_storage::distances().
+        @return Returns the number of points of the node, i.e. 1.
+        */
+        template< typename metric_t>
+        static inline size_t distances(
+            const node_handle n,
+            const data_t& center,
+            const metric_t& metric,
+            coord_t* out,
+            const coord_t = std::numeric_limits<coord_t>::max()) {
+            *out = detail::kd_distance<n_dims, coord_t>(metric, n->data, center);
+            return 1;
+        }
+
+        /** Returns the number of bytes of the viewed version's nodes, including nodes shared with other versions.
+        */
+        size_t memory_footprint() const {
+            size_t n_nodes = 0;
+            detail::kd_stack<const node_t*> stack;
+            if (root_ != nullptr)
+                stack.push(root_);
+            while (!stack.empty()) {
+                const node_t* n = stack.pop();
+                ++n_nodes;
+                if (n->left != nullptr)
+                    stack.push(n->left);
+                if (n->right != nullptr)
+                    stack.push(n->right);
+            }
+            return n_nodes * sizeof(node_t);
+        }
+
+        /** Calls f with every point that is not erased, in depth-first pre-order.
+        Versions have no parent links, so this keeps an explicit stack; it skips subtrees without points left.
+        */
+        template< typename func_t>
+        void for_each_point(func_t&& f) const {
+            detail::kd_stack<const node_t*> stack;
+            if (root_ != nullptr && root_->size > 0)
+                stack.push(root_);
+            while (!stack.empty()) {
+                const node_t* n = stack.pop();
+                if (!n->erased)
+                    f(n->data);
+                if (n->right != nullptr && n->right->size > 0)
+                    stack.push(n->right);
+                if (n->left != nullptr && n->left->size > 0)
+                    stack.push(n->left);
+            }
+        }
+    };
+
+
+    namespace kd_layout {
+
+        /** A read-only version of a barn::concurrent_kd_tree, see concurrent_kd_tree::snapshot().
+        */
+        struct snapshot {
+            template< typename data_t, size_t n_dims>
+            using storage = kd_snapshot_storage<data_t, n_dims>;
+        };
+
+    } // END namespace kd_layout
+
+
+    /** Implements a kd-tree that any number of threads query without locking while other threads modify it.
+    Every modification publishes a new immutable version by path copying: the nodes from the root down to the changed
+    node are copied, all others are shared with the previous version. Readers pin the current version with snapshot()
+    and query it with the full barn::kd_tree API. Writers are serialized by a mutex readers never touch.
+    Replaced nodes are retired with the current epoch and freed by a later write once every snapshot that could
+    still reach them is released.
+    CAUTION: Snapshots must not outlive the tree.
+    */
+    template<
+        typename data_t /*data type*/,
+        size_t n_dims = 2 /*number of dimensions of the data type*/,
+        typename metric_t = kd_metric::l2 /*distance metric, see barn::kd_metric*/>
+    class concurrent_kd_tree {
+    public: // inner typedefs
+        using storage_t = kd_snapshot_storage<data_t, n_dims>;
+        using tree_t = kd_tree<data_t, n_dims, kd_layout::snapshot, metric_t>;
+        using node_t = typename storage_t::node_t;
+
+    private: // inner typedefs
+
+        /** The epoch a reader pinned, 0 if the slot is free; one cache line per slot, so readers do not contend.
+        */
+        struct alignas(64) reader_slot_t {
+            std::atomic<std::uint64_t> epoch{ 0 };
+        };
+
+        /// A node replaced by a write, with the epoch of the last version that contains it.
+        using retired_node_t = std::pair<std::uint64_t, const node_t*>;
+
+    public: // inner classes
+
+        /** A pinned version of the tree, queried via operator->.
+        The version and the points it hands out stay valid and unchanged until the snapshot is destroyed.
+        */
+        class snapshot_t {
+
+        private: // vars
+            reader_slot_t* slot_ = nullptr;     ///< the pinned reader slot
+            tree_t tree_;                       ///< a view of the pinned version
+
+        public: // operations
+
+            snapshot_t(reader_slot_t& slot, const node_t* root, const kd_build_options& options, const metric_t& metric)
+                : slot_(&slot), tree_(metric) {
+                tree_.storage().reset(root, options);
+            }
+
+            snapshot_t(snapshot_t&& other) noexcept
+                : slot_(other.slot_), tree_(std::move(other.tree_)) {
+                other.slot_ = nullptr;
+            }
+
+            snapshot_t& operator=(snapshot_t&& other) noexcept {
+                release();
+                slot_ = other.slot_;
+                tree_ = std::move(other.tree_);
+                other.slot_ = nullptr;
+                return *this;
+            }
+
+            snapshot_t(const snapshot_t&) = delete;
+            snapshot_t& operator=(const snapshot_t&) = delete;
+
+            ~snapshot_t() {
+                release();
+            }
+
+            // access to the pinned version
+            inline const tree_t& operator*() const noexcept { return tree_; }
+            inline const tree_t* operator->() const noexcept { return &tree_; }
+
+            /** Unpins the version early, leaving an empty snapshot.
+            */
+            inline void release() noexcept {
+                if (slot_ != nullptr)
+                    slot_->epoch.store(0);
+                slot_ = nullptr;
+                tree_.storage().reset(nullptr, tree_.storage().options());
+            }
+        };
+
+    private: // vars
+
+        std::atomic<const node_t*> root_{ nullptr };    ///< the root of the current version
+        std::atomic<std::uint64_t> epoch_{ 1 };         ///< incremented by every published version
+        mutable std::vector<reader_slot_t> slots_;      ///< the epochs pinned by the readers
+        std::deque<retired_node_t> retired_;            ///< replaced nodes not freed yet, oldest first
+        std::mutex write_mutex_;                        ///< serializes the writers
+        kd_build_options options_;                      ///< parameters for building and rebalancing
+        metric_t metric_;                               ///< the distance metric
+        size_t n_erased_ = 0;                           ///< number of erased nodes in the current version
+
+    public: // ctors & dtor
+
+        /** Creates an empty tree whose inserts follow the given parameters, e.g. kd_build_options::balance.
+        @param max_readers The number of snapshots that can be alive at once; further readers spin until one is released.
+        */
+        explicit concurrent_kd_tree(
+            const kd_build_options& options = kd_build_options(),
+            const metric_t& metric = metric_t(),
+            const size_t max_readers = 64)
+            : slots_(std::max(max_readers, size_t(1))), options_(options), metric_(metric)
+        {}
+
+        /** Creates a balanced tree from the given elements with the given construction parameters.
+        CAUTION: Reorders the given range.
+        */
+        template< typename iter_t>
+        concurrent_kd_tree(
+            const iter_t start,
+            const iter_t end,
+            const kd_build_options& options = kd_build_options(),
+            const metric_t& metric = metric_t(),
+            const size_t max_readers = 64)
+            : concurrent_kd_tree(options, metric, max_readers) {
+            root_.store(create_kd_node_hierarchy(start, end, 0, 0));
+        }
+
+        concurrent_kd_tree(const concurrent_kd_tree&) = delete;
+        concurrent_kd_tree& operator=(const concurrent_kd_tree&) = delete;
+
+        ~concurrent_kd_tree() {
+            assert(std::all_of(slots_.begin(), slots_.end(), [](const reader_slot_t& s) { return s.epoch.load() == 0; })
+                && "snapshots must not outlive the tree");
+            for (const auto& r : retired_)
+                delete r.second;
+            delete_subtree(root_.load());
+        }
+
+    public: // methods
+
+        /** Pins the current version for reading. Never blocks on writers.
+        */
+        snapshot_t snapshot() const {
+            const size_t n_slots = slots_.size();
+            const size_t first = std::hash<std::thread::id>()(std::this_thread::get_id());
+            for (size_t i = 0;; ++i) {
+                reader_slot_t& slot = slots_[(first + i) % n_slots];
+                std::uint64_t expected = 0;
+                // the pinned epoch may be outdated by the time it is visible, which only delays freeing
+                if (slot.epoch.load(std::memory_order_relaxed) == 0 && slot.epoch.compare_exchange_strong(expected, epoch_.load()))
+                    return snapshot_t(slot, root_.load(), options_, metric_);
+                if (i % n_slots == n_slots - 1)
+                    std::this_thread::yield();
+            }
+        }
+
+        /** Returns the number of data elements in the current version.
+        */
+        inline size_t size() const {
+            return snapshot()->size();
+        }
+
+        /** Publishes a version with the given data element inserted.
+        If kd_build_options::balance is set, rebuilds the topmost subtree on the insertion path that became unbalanced.
+        */
+        void insert(const data_t& data) {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            std::vector<const node_t*> replaced;
+            const node_t* root = do_insert(root_.load(), data, 0, replaced);
+            publish(root, replaced);
+        }
+
+        /** Publishes a version with one data element with the same coordinates as the given one erased.
+        Once the share of erased elements exceeds kd_build_options::max_erased, the version is rebuilt without them.
+        @return Returns whether such an element was found.
+        */
+        bool erase(const data_t& data) {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            std::vector<const node_t*> replaced;
+            const node_t* root = do_erase(root_.load(), data, replaced);
+            if (root == nullptr)
+                return false;
+            ++n_erased_;
+
+            if (options_.max_erased > 0.f && n_erased_ > options_.max_erased * (n_erased_ + root->size)) {
+                std::vector<data_t> points;
+                points.reserve(root->size);
+                collect_subtree(root, points, replaced); // also retires the unpublished path copies, which no reader sees
+                root = create_kd_node_hierarchy(points.begin(), points.end(), 0, 0);
+            }
+            publish(root, replaced);
+            return true;
+        }
+
+        /** Returns the tree's distance metric.
+        */
+        inline const metric_t& metric() const noexcept {
+            return metric_;
+        }
+
+    private: // helpers
+
+        /** Makes the given root the current version, retires the given nodes and frees retired nodes no reader can reach.
+        */
+        void publish(const node_t* root, const std::vector<const node_t*>& replaced) {
+            root_.store(root);
+            const std::uint64_t retired_epoch = epoch_.fetch_add(1);
+            for (const node_t* n : replaced)
+                retired_.emplace_back(retired_epoch, n);
+
+            // readers that pinned a later epoch loaded a root published after the nodes were replaced
+            std::uint64_t oldest_pinned = epoch_.load();
+            for (const reader_slot_t& slot : slots_) {
+                const std::uint64_t pinned = slot.epoch.load();
+                if (pinned != 0)
+                    oldest_pinned = std::min(oldest_pinned, pinned);
+            }
+            while (!retired_.empty() && retired_.front().first < oldest_pinned) {
+                delete retired_.front().second;
+                retired_.pop_front();
+            }
+        }
+
+        /** Recursively copies the insertion path, or rebuilds the topmost subtree on it that becomes unbalanced.
+        @param axis The splitting axis of a new node.
+        @param replaced Collects the nodes of the current version that the new version does not contain.
+        @return Returns the root of the new subtree.
+        */
+        const node_t* do_insert(const node_t* n, const data_t& data, const size_t axis, std::vector<const node_t*>& replaced) {
+            assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+
+            if (n == nullptr) {
+                node_t* ret = new node_t();
+                ret->data = data;
+                ret->axis = static_cast<std::uint8_t>(axis);
+                ret->bounds.extend(data);
+                return ret;
+            }
+
+            const bool go_left = data[n->axis] <= n->data[n->axis];
+            const size_t left_size = (n->left == nullptr ? 0 : n->left->size) + go_left;
+            const size_t right_size = (n->right == nullptr ? 0 : n->right->size) + !go_left;
+            if (options_.unbalanced(std::max(left_size, right_size), n->size + 1)) {
+                std::vector<data_t> points;
+                points.reserve(n->size + 1);
+                collect_subtree(n, points, replaced);
+                points.push_back(data);
+                return create_kd_node_hierarchy(points.begin(), points.end(), n->axis, 0);
+            }
+
+            node_t* ret = new node_t(*n);
+            replaced.push_back(n);
+            ++ret->size;
+            ret->bounds.extend(data);
+            if (go_left)
+                ret->left = do_insert(n->left, data, (n->axis + 1) % n_dims, replaced);
+            else
+                ret->right = do_insert(n->right, data, (n->axis + 1) % n_dims, replaced);
+            return ret;
+        }
+
+        /** Recursively copies the path to a point to erase, with that point marked as erased.
+        @param replaced Collects the nodes of the current version that the new version does not contain.
+        @return Returns the root of the new subtree, nullptr if no such point was found.
+        */
+        const node_t* do_erase(const node_t* n, const data_t& data, std::vector<const node_t*>& replaced) {
+            if (n == nullptr || n->size == 0 || !n->bounds.contains(data))
+                return nullptr;
+
+            node_t* ret = nullptr;
+            if (!n->erased && detail::kd_equal_coordinates<n_dims>(n->data, data)) {
+                ret = new node_t(*n);
+                ret->erased = true;
+            }
+            else if (const node_t* left = do_erase(n->left, data, replaced)) {
+                ret = new node_t(*n);
+                ret->left = left;
+            }
+            else if (const node_t* right = do_erase(n->right, data, replaced)) {
+                ret = new node_t(*n);
+                ret->right = right;
+            }
+            else
+                return nullptr;
+
+            replaced.push_back(n);
+            --ret->size;
+            return ret;
+        }
+
+        /** Recursively creates a kd tree hierarchy from the elements in the given ranges.
+        */
+        template< typename iter_t>
+        const node_t* create_kd_node_hierarchy(const iter_t start, const iter_t end, size_t axis, const size_t depth) {
+            assert(axis < n_dims && "axis must be smaller than the number of point dimensions");
+
+            const auto n_points = std::distance(start, end);
+            if (n_points < 1)
+                return nullptr;
+
+            iter_t middle = detail::kd_split_range<data_t, n_dims>(start, end, axis, options_.split);
+
+            node_t* ret = new node_t();
+            ret->data = *middle;
+            ret->axis = static_cast<std::uint8_t>(axis);
+            axis = (axis + 1) % n_dims;
+            if (options_.fork(depth, static_cast<size_t>(n_points))) {
+                // the partitions are disjoint, so the left one can be built concurrently
+                auto left = std::async(std::launch::async, [&]() {
+                    return create_kd_node_hierarchy(start, middle, axis, depth + 1); });
+                ret->right = create_kd_node_hierarchy(std::next(middle, 1), end, axis, depth + 1);
+                ret->left = left.get();
+            }
+            else {
+                ret->left = create_kd_node_hierarchy(start, middle, axis, depth + 1);
+                ret->right = create_kd_node_hierarchy(std::next(middle, 1), end, axis, depth + 1);
+            }
+
+            ret->bounds.extend(ret->data);
+            for (const node_t* child : { ret->left, ret->right })
+                if (child != nullptr) {
+                    ret->size += child->size;
+                    ret->bounds.extend(child->bounds);
+                }
+            return ret;
+        }
+
+        /** Collects copies of the points of the given subtree that are not erased, and the subtree's nodes.
+        */
+        void collect_subtree(const node_t* subtree, std::vector<data_t>& points, std::vector<const node_t*>& nodes) {
+            detail::kd_stack<const node_t*> stack;
+            stack.push(subtree);
+            while (!stack.empty()) {
+                const node_t* n = stack.pop();
+                if (n->erased)
+                    --n_erased_;
+                else
+                    points.push_back(n->data);
+                nodes.push_back(n);
+                if (n->left != nullptr)
+                    stack.push(n->left);
+                if (n->right != nullptr)
+                    stack.push(n->right);
+            }
+        }
+
+        /** Frees the nodes of the given subtree.
+        */
+        static void delete_subtree(const node_t* subtree) {
+            detail::kd_stack<const node_t*> stack;
+            if (subtree != nullptr)
+                stack.push(subtree);
+            while (!stack.empty()) {
+                const node_t* n = stack.pop();
+                if (n->left != nullptr)
+                    stack.push(n->left);
+                if (n->right != nullptr)
+                    stack.push(n->right);
+                delete n;
+            }
+        }
+    };
+
+} // END namespace barn
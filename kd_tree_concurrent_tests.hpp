@@ -0,0 +1,106 @@
+/******************************************************************************
+/* @file Test routines for barn::concurrent_kd_tree.
+/*
+/* @author langenhagen
+/* @version 161017
+/*****************************************************************************/
+#pragma once
+
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "kd_tree_concurrent.hpp"
+#include "kd_tree_tests.hpp"
+#include "barn_test/FunctionTest.hpp"
+
+using namespace std;
+using namespace unittest;
+
+
+/// Builds a tree from half of n random points; then the given number of writers insert the other half and erase every
+/// fifth point while as many readers query snapshots. Compares a snapshot taken before the writes with a linear scan
+/// over the first half and one taken afterwards with a linear scan over the remaining points; every snapshot taken
+/// meanwhile must agree with itself.
+size_t kd_concurrent_tree_snapshot_mismatches(const size_t n_points, const size_t n_threads, const float max_erased) {
+    using namespace kd_tree_tests;
+    using tree_t = barn::concurrent_kd_tree<point_t<3>, 3>;
+    static_assert(is_same<decltype(declval<tree_t::tree_t>().find_k_nearest(point_t<3>(), 1)), vector<const point_t<3>*>>::value,
+        "snapshots share their points with other threads, so queries must hand them out read-only");
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.balance = 0.7f;
+    options.max_erased = max_erased;
+    auto input = vector<point_t<3>>(points.begin(), points.begin() + n_points / 2);
+    const vector<point_t<3>> first_half = input;
+    tree_t tree(input.begin(), input.end(), options);
+
+    size_t ret = 0;
+    {
+        const tree_t::snapshot_t before = tree.snapshot();
+
+        atomic<size_t> n_inserting{ n_threads }, n_writers{ n_threads }, mismatches{ 0 };
+        vector<thread> threads;
+        for (size_t t = 0; t < n_threads; ++t) {
+            threads.emplace_back([&, t]() {
+                for (size_t i = n_points / 2 + t; i < n_points; i += n_threads)
+                    tree.insert(points[i]);
+                --n_inserting;
+                while (n_inserting > 0) // the points to erase may be another writer's
+                    this_thread::yield();
+                for (size_t i = t * 5; i < n_points; i += n_threads * 5)
+                    mismatches += !tree.erase(points[i]);
+                --n_writers;
+            });
+            threads.emplace_back([&, t]() {
+                const auto centers = random_points<3>(10, unsigned(t + 2));
+                do {
+                    for (const auto& c : centers) {
+                        const tree_t::snapshot_t snapshot = tree.snapshot();
+                        mismatches += snapshot->count_in_range(c, 0.2f) != snapshot->find_points_within_range(c, 0.2f).size();
+                        mismatches += snapshot->find_k_nearest(c, 5).size() != min(size_t(5), snapshot->size());
+                    }
+                } while (n_writers > 0);
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+        ret += mismatches;
+
+        ret += (before->size() != first_half.size()) + query_mismatches<tree_t::tree_t, 3>(*before, first_half);
+    }
+
+    vector<point_t<3>> live;
+    for (size_t i = 0; i < n_points; ++i)
+        if (i % 5 != 0)
+            live.push_back(points[i]);
+    const tree_t::snapshot_t after = tree.snapshot();
+    return ret + (tree.size() != live.size()) + query_mismatches<tree_t::tree_t, 3>(*after, live);
+}
+
+
+/// Calls the testing routine
+void kd_tree_concurrent_test_all() {
+
+    auto& os = std::cout;
+    auto all_passed = true;
+    os << "\n";
+
+    os << "Test concurrent_kd_tree snapshots" << std::endl;
+    FunctionTest<size_t, size_t, size_t, float> snapshot_test(kd_concurrent_tree_snapshot_mismatches);
+    snapshot_test.verbosity_level = verbosity::NORMAL;
+    snapshot_test.test("empty", size_t(0), size_t(0), size_t(2), 0.f);
+    snapshot_test.test("1 writer, 1 reader", size_t(0), size_t(4000), size_t(1), 0.f);
+    snapshot_test.test("4 writers, 4 readers", size_t(0), size_t(4000), size_t(4), 0.f);
+    snapshot_test.test("4 writers, 4 readers, rebuilding", size_t(0), size_t(4000), size_t(4), 0.1f);
+    all_passed &= snapshot_test.write_test_series_summary();
+
+    os << "\n";
+    if (all_passed) os << "+++ ALL TEST SERIES PASSED +++ :)))";
+    else            os << "--- SOME ERRORS OCCURED ---    :(((";
+    os << "\n\n\n";
+}
@@ -0,0 +1,468 @@
+/******************************************************************************
+/* @file Persists built barn::kd_trees in files that are queried in place via mmap.
+/*
+/* Save a tree with the flat layout and open the file with the mapped layout:
+/*
+/*      barn::kd_tree<point_t, 3, barn::kd_layout::flat> tree(points.begin(), points.end());
+/*      barn::save_kd_tree("points.kdt", tree);
+/*
+/*      barn::kd_tree<point_t, 3, barn::kd_layout::mapped> mapped;
+/*      if (barn::open_kd_tree("points.kdt", mapped))
+/*          auto neighbors = mapped.find_k_nearest(center, 8);
+/*
+/* Opening deserializes nothing: it checks the header and the node array, the OS pages the points in on demand and
+/* processes that open the same file share its pages. Mapped trees are read-only.
+/* Requires POSIX mmap.
+/*
+/* @author langenhagen
+/* @version 161017
+/******************************************************************************/
+#pragma once
+
+///////////////////////////////////////////////////////////////////////////////
+//INCLUDES C/C++ standard library (and other external libraries)
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+///////////////////////////////////////////////////////////////////////////////
+//INCLUDES project headers
+
+#include "kd_tree.hpp"
+
+///////////////////////////////////////////////////////////////////////////////
+// NAMESPACE, CONSTANTS and TYPE DECLARATIONS/IMPLEMENTATIONS
+
+
+namespace barn {
+
+    /// Implementation details, clients never use these directly.
+    namespace detail {
+
+        /// Version of the kd-tree file format; files of other versions are rejected.
+        constexpr std::uint32_t kd_file_version = 2;
+
+        /// Alignment of the arrays within a kd-tree file.
+        constexpr std::uint64_t kd_file_alignment = 64;
+
+        /** Leading header of a kd-tree file.
+        All offsets are relative to the start of the file, so the file can be mapped at any address.
+        The arrays follow in this order: nodes, points, then one coordinate array per axis.
+        */
+        struct kd_file_header {
+            char magic[8];                  ///< "barn-kdt"
+            std::uint32_t version;          ///< kd_file_version
+            std::uint32_t byte_order;       ///< 0x01020304 as written by the saving machine
+            std::uint32_t n_dims;           ///< number of dimensions of the points
+            std::uint32_t data_size;        ///< sizeof(data_t)
+            std::uint32_t data_align;       ///< alignof(data_t)
+            std::uint32_t coord_size;       ///< sizeof(coord_t)
+            std::uint32_t coord_kind;       ///< 0: unsigned integer, 1: signed integer, 2: floating point
+            std::uint32_t node_size;        ///< sizeof(node_t)
+            std::uint64_t n_nodes;          ///< number of nodes
+            std::uint64_t n_points;         ///< number of points
+            std::uint64_t nodes_offset;     ///< offset of the node array
+            std::uint64_t points_offset;    ///< offset of the point array
+            std::uint64_t coords_offset;    ///< offset of the first coordinate array
+            std::uint64_t coords_stride;    ///< distance between two coordinate arrays
+            std::uint64_t file_size;        ///< size of the whole file
+            std::uint64_t payload_checksum; ///< checksum of everything behind the header
+            std::uint64_t header_checksum;  ///< checksum of the header up to this field
+
+            /** Creates the header of a file holding the given numbers of nodes and points of the given storage.
+            */
+            template< typename data_t, size_t n_dims, typename node_t, typename coord_t>
+            static kd_file_header create(const size_t n_nodes, const size_t n_points) {
+                kd_file_header ret;
+                std::memset(&ret, 0, sizeof(ret));
+                std::memcpy(ret.magic, "barn-kdt", sizeof(ret.magic));
+                ret.version = kd_file_version;
+                ret.byte_order = 0x01020304;
+                ret.n_dims = static_cast<std::uint32_t>(n_dims);
+                ret.data_size = static_cast<std::uint32_t>(sizeof(data_t));
+                ret.data_align = static_cast<std::uint32_t>(alignof(data_t));
+                ret.coord_size = static_cast<std::uint32_t>(sizeof(coord_t));
+                ret.coord_kind = std::is_floating_point<coord_t>::value ? 2 : std::is_signed<coord_t>::value ? 1 : 0;
+                ret.node_size = static_cast<std::uint32_t>(sizeof(node_t));
+                ret.n_nodes = n_nodes;
+                ret.n_points = n_points;
+                ret.nodes_offset = align(sizeof(kd_file_header));
+                ret.points_offset = align(ret.nodes_offset + n_nodes * sizeof(node_t));
+                ret.coords_offset = align(ret.points_offset + n_points * sizeof(data_t));
+                ret.coords_stride = align(n_points * sizeof(coord_t));
+                ret.file_size = ret.coords_offset + n_dims * ret.coords_stride;
+                return ret;
+            }
+
+            /** Tells whether this header describes a well-formed file of the given size that was saved
+            from a tree of the same data_t and n_dims on a machine of the same byte order.
+            */
+            template< typename data_t, size_t n_dims, typename node_t, typename coord_t>
+            bool matches(const std::uint64_t actual_file_size) const {
+                const kd_file_header expected = create<data_t, n_dims, node_t, coord_t>(
+                    static_cast<size_t>(n_nodes), static_cast<size_t>(n_points));
+                return std::memcmp(magic, expected.magic, sizeof(magic)) == 0
+                    && header_checksum == checksum(this, offsetof(kd_file_header, header_checksum))
+                    && version == expected.version
+                    && byte_order == expected.byte_order
+                    && n_dims == expected.n_dims
+                    && data_size == expected.data_size
+                    && data_align == expected.data_align
+                    && coord_size == expected.coord_size
+                    && coord_kind == expected.coord_kind
+                    && node_size == expected.node_size
+                    && n_points < std::numeric_limits<std::uint32_t>::max()
+                    && n_nodes <= n_points
+                    && nodes_offset == expected.nodes_offset
+                    && points_offset == expected.points_offset
+                    && coords_offset == expected.coords_offset
+                    && coords_stride == expected.coords_stride
+                    && file_size == expected.file_size
+                    && file_size == actual_file_size;
+            }
+
+            /** Rounds the given offset up to the next multiple of kd_file_alignment.
+            */
+            static inline std::uint64_t align(const std::uint64_t offset) noexcept {
+                return (offset + kd_file_alignment - 1) / kd_file_alignment * kd_file_alignment;
+            }
+
+            /** Computes the 64 bit FNV-1a hash of the given bytes, continuing the given hash.
+            */
+            static std::uint64_t checksum(const void* data, const size_t size, std::uint64_t hash = 14695981039346656037ull) {
+                const unsigned char* bytes = static_cast<const unsigned char*>(data);
+                for (size_t i = 0; i < size; ++i)
+                    hash = (hash ^ bytes[i]) * 1099511628211ull;
+                return hash;
+            }
+        };
+
+    } // END namespace detail
+
+
+    /** Serves the nodes and points of a tree saved with save_kd_tree() straight from a read-only memory mapping.
+    Shares the node layout with kd_flat_storage. Mapped trees cannot be modified.
+    */
+    template< typename data_t, size_t n_dims>
+    class kd_mapped_storage {
+    public: // inner typedefs
+        using flat_storage_t = kd_flat_storage<data_t, n_dims>;
+        using index_t = typename flat_storage_t::index_t;
+        using node_t = typename flat_storage_t::node_t;
+        using node_ptr = index_t;
+        using node_handle = index_t;
+        using element_t = const data_t;    ///< the points are mapped read-only, so queries hand them out read-only
+        using coord_t = typename flat_storage_t::coord_t;
+        using box_t = typename flat_storage_t::box_t;
+        using const_iterator = const data_t*;
+        using iterator = const_iterator;    ///< the points are mapped read-only
+
+        static constexpr index_t null_index = flat_storage_t::null_index;
+        static constexpr size_t max_bucket_size = flat_storage_t::max_bucket_size;
+
+        static_assert(std::is_trivially_copyable<data_t>::value, "only trivially copyable points can be mapped");
+
+    private: // vars
+
+        void* mapping_ = nullptr;                           ///< the start of the mapped file
+        size_t mapping_size_ = 0;                           ///< the size of the mapped file
+        const node_t* nodes_ = nullptr;                     ///< all nodes, the root is at index 0
+        size_t n_nodes_ = 0;                                ///< number of nodes
+        const data_t* points_ = nullptr;                    ///< the points; mapped read-only
+        size_t n_points_ = 0;                               ///< number of points
+        std::array<const coord_t*, n_dims> coords_;         ///< the points' coordinates, one array per axis
+        kd_build_options options_;                          ///< unused, mapped trees are never rebuilt
+
+    public: // ctors & dtor
+
+        kd_mapped_storage() noexcept {
+            coords_.fill(nullptr);
+        }
+
+        kd_mapped_storage(const kd_mapped_storage&) = delete;
+        kd_mapped_storage& operator=(const kd_mapped_storage&) = delete;
+
+        kd_mapped_storage(kd_mapped_storage&& other) noexcept
+            : kd_mapped_storage() {
+            swap(other);
+        }
+
+        kd_mapped_storage& operator=(kd_mapped_storage&& other) noexcept {
+            close();
+            swap(other);
+            return *this;
+        }
+
+        ~kd_mapped_storage() {
+            close();
+        }
+
+    public: // methods
+
+        /** Maps the given file saved with save_kd_tree(); closes the currently mapped file first.
+        The header is always checked, which rejects files of other data_t, n_dims, format versions or byte orders,
+        and so are the nodes, see valid_nodes(), so corrupt child indices or point ranges cannot make queries read out
+        of bounds. Corrupt points and coordinates are only caught by the checksum.
+        @param verify Whether to also check the checksum of the whole file, which reads all of it.
+        @return TRUE in case of success,
+                FALSE if the file cannot be mapped or does not match.
+        */
+        bool open(const std::string& filename, const bool verify = false) {
+            close();
+
+            const int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            if (::fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(detail::kd_file_header))) {
+                ::close(fd);
+                return false;
+            }
+            void* mapping = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (mapping == MAP_FAILED)
+                return false;
+            mapping_ = mapping;
+            mapping_size_ = static_cast<size_t>(st.st_size);
+
+            const char* bytes = static_cast<const char*>(mapping_);
+            const detail::kd_file_header& header = *reinterpret_cast<const detail::kd_file_header*>(bytes);
+            if (!header.matches<data_t, n_dims, node_t, coord_t>(mapping_size_)
+                || (verify && header.payload_checksum != detail::kd_file_header::checksum(
+                    bytes + header.nodes_offset, mapping_size_ - header.nodes_offset))
+                || !valid_nodes(reinterpret_cast<const node_t*>(bytes + header.nodes_offset),
+                    static_cast<size_t>(header.n_nodes), static_cast<size_t>(header.n_points))) {
+                close();
+                return false;
+            }
+
+            nodes_ = reinterpret_cast<const node_t*>(bytes + header.nodes_offset);
+            n_nodes_ = static_cast<size_t>(header.n_nodes);
+            points_ = reinterpret_cast<const data_t*>(bytes + header.points_offset);
+            n_points_ = static_cast<size_t>(header.n_points);
+            for (size_t d = 0; d < n_dims; ++d)
+                coords_[d] = reinterpret_cast<const coord_t*>(bytes + header.coords_offset + d * header.coords_stride);
+            return true;
+        }
+
+        /** Unmaps the file, leaving an empty tree.
+        */
+        void close() noexcept {
+            if (mapping_ != nullptr)
+                ::munmap(mapping_, mapping_size_);
+            mapping_ = nullptr;
+            mapping_size_ = 0;
+            nodes_ = nullptr;
+            n_nodes_ = 0;
+            points_ = nullptr;
+            n_points_ = 0;
+            coords_.fill(nullptr);
+        }
+
+        /** Returns the parameters for building and rebalancing.
+        */
+        inline const kd_build_options& options() const noexcept { return options_; }
+
+        /** Returns the number of erased points still in the tree, i.e. 0 since saved trees are compacted.
+        */
+        inline size_t erased_count() const noexcept { return 0; }
+
+        // node access used by the tree algorithms
+        inline node_handle root() const noexcept { return n_nodes_ == 0 ? null_index : 0; }
+        static inline bool is_null(const node_handle n) noexcept { return n == null_index; }
+        inline node_handle left(const node_handle n) const noexcept { return nodes_[n].left; }
+        inline node_handle right(const node_handle n) const noexcept { return nodes_[n].right; }
+        inline size_t axis(const node_handle n) const noexcept { return nodes_[n].axis; }
+        inline coord_t split(const node_handle n) const noexcept { return nodes_[n].split; }
+        inline size_t point_count(const node_handle n) const noexcept { return nodes_[n].count; }
+        static inline bool is_erased(const node_handle, size_t) noexcept { return false; }
+        inline size_t subtree_size(const node_handle n) const noexcept { return nodes_[n].size; }
+        inline const box_t& bounds(const node_handle n) const noexcept { return nodes_[n].bounds; }
+
+        /** Returns the i-th point of the node.
+        */
+        inline const data_t& point(const node_handle n, const size_t i) const noexcept {
+            return points_[nodes_[n].first + i];
+        }
+
+        /** Writes the reduced distances between the node's points and the center to out.
+        The bound only matters for quantized storages, see kd_flat_storage::distances().
+        @return Returns the number of points of the node.
+        */
+        template< typename metric_t>
+        inline size_t distances(
+            const node_handle n,
+            const data_t& center,
+            const metric_t& metric,
+            coord_t* out,
+            const coord_t = std::numeric_limits<coord_t>::max()) const {
+            const node_t& node = nodes_[n];
+            std::array<const coord_t*, n_dims> coords;
+            for (size_t d = 0; d < n_dims; ++d)
+                coords[d] = coords_[d] + node.first;
+            detail::kd_bucket_kernel<metric_t, coord_t, n_dims>::distances(metric, coords, node.count, center, out);
+            return node.count;
+        }
+
+        /** Returns the number of bytes allocated by the tree on the heap, i.e. 0; the mapped file is not counted.
+        */
+        inline size_t memory_footprint() const noexcept { return 0; }
+
+        /** Calls f with every point, in memory order.
+        */
+        template< typename func_t>
+        void for_each_point(func_t&& f) const {
+            for (const data_t* p = points_; p != points_ + n_points_; ++p)
+                f(*p);
+        }
+
+        // iterator methods; iterates the points in memory order
+        inline const_iterator begin() const noexcept { return points_; }
+        inline const_iterator end() const noexcept { return points_ + n_points_; }
+
+    private: // helpers
+
+        /** Tells whether the given nodes form a tree over the given number of points that queries can walk safely:
+        every child comes after its parent, as saved trees are laid out in pre-order, so there are no cycles, every
+        node's points lie within the point array and fit a bucket, its axis is a valid one, and every subtree size
+        adds up. Reads every node once, but no points.
+        */
+        static bool valid_nodes(const node_t* nodes, const size_t n_nodes, const size_t n_points) {
+            if ((n_nodes == 0) != (n_points == 0))
+                return false;
+            for (size_t i = n_nodes; i-- > 0;) {
+                const node_t& node = nodes[i];
+                if (node.axis >= n_dims
+                    || node.count > max_bucket_size
+                    || (node.count > 0 && static_cast<size_t>(node.first) + node.count > n_points))
+                    return false;
+                size_t size = node.count;
+                for (const index_t child : { node.left, node.right }) {
+                    if (child == null_index)
+                        continue;
+                    if (child <= i || child >= n_nodes)
+                        return false;
+                    size += nodes[child].size;
+                }
+                if (node.size != size)
+                    return false;
+            }
+            return n_nodes == 0 || nodes[0].size == n_points;
+        }
+
+        /** Exchanges the mappings of this and the given storage.
+        */
+        void swap(kd_mapped_storage& other) noexcept {
+            std::swap(mapping_, other.mapping_);
+            std::swap(mapping_size_, other.mapping_size_);
+            std::swap(nodes_, other.nodes_);
+            std::swap(n_nodes_, other.n_nodes_);
+            std::swap(points_, other.points_);
+            std::swap(n_points_, other.n_points_);
+            std::swap(coords_, other.coords_);
+        }
+    };
+
+
+    namespace kd_layout {
+
+        /** A read-only memory mapping of a file saved with save_kd_tree(), see barn::open_kd_tree().
+        */
+        struct mapped {
+            template< typename data_t, size_t n_dims>
+            using storage = kd_mapped_storage<data_t, n_dims>;
+        };
+
+    } // END namespace kd_layout
+
+
+    /** Saves the given tree to a file that open_kd_tree() maps.
+    Erased points and leftovers from rebuilds are compacted away in a copy of the tree first.
+    Truncates an existing file.
+    @return TRUE in case of success,
+            FALSE in case of error.
+    */
+    template< typename data_t, size_t n_dims, typename metric_t>
+    bool save_kd_tree(const std::string& filename, const kd_tree<data_t, n_dims, kd_layout::flat, metric_t>& tree) {
+        using storage_t = kd_flat_storage<data_t, n_dims>;
+        using node_t = typename storage_t::node_t;
+        using coord_t = typename storage_t::coord_t;
+        static_assert(std::is_trivially_copyable<data_t>::value, "only trivially copyable points can be saved");
+
+        const storage_t* storage = &tree.storage();
+        storage_t compacted;
+        if (storage->erased_count() > 0 || storage->points().size() > tree.size()) {
+            compacted = *storage;
+            compacted.compact();
+            storage = &compacted;
+        }
+
+        const auto& nodes = storage->nodes();
+        const auto& points = storage->points();
+        detail::kd_file_header header = detail::kd_file_header::create<data_t, n_dims, node_t, coord_t>(nodes.size(), points.size());
+
+        std::ofstream out(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return false;
+
+        // the header is written last, once the payload checksum is known; arrays are padded with zeros to their offsets
+        const char zeros[detail::kd_file_alignment] = {};
+        std::uint64_t offset = sizeof(header);
+        std::uint64_t checksum = detail::kd_file_header::checksum(nullptr, 0);
+        auto write_at = [&](const std::uint64_t at, const void* data, const size_t size) {
+            const size_t padding = static_cast<size_t>(at - offset);
+            out.write(zeros, padding);
+            if (offset >= header.nodes_offset)
+                checksum = detail::kd_file_header::checksum(zeros, padding, checksum);
+            out.write(static_cast<const char*>(data), size);
+            checksum = detail::kd_file_header::checksum(data, size, checksum);
+            offset = at + size;
+        };
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_at(header.nodes_offset, nodes.data(), nodes.size() * sizeof(node_t));
+        write_at(header.points_offset, points.data(), points.size() * sizeof(data_t));
+        for (size_t d = 0; d < n_dims; ++d) {
+            // quantized trees keep no full precision coordinate arrays, the file always has them
+            std::vector<coord_t> gathered;
+            const coord_t* coords = storage->coords(d).data();
+            if (storage->coords(d).size() != points.size()) {
+                gathered.reserve(points.size());
+                for (const data_t& p : points)
+                    gathered.push_back(p[d]);
+                coords = gathered.data();
+            }
+            write_at(header.coords_offset + d * header.coords_stride, coords, points.size() * sizeof(coord_t));
+        }
+        write_at(header.file_size, nullptr, 0);
+
+        header.payload_checksum = checksum;
+        header.header_checksum = detail::kd_file_header::checksum(&header, offsetof(detail::kd_file_header, header_checksum));
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        return !out.fail();
+    }
+
+    /** Maps the given file saved with save_kd_tree() into the given tree; see kd_mapped_storage::open().
+    @return TRUE in case of success,
+            FALSE if the file cannot be mapped or was saved from a tree of another data_t or n_dims.
+    */
+    template< typename data_t, size_t n_dims, typename metric_t>
+    inline bool open_kd_tree(const std::string& filename, kd_tree<data_t, n_dims, kd_layout::mapped, metric_t>& tree, const bool verify = false) {
+        return tree.storage().open(filename, verify);
+    }
+
+} // END namespace barn
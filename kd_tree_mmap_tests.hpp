@@ -0,0 +1,144 @@
+/******************************************************************************
+/* @file Test routines for saving and mapping barn::kd_trees.
+/*
+/* Writes its files to the working directory.
+/*
+/* @author langenhagen
+/* @version 161017
+/*****************************************************************************/
+#pragma once
+
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "kd_tree_mmap.hpp"
+#include "kd_tree_tests.hpp"
+#include "barn_test/FunctionTest.hpp"
+
+using namespace std;
+using namespace unittest;
+
+
+/// Saves a flat tree built from half of n random points, with the other half inserted and every fifth point erased,
+/// maps the file and compares the mapped tree's queries with a linear scan over the remaining points.
+size_t kd_tree_mmap_round_trip_mismatches(const size_t n_points, const size_t bucket_size, const bool quantize) {
+    using namespace kd_tree_tests;
+    const string filename = "kd_tree_mmap_tests.kdt";
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.bucket_size = bucket_size;
+    options.quantize = quantize;
+    options.balance = 0.7f;
+    options.max_erased = 0.f;
+    barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat> tree(points.begin(), points.begin() + n_points / 2, options);
+    for (size_t i = n_points / 2; i < n_points; ++i)
+        tree.insert(points[i]);
+    vector<point_t<3>> live;
+    for (size_t i = 0; i < n_points; ++i) {
+        if (i % 5 == 0)
+            tree.erase(points[i]);
+        else
+            live.push_back(points[i]);
+    }
+
+    size_t ret = !barn::save_kd_tree(filename, tree);
+    {
+        barn::kd_tree<point_t<3>, 3, barn::kd_layout::mapped> mapped;
+        static_assert(is_same<decltype(mapped.find_points_within_range(point_t<3>(), 0.f)), vector<const point_t<3>*>>::value,
+            "mapped points are read-only, so queries must hand them out read-only");
+        ret += !barn::open_kd_tree(filename, mapped, true);
+        ret += mapped.size() != live.size();
+        ret += query_mismatches<decltype(mapped), 3>(mapped, live);
+        vector<point_t<3>> iterated(mapped.begin(), mapped.end());
+        sort(iterated.begin(), iterated.end());
+        sort(live.begin(), live.end());
+        ret += iterated != live;
+    }
+    remove(filename.c_str());
+    return ret;
+}
+
+/// Saves a tree, damages the file in the given way and counts how often it can still be mapped, with and without
+/// verifying the payload checksum.
+///   0: truncates the file by one byte
+///   1: points the root's left child at the root
+///   2: flips a bit of a coordinate, which only the checksum detects
+size_t kd_tree_mmap_corrupt_file_acceptances(const size_t damage) {
+    using namespace kd_tree_tests;
+    using storage_t = barn::kd_flat_storage<point_t<3>, 3>;
+    const string filename = "kd_tree_mmap_tests.kdt";
+    const auto points = random_points<3>(1000, 1);
+    const barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat> tree(points.begin(), points.end());
+    if (!barn::save_kd_tree(filename, tree))
+        return 1;
+
+    const auto header_size = barn::detail::kd_file_header::align(sizeof(barn::detail::kd_file_header));
+    vector<char> bytes;
+    {
+        ifstream in(filename, ios::binary);
+        bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    switch (damage) {
+    case 0:
+        bytes.pop_back();
+        break;
+    case 1: {
+        const storage_t::index_t root = 0;
+        memcpy(&bytes[static_cast<size_t>(header_size) + offsetof(storage_t::node_t, left)], &root, sizeof(root));
+        break;
+    }
+    default:
+        bytes[bytes.size() - 1] ^= 1;
+        break;
+    }
+    {
+        ofstream out(filename, ios::binary | ios::trunc);
+        out.write(bytes.data(), bytes.size());
+    }
+
+    size_t ret = 0;
+    for (const bool verify : { false, true }) {
+        barn::kd_tree<point_t<3>, 3, barn::kd_layout::mapped> mapped;
+        ret += barn::open_kd_tree(filename, mapped, verify) && (verify || damage < 2);
+    }
+    remove(filename.c_str());
+    return ret;
+}
+
+
+/// Calls the testing routine
+void kd_tree_mmap_test_all() {
+
+    auto& os = std::cout;
+    auto all_passed = true;
+    os << "\n";
+
+    os << "Test kd_tree save and map round trips" << std::endl;
+    FunctionTest<size_t, size_t, size_t, bool> round_trip_test(kd_tree_mmap_round_trip_mismatches);
+    round_trip_test.verbosity_level = verbosity::NORMAL;
+    round_trip_test.test("empty", size_t(0), size_t(0), size_t(1), false);
+    round_trip_test.test("single points", size_t(0), size_t(4000), size_t(1), false);
+    round_trip_test.test("bucket size 16", size_t(0), size_t(4000), size_t(16), false);
+    round_trip_test.test("quantized, bucket size 16", size_t(0), size_t(4000), size_t(16), true);
+    all_passed &= round_trip_test.write_test_series_summary();
+
+    os << "Test kd_tree mapping corrupt files" << std::endl;
+    FunctionTest<size_t, size_t> corrupt_test(kd_tree_mmap_corrupt_file_acceptances);
+    corrupt_test.verbosity_level = verbosity::NORMAL;
+    corrupt_test.test("truncated file", size_t(0), size_t(0));
+    corrupt_test.test("cyclic node", size_t(0), size_t(1));
+    corrupt_test.test("flipped coordinate bit", size_t(0), size_t(2));
+    all_passed &= corrupt_test.write_test_series_summary();
+
+    os << "\n";
+    if (all_passed) os << "+++ ALL TEST SERIES PASSED +++ :)))";
+    else            os << "--- SOME ERRORS OCCURED ---    :(((";
+    os << "\n\n\n";
+}
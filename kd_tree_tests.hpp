@@ -0,0 +1,1092 @@
+/******************************************************************************
+/* @file Test routines for barn::kd_tree.
+/*
+/* Every test compares the tree with a linear scan over the same points and returns the number of mismatches,
+/* so every test case expects 0.
+/*
+/* @author langenhagen
+/* @version 161017
+/*****************************************************************************/
+#pragma once
+
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "kd_tree.hpp"
+#include "barn_test/FunctionTest.hpp"
+
+using namespace std;
+using namespace unittest;
+
+
+/// Helpers of the kd_tree tests.
+namespace kd_tree_tests {
+
+    template< size_t n_dims>
+    using point_t = array<float, n_dims>;
+
+    /// Coordinates outside the unit cube, see compacting_tree_with_twins().
+    const point_t<3> twin_at = { { 2.f, 2.f, 2.f } };
+
+    /// Returns n points uniformly distributed in the unit cube; the same ones for the same seed.
+    template< size_t n_dims>
+    vector<point_t<n_dims>> random_points(const size_t n, const unsigned seed) {
+        mt19937 rng(seed);
+        uniform_real_distribution<float> uniform(0.f, 1.f);
+        vector<point_t<n_dims>> ret(n);
+        for (auto& p : ret)
+            for (auto& c : p)
+                c = uniform(rng);
+        return ret;
+    }
+
+    /// Returns the reduced distance between the given points by the given metric, accumulated axis by axis.
+    template< size_t n_dims, typename metric_t>
+    float reduced_distance(const metric_t& metric, const point_t<n_dims>& a, const point_t<n_dims>& b) {
+        float ret = 0.f;
+        for (size_t d = 0; d < n_dims; ++d)
+            ret = metric.accumulate(ret, a[d] - b[d], d);
+        return ret;
+    }
+
+    /// Returns sorted copies of the given points, which read-only layouts hand out as const.
+    template< size_t n_dims, typename element_t>
+    vector<point_t<n_dims>> sorted_copies(const vector<element_t*>& found) {
+        vector<point_t<n_dims>> ret;
+        for (const point_t<n_dims>* p : found)
+            ret.push_back(*p);
+        sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+    /// Returns the sorted points within the given radius of the center, found by a linear scan.
+    template< size_t n_dims, typename metric_t>
+    vector<point_t<n_dims>> scan_range(const vector<point_t<n_dims>>& points, const point_t<n_dims>& center, const float radius, const metric_t& metric) {
+        vector<point_t<n_dims>> ret;
+        for (const auto& p : points)
+            if (reduced_distance<n_dims>(metric, p, center) <= metric.to_reduced(radius))
+                ret.push_back(p);
+        sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+    /// Returns the ascending reduced distances of the given points to the center.
+    template< size_t n_dims, typename element_t, typename metric_t>
+    vector<float> distances_of(const vector<element_t*>& found, const point_t<n_dims>& center, const metric_t& metric) {
+        vector<float> ret;
+        for (const point_t<n_dims>* p : found)
+            ret.push_back(reduced_distance<n_dims>(metric, *p, center));
+        sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+    /// Returns the ascending reduced distances of the k points closest to the center, found by a linear scan.
+    template< size_t n_dims, typename metric_t>
+    vector<float> scan_k_nearest(const vector<point_t<n_dims>>& points, const point_t<n_dims>& center, const size_t k, const metric_t& metric) {
+        vector<float> ret;
+        for (const auto& p : points)
+            ret.push_back(reduced_distance<n_dims>(metric, p, center));
+        sort(ret.begin(), ret.end());
+        ret.resize(min(k, ret.size()));
+        return ret;
+    }
+
+    /// Tells whether the given ascending distances are equal up to rounding.
+    inline bool same_distances(const vector<float>& a, const vector<float>& b) {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); ++i)
+            if (abs(a[i] - b[i]) > 1e-5f * (1.f + abs(b[i])))
+                return false;
+        return true;
+    }
+
+    /// Returns the radius that holds about 10 of n uniform points in the unit cube, by the euclidean metric in 3 dimensions.
+    inline float radius_for(const size_t n) {
+        return static_cast<float>(pow(10. / max(n, size_t(1)), 1. / 3)) * 0.7f;
+    }
+
+    /// Counts the radius queries around the given centers whose results or counts differ from a linear scan over points.
+    template< typename tree_t, size_t n_dims>
+    size_t range_mismatches(const tree_t& tree, const vector<point_t<n_dims>>& points, const vector<point_t<n_dims>>& centers, const float radius) {
+        size_t ret = 0;
+        for (const auto& c : centers) {
+            const vector<point_t<n_dims>> expected = scan_range<n_dims>(points, c, radius, tree.metric());
+            ret += sorted_copies<n_dims>(tree.find_points_within_range(c, radius)) != expected;
+            ret += tree.count_in_range(c, radius) != expected.size();
+        }
+        return ret;
+    }
+
+    /// Counts the k-nearest-neighbor queries around the given centers whose distances differ from a linear scan over points.
+    template< typename tree_t, size_t n_dims>
+    size_t k_nearest_mismatches(const tree_t& tree, const vector<point_t<n_dims>>& points, const vector<point_t<n_dims>>& centers, const size_t k) {
+        size_t ret = 0;
+        for (const auto& c : centers) {
+            const vector<float> expected = scan_k_nearest<n_dims>(points, c, k, tree.metric());
+            const auto found = tree.find_k_nearest(c, k);
+            ret += !same_distances(distances_of<n_dims>(found, c, tree.metric()), expected);
+            ret += !is_sorted(found.begin(), found.end(), [&](const point_t<n_dims>* a, const point_t<n_dims>* b) {
+                return reduced_distance<n_dims>(tree.metric(), *a, c) < reduced_distance<n_dims>(tree.metric(), *b, c); });
+        }
+        return ret;
+    }
+
+    /// Counts the mismatches of radius and 10-nearest-neighbor queries around 20 random centers.
+    /// The radius holds 10 points around the first center, whatever the metric and the number of dimensions,
+    /// and lies halfway to the 11th so rounding can't decide whether it's in range.
+    template< typename tree_t, size_t n_dims>
+    size_t query_mismatches(const tree_t& tree, const vector<point_t<n_dims>>& points, const unsigned seed = 7) {
+        const vector<point_t<n_dims>> centers = random_points<n_dims>(20, seed);
+        const vector<float> nearest = scan_k_nearest<n_dims>(points, centers.front(), 11, tree.metric());
+        const float radius = nearest.size() < 11 ? 0.1f : tree.metric().from_reduced((nearest[9] + nearest[10]) / 2);
+        return range_mismatches<tree_t, n_dims>(tree, points, centers, radius)
+            + k_nearest_mismatches<tree_t, n_dims>(tree, points, centers, 10);
+    }
+
+    /// A point with a payload, so elements can share coordinates and still differ.
+    struct labeled_point_t {
+        point_t<3> coords;
+        int id;
+
+        inline float& operator[](const size_t i) { return coords[i]; }
+        inline const float& operator[](const size_t i) const { return coords[i]; }
+    };
+
+    /// Returns a tree of the given layout of n labeled random points, labeled by their index, and two elements at
+    /// twin_at, outside the others, labeled -1 and -2. The tree has started to compact itself in the background.
+    template< typename layout_t>
+    unique_ptr<barn::kd_tree<labeled_point_t, 3, layout_t>> compacting_tree_with_twins(const size_t n_points) {
+        barn::kd_build_options options;
+        options.max_erased = 1e-4f;
+        options.grain_size = 1000;
+        vector<labeled_point_t> input;
+        for (const auto& p : random_points<3>(n_points, 1))
+            input.push_back({ p, int(input.size()) });
+        input.push_back({ twin_at, -1 });
+        input.push_back({ twin_at, -2 });
+        unique_ptr<barn::kd_tree<labeled_point_t, 3, layout_t>> ret(
+            new barn::kd_tree<labeled_point_t, 3, layout_t>(input.begin(), input.end(), options));
+        const auto points = random_points<3>(n_points, 1);
+        for (size_t i = 0; i <= n_points / 10000; ++i)
+            ret->erase(labeled_point_t{ points[i], 0 });
+        return ret;
+    }
+
+    /// Returns the sorted labels of the elements of the given tree at the given coordinates.
+    template< typename tree_t>
+    vector<int> ids_at(const tree_t& tree, const point_t<3>& at) {
+        vector<int> ret;
+        for (const labeled_point_t* p : tree.find_points_within_range(labeled_point_t{ at, 0 }, 0.f))
+            ret.push_back(p->id);
+        sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+} // END namespace kd_tree_tests
+
+
+/// Builds a tree of the given layout from n random points and compares radius queries with a linear scan.
+template< typename layout_t>
+size_t kd_tree_range_mismatches(const size_t n_points) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    auto input = points;
+    const barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end());
+    const auto centers = random_points<3>(20, 2);
+    return (tree.size() != n_points) + range_mismatches<decltype(tree), 3>(tree, points, centers, radius_for(n_points));
+}
+
+/// Builds a tree of the given layout from n random points and compares k-nearest-neighbor queries with a linear scan.
+template< typename layout_t>
+size_t kd_tree_k_nearest_mismatches(const size_t n_points, const size_t k) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    auto input = points;
+    const barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end());
+    const auto centers = random_points<3>(20, 2);
+    size_t ret = k_nearest_mismatches<decltype(tree), 3>(tree, points, centers, k);
+    for (const auto& c : centers) {
+        const point_t<3>* nearest = tree.find_nearest(c);
+        ret += (nearest == nullptr) != points.empty();
+        if (nearest != nullptr)
+            ret += !same_distances({ reduced_distance<3>(tree.metric(), *nearest, c) }, scan_k_nearest<3>(points, c, 1, tree.metric()));
+    }
+    return ret;
+}
+
+/// Compares the visitor and output iterator radius queries of a tree of the given layout with a linear scan.
+template< typename layout_t>
+size_t kd_tree_visitor_range_mismatches(const size_t n_points) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    auto input = points;
+    const barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end());
+    const float radius = radius_for(n_points);
+    size_t ret = 0;
+    vector<point_t<3>*> buffer;
+    for (const auto& c : random_points<3>(20, 2)) {
+        const auto expected = scan_range<3>(points, c, radius, tree.metric());
+        vector<point_t<3>*> visited;
+        tree.for_each_in_range(c, radius, [&visited](point_t<3>& p) { visited.push_back(&p); });
+        ret += sorted_copies<3>(visited) != expected;
+        buffer.clear();
+        tree.find_points_within_range(c, radius, back_inserter(buffer));
+        ret += sorted_copies<3>(buffer) != expected;
+    }
+    return ret;
+}
+
+/// Compares radius and k-nearest-neighbor queries of linked and flat trees with the given metric with a linear scan.
+template< typename metric_t>
+size_t kd_tree_metric_mismatches(const size_t n_points, const metric_t metric) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    auto input = points;
+    const barn::kd_tree<point_t<3>, 3, barn::kd_layout::linked, metric_t> linked(input.begin(), input.end(), metric);
+    const barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat, metric_t> flat(input.begin(), input.end(), metric);
+    return query_mismatches<decltype(linked), 3>(linked, points) + query_mismatches<decltype(flat), 3>(flat, points);
+}
+
+/// Builds trees on the given number of threads and compares their queries with a linear scan, and the flat tree's
+/// arrays with those of a sequential build.
+size_t kd_tree_parallel_build_mismatches(const size_t n_points, const size_t n_threads) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.n_threads = n_threads;
+    options.grain_size = 64;
+    auto input = points;
+    const barn::kd_tree<point_t<3>, 3, barn::kd_layout::linked> linked(input.begin(), input.end(), options);
+    const barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat> flat(points.begin(), points.end(), options);
+    const barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat> sequential(points.begin(), points.end());
+    return query_mismatches<decltype(linked), 3>(linked, points) + query_mismatches<decltype(flat), 3>(flat, points)
+        + (flat.storage().points() != sequential.storage().points());
+}
+
+/// Compares batched radius and k-nearest-neighbor queries on the given number of threads with single queries.
+template< typename layout_t>
+size_t kd_tree_batch_mismatches(const size_t n_queries, const size_t n_threads, const bool spatial_order) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(5000, 1);
+    auto input = points;
+    const barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end());
+    const auto centers = random_points<3>(n_queries, 2);
+    barn::kd_batch_options options;
+    options.n_threads = n_threads;
+    options.grain_size = 16;
+    options.spatial_order = spatial_order;
+    const float radius = radius_for(points.size());
+    const auto ranges = tree.find_points_within_range(centers.begin(), centers.end(), radius, options);
+    const auto nearest = tree.find_k_nearest(centers.begin(), centers.end(), 10, options);
+
+    size_t ret = (ranges.size() != n_queries) + (nearest.size() != n_queries);
+    for (size_t q = 0; q < n_queries && ret == 0; ++q) {
+        const vector<point_t<3>*> range(ranges.neighbors.begin() + ranges.offsets[q], ranges.neighbors.begin() + ranges.offsets[q + 1]);
+        ret += sorted_copies<3>(range) != sorted_copies<3>(tree.find_points_within_range(centers[q], radius));
+        const vector<point_t<3>*> k_nearest(nearest.neighbors.begin() + nearest.offsets[q], nearest.neighbors.begin() + nearest.offsets[q + 1]);
+        ret += k_nearest != tree.find_k_nearest(centers[q], 10);
+    }
+    return ret;
+}
+
+/// Compares radius and k-nearest-neighbor queries of a flat tree with the given bucket size with a linear scan.
+size_t kd_tree_bucket_mismatches(const size_t n_points, const size_t bucket_size) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.bucket_size = bucket_size;
+    const barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat> tree(points.begin(), points.end(), options);
+    const barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat, barn::kd_metric::l1> l1(points.begin(), points.end(), options);
+    return query_mismatches<decltype(tree), 3>(tree, points) + query_mismatches<decltype(l1), 3>(l1, points);
+}
+
+/// Compares box queries and box counts of a tree of the given layout with a linear scan.
+template< typename layout_t>
+size_t kd_tree_box_mismatches(const size_t n_points, const size_t bucket_size) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.bucket_size = bucket_size;
+    auto input = points;
+    const barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end(), options);
+    const auto corners = random_points<3>(40, 2);
+    size_t ret = 0;
+    for (size_t i = 0; i + 1 < corners.size(); i += 2) {
+        point_t<3> lo, hi;
+        for (size_t d = 0; d < 3; ++d) {
+            lo[d] = min(corners[i][d], corners[i + 1][d]);
+            hi[d] = lo[d] + (max(corners[i][d], corners[i + 1][d]) - lo[d]) / 2;
+        }
+        vector<point_t<3>> expected;
+        for (const auto& p : points)
+            if (p[0] >= lo[0] && p[0] <= hi[0] && p[1] >= lo[1] && p[1] <= hi[1] && p[2] >= lo[2] && p[2] <= hi[2])
+                expected.push_back(p);
+        sort(expected.begin(), expected.end());
+        ret += sorted_copies<3>(tree.find_points_in_box(lo, hi)) != expected;
+        ret += tree.count_in_box(lo, hi) != expected.size();
+        vector<point_t<3>*> visited;
+        tree.for_each_in_box(lo, hi, [&visited](point_t<3>& p) { visited.push_back(&p); });
+        ret += sorted_copies<3>(visited) != expected;
+    }
+    return ret;
+}
+
+/// Inserts n sorted points, the worst case for an unbalanced tree, into a tree that keeps every subtree's larger child at
+/// most 70% of the subtree, and compares its queries with a linear scan and its shape with that bound.
+template< typename layout_t>
+size_t kd_tree_balanced_insert_mismatches(const size_t n_points, const size_t bucket_size) {
+    using namespace kd_tree_tests;
+    auto points = random_points<3>(n_points, 1);
+    sort(points.begin(), points.end());
+    barn::kd_build_options options;
+    options.balance = 0.7f;
+    options.bucket_size = bucket_size;
+    barn::kd_tree<point_t<3>, 3, layout_t> tree(options);
+    for (const auto& p : points)
+        tree.insert(p);
+    const barn::kd_tree_stats stats = tree.stats();
+    const double max_depth = 2. + log(double(n_points)) / log(1. / 0.7);
+    return query_mismatches<decltype(tree), 3>(tree, points) + (tree.size() != n_points)
+        + (stats.balance > 0.7f) + (double(tree.depth()) > max_depth);
+}
+
+/// Erases every third point from a tree of the given layout and compares its queries with a linear scan over the others,
+/// before and after compacting it.
+template< typename layout_t>
+size_t kd_tree_erase_mismatches(const size_t n_points, const float max_erased) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.max_erased = max_erased;
+    options.grain_size = 256; // compacts larger trees in the background
+    auto input = points;
+    barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end(), options);
+
+    size_t ret = 0;
+    vector<point_t<3>> remaining;
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (i % 3 == 0)
+            ret += !tree.erase(points[i]);
+        else
+            remaining.push_back(points[i]);
+    }
+    ret += tree.erase(point_t<3>{ { 2.f, 2.f, 2.f } });
+    ret += (tree.size() != remaining.size()) + query_mismatches<decltype(tree), 3>(tree, remaining);
+
+    tree.compact();
+    ret += (tree.storage().erased_count() != 0) + (tree.size() != remaining.size());
+    ret += query_mismatches<decltype(tree), 3>(tree, remaining);
+
+    // erasing by pointer takes exactly the given element of equal ones
+    const point_t<3> twin = remaining.front();
+    tree.insert(twin);
+    const auto found = tree.find_points_within_range(twin, 0.f);
+    ret += found.size() != 2;
+    if (found.size() == 2) {
+        ret += !tree.erase(found[1]);
+        ret += tree.count_in_range(twin, 0.f) != 1;
+    }
+    return ret;
+}
+
+/// Erases elements of equal coordinates but different labels from a tree that compacts itself in the background
+/// meanwhile, and checks that the compacted tree has erased the same ones.
+template< typename layout_t>
+size_t kd_tree_erase_twin_mismatches(const size_t n_points) {
+    using namespace kd_tree_tests;
+    auto tree = compacting_tree_with_twins<layout_t>(n_points);
+    size_t ret = 0;
+    for (const labeled_point_t* p : tree->find_points_within_range(labeled_point_t{ twin_at, 0 }, 0.f))
+        if (p->id == -1)
+            ret += !tree->erase(p);
+    ret += ids_at(*tree, twin_at) != vector<int>{ -2 };
+    tree->compact();
+    ret += ids_at(*tree, twin_at) != vector<int>{ -2 };
+
+    // erasing by value during a compaction erases the same element on the compacted tree as well
+    tree->insert({ twin_at, -3 });
+    const auto points = random_points<3>(n_points, 1);
+    for (size_t i = n_points / 2; i <= n_points / 2 + n_points / 10000; ++i)
+        tree->erase(labeled_point_t{ points[i], 0 });
+    ret += !tree->erase(labeled_point_t{ twin_at, 0 });
+    const vector<int> before = ids_at(*tree, twin_at);
+    tree->compact();
+    return ret + (before.size() != 1) + (ids_at(*tree, twin_at) != before);
+}
+
+/// Checks approximate k-nearest-neighbor queries with the given relative error on a tree of the given layout:
+/// the i-th result must be at most 1 + epsilon times as far away as the true i-th nearest neighbor.
+template< typename layout_t>
+size_t kd_tree_approximate_k_nearest_violations(const float epsilon, const size_t max_leaves) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<8>(5000, 1);
+    barn::kd_build_options options;
+    options.bucket_size = is_same<layout_t, barn::kd_layout::flat>::value ? 8 : 1;
+    auto input = points;
+    const barn::kd_tree<point_t<8>, 8, layout_t> tree(input.begin(), input.end(), options);
+    barn::kd_search_options search;
+    search.epsilon = epsilon;
+    search.max_leaves = max_leaves;
+
+    size_t ret = 0;
+    for (const auto& c : random_points<8>(20, 2)) {
+        const size_t k = 10;
+        const vector<float> expected = scan_k_nearest<8>(points, c, k, tree.metric());
+        const auto found = tree.find_k_nearest(c, k, search);
+        const vector<float> distances = distances_of<8>(found, c, tree.metric());
+        ret += found.size() != k;
+        if (max_leaves > 0 || found.size() != k)
+            continue; // a limited search gives no error bound
+        for (size_t i = 0; i < k; ++i)
+            ret += sqrt(distances[i]) > (1.f + epsilon) * sqrt(expected[i]) * (1.f + 1e-5f);
+    }
+    return ret;
+}
+
+/// Compares the queries of trees built with the given split policy with a linear scan, on uniform and on collinear
+/// points, where every coordinate is the same.
+template< typename layout_t>
+size_t kd_tree_split_mismatches(const barn::kd_split split, const size_t bucket_size) {
+    using namespace kd_tree_tests;
+    barn::kd_build_options options;
+    options.split = split;
+    options.bucket_size = bucket_size;
+    size_t ret = 0;
+    auto collinear = random_points<3>(3000, 3);
+    for (auto& p : collinear)
+        p[1] = p[2] = p[0];
+    for (const auto& points : { random_points<3>(3000, 1), collinear }) {
+        auto input = points;
+        const barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end(), options);
+        ret += (tree.size() != points.size()) + query_mismatches<decltype(tree), 3>(tree, points);
+    }
+    return ret;
+}
+
+/// Compares presorted builds of flat trees with a linear scan and with builds that select on every level.
+size_t kd_tree_presort_mismatches(const size_t n_points, const size_t bucket_size, const size_t n_threads) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.bucket_size = bucket_size;
+    options.n_threads = n_threads;
+    options.grain_size = 64;
+    const barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat> selected(points.begin(), points.end(), options);
+    options.presort = true;
+    barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat> presorted(points.begin(), points.end(), options);
+    size_t ret = query_mismatches<decltype(presorted), 3>(presorted, points);
+    for (const auto& c : random_points<3>(20, 2))
+        ret += sorted_copies<3>(presorted.find_points_within_range(c, 0.2f)) != sorted_copies<3>(selected.find_points_within_range(c, 0.2f));
+
+    // rebuilding subtrees presorts too
+    options.balance = 0.7f;
+    presorted = barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat>(options);
+    auto sorted_points = points;
+    sort(sorted_points.begin(), sorted_points.end());
+    for (const auto& p : sorted_points)
+        presorted.insert(p);
+    return ret + query_mismatches<decltype(presorted), 3>(presorted, points);
+}
+
+/// Walks the nearest_iterator of a tree of the given layout over the given number of elements and compares their order
+/// with a linear scan.
+template< typename layout_t>
+size_t kd_tree_nearest_iterator_mismatches(const size_t n_points, const size_t n_steps) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.bucket_size = is_same<layout_t, barn::kd_layout::flat>::value ? 8 : 1;
+    auto input = points;
+    const barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end(), options);
+    size_t ret = 0;
+    for (const auto& c : random_points<3>(10, 2)) {
+        vector<point_t<3>*> found;
+        for (auto it = tree.nearest_begin(c); it != tree.nearest_end() && found.size() < n_steps; ++it)
+            found.push_back(&*it);
+        const vector<float> distances = [&]() {
+            vector<float> ret;
+            for (const point_t<3>* p : found)
+                ret.push_back(reduced_distance<3>(tree.metric(), *p, c));
+            return ret;
+        }();
+        ret += !is_sorted(distances.begin(), distances.end());
+        ret += !same_distances(distances, scan_k_nearest<3>(points, c, n_steps, tree.metric()));
+    }
+    return ret;
+}
+
+/// Compares radius and k-nearest-neighbor queries of linked, flat and bucketed flat trees in the given number of
+/// dimensions with a linear scan.
+template< size_t n_dims>
+size_t kd_tree_dimension_mismatches(const size_t n_points) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<n_dims>(n_points, 1);
+    barn::kd_build_options bucketed;
+    bucketed.bucket_size = 16;
+    auto input = points;
+    const barn::kd_tree<point_t<n_dims>, n_dims, barn::kd_layout::linked> linked(input.begin(), input.end());
+    const barn::kd_tree<point_t<n_dims>, n_dims, barn::kd_layout::flat> flat(points.begin(), points.end());
+    const barn::kd_tree<point_t<n_dims>, n_dims, barn::kd_layout::flat> flat_b(points.begin(), points.end(), bucketed);
+    return query_mismatches<decltype(linked), n_dims>(linked, points) + query_mismatches<decltype(flat), n_dims>(flat, points)
+        + query_mismatches<decltype(flat_b), n_dims>(flat_b, points);
+}
+
+/// Compares the pairs of radius_self_join() and radius_join() on trees of the given layout with all pairs of points.
+template< typename layout_t>
+size_t kd_tree_radius_join_mismatches(const size_t n_points, const float radius, const size_t n_threads) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    const auto others = random_points<3>(n_points / 2, 2);
+    barn::kd_build_options options;
+    options.bucket_size = is_same<layout_t, barn::kd_layout::flat>::value ? 8 : 1;
+    auto input = points, other_input = others;
+    const barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end(), options);
+    const barn::kd_tree<point_t<3>, 3, layout_t> other(other_input.begin(), other_input.end(), options);
+    barn::kd_batch_options batch;
+    batch.n_threads = n_threads;
+    using pair_points_t = pair<point_t<3>, point_t<3>>;
+    const float reduced_radius = radius * radius;
+
+    // every unordered pair once, with the lesser point first
+    vector<pair_points_t> expected_self, found_self;
+    for (size_t i = 0; i < points.size(); ++i)
+        for (size_t j = i + 1; j < points.size(); ++j)
+            if (reduced_distance<3>(tree.metric(), points[i], points[j]) <= reduced_radius)
+                expected_self.push_back(minmax(points[i], points[j]));
+    for (const auto& p : tree.radius_self_join(radius, batch))
+        found_self.push_back(minmax(*p.first, *p.second));
+    sort(expected_self.begin(), expected_self.end());
+    sort(found_self.begin(), found_self.end());
+
+    vector<pair_points_t> expected, found;
+    for (const auto& p : points)
+        for (const auto& q : others)
+            if (reduced_distance<3>(tree.metric(), p, q) <= reduced_radius)
+                expected.emplace_back(p, q);
+    for (const auto& p : tree.radius_join(other, radius, batch))
+        found.emplace_back(*p.first, *p.second);
+    sort(expected.begin(), expected.end());
+    sort(found.begin(), found.end());
+    return (found_self != expected_self) + (found != expected);
+}
+
+/// Moves all points of a tree of the given layout, most a little and every tenth across the tree, with refit() and
+/// compares the queries with a linear scan over the new positions.
+template< typename layout_t>
+size_t kd_tree_refit_mismatches(const size_t n_points, const size_t max_refit_rebuild) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.max_refit_rebuild = max_refit_rebuild;
+    options.bucket_size = is_same<layout_t, barn::kd_layout::flat>::value ? 8 : 1;
+    auto input = points;
+    barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end(), options);
+
+    mt19937 rng(3);
+    uniform_real_distribution<float> jitter(-0.01f, 0.01f), uniform(0.f, 1.f);
+    vector<pair<const point_t<3>*, point_t<3>>> moves;
+    vector<point_t<3>> moved;
+    for (const point_t<3>& p : tree) {
+        point_t<3> to = p;
+        for (auto& c : to)
+            c = moves.size() % 10 == 0 ? uniform(rng) : c + jitter(rng);
+        moves.emplace_back(&p, to);
+        moved.push_back(to);
+    }
+    size_t ret = tree.refit(moves.begin(), moves.end()) != n_points;
+    ret += (tree.size() != n_points) + query_mismatches<decltype(tree), 3>(tree, moved);
+    return ret;
+}
+
+/// Moves one of two elements of equal coordinates but different labels with refit() while the tree compacts itself in
+/// the background, and checks that the compacted tree has moved the same one.
+template< typename layout_t>
+size_t kd_tree_refit_twin_mismatches(const size_t n_points) {
+    using namespace kd_tree_tests;
+    auto tree = compacting_tree_with_twins<layout_t>(n_points);
+    const point_t<3> far_at = { { 3.f, 3.f, 3.f } };
+    vector<pair<const labeled_point_t*, labeled_point_t>> moves;
+    for (const labeled_point_t* p : tree->find_points_within_range(labeled_point_t{ twin_at, 0 }, 0.f))
+        if (p->id == -1)
+            moves.emplace_back(p, labeled_point_t{ far_at, -1 });
+    size_t ret = tree->refit(moves.begin(), moves.end()) != 1;
+    ret += (ids_at(*tree, twin_at) != vector<int>{ -2 }) + (ids_at(*tree, far_at) != vector<int>{ -1 });
+    tree->compact();
+    return ret + (ids_at(*tree, twin_at) != vector<int>{ -2 }) + (ids_at(*tree, far_at) != vector<int>{ -1 });
+}
+
+/// Compares the statistics of a tree of the given layout with the tree: its size, erased elements and depth.
+/// Without BARN_KD_TREE_STATS the per-query counters must stay 0, with it a query must count visited nodes.
+template< typename layout_t>
+size_t kd_tree_stats_mismatches(const size_t n_points) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.max_erased = 0.f;
+    auto input = points;
+    barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end(), options);
+    for (size_t i = 0; i < n_points; i += 4)
+        tree.erase(points[i]);
+    const barn::kd_tree_stats stats = tree.stats();
+    size_t leaves = 0;
+    for (const size_t n : stats.depth_histogram)
+        leaves += n;
+    size_t ret = (stats.size != tree.size()) + (stats.erased != tree.storage().erased_count())
+        + (stats.depth != tree.depth()) + (stats.depth_histogram.size() != stats.depth)
+        + (leaves == 0) + (leaves > stats.nodes) + (stats.bytes != tree.memory_footprint());
+
+    tree.find_k_nearest(points[1], 10);
+    const barn::kd_query_stats& query = tree.last_query_stats();
+#if defined(BARN_KD_TREE_STATS)
+    ret += (query.nodes_visited == 0) + (query.distance_evaluations < 10);
+#else
+    ret += (query.nodes_visited != 0) + (query.distance_evaluations != 0);
+#endif
+    return ret;
+}
+
+/// Compares the results of a flat tree with quantized coordinates with those of one without, after inserts and erases
+/// that requantize buckets.
+template< typename metric_t>
+size_t kd_tree_quantized_mismatches(const size_t n_points, const size_t bucket_size, const metric_t metric) {
+    using namespace kd_tree_tests;
+    using tree_t = barn::kd_tree<point_t<3>, 3, barn::kd_layout::flat, metric_t>;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.bucket_size = bucket_size;
+    options.balance = 0.7f;
+    options.max_erased = 0.f;
+    tree_t full(points.begin(), points.begin() + points.size() / 2, options, metric);
+    options.quantize = true;
+    tree_t quantized(points.begin(), points.begin() + points.size() / 2, options, metric);
+
+    vector<point_t<3>> live(points.begin(), points.begin() + points.size() / 2);
+    for (size_t i = points.size() / 2; i < points.size(); ++i) {
+        full.insert(points[i]);
+        quantized.insert(points[i]);
+        live.push_back(points[i]);
+    }
+    for (size_t i = 0; i < points.size(); i += 5) {
+        full.erase(points[i]);
+        quantized.erase(points[i]);
+    }
+    live.erase(remove_if(live.begin(), live.end(), [&](const point_t<3>& p) {
+        return (find(points.begin(), points.end(), p) - points.begin()) % 5 == 0; }), live.end());
+
+    size_t ret = query_mismatches<tree_t, 3>(quantized, live);
+    for (const auto& c : random_points<3>(20, 2)) {
+        ret += sorted_copies<3>(quantized.find_points_within_range(c, 0.15f)) != sorted_copies<3>(full.find_points_within_range(c, 0.15f));
+        ret += sorted_copies<3>(quantized.find_k_nearest(c, 10)) != sorted_copies<3>(full.find_k_nearest(c, 10));
+    }
+    return ret;
+}
+
+/// Compares k_nearest_join() of trees of the given layout with a linear scan for every query element.
+template< typename layout_t>
+size_t kd_tree_k_nearest_join_mismatches(const size_t n_points, const size_t k, const size_t n_threads) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    const auto queries = random_points<3>(n_points / 2 + 1, 2);
+    barn::kd_build_options options;
+    options.bucket_size = is_same<layout_t, barn::kd_layout::flat>::value ? 8 : 1;
+    options.max_erased = 0.f;
+    auto input = points, query_input = queries;
+    barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end(), options);
+    barn::kd_tree<point_t<3>, 3, layout_t> query_tree(query_input.begin(), query_input.end(), options);
+    vector<point_t<3>> live;
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (i % 4 == 0)
+            tree.erase(points[i]);
+        else
+            live.push_back(points[i]);
+    }
+    barn::kd_batch_options batch;
+    batch.n_threads = n_threads;
+
+    const auto result = tree.k_nearest_join(query_tree, k, batch);
+    size_t ret = (result.size() != queries.size()) + (result.queries.size() != queries.size());
+    for (size_t q = 0; q < result.size() && ret == 0; ++q) {
+        const vector<point_t<3>*> found(result.neighbors.begin() + result.offsets[q], result.neighbors.begin() + result.offsets[q + 1]);
+        const point_t<3>& c = *result.queries[q];
+        ret += !same_distances(distances_of<3>(found, c, tree.metric()), scan_k_nearest<3>(live, c, k, tree.metric()));
+    }
+    return ret;
+}
+
+/// Compares read-only iteration and for_each_point(), sequential and on the given number of threads, of a tree of the
+/// given layout with the points that are not erased, after inserts, erases and rebuilds.
+template< typename layout_t>
+size_t kd_tree_iteration_mismatches(const size_t n_points, const size_t n_threads) {
+    using namespace kd_tree_tests;
+    const auto points = random_points<3>(n_points, 1);
+    barn::kd_build_options options;
+    options.balance = 0.7f;
+    options.max_erased = 0.f;
+    auto input = vector<point_t<3>>(points.begin(), points.begin() + points.size() / 2);
+    barn::kd_tree<point_t<3>, 3, layout_t> tree(input.begin(), input.end(), options);
+    for (size_t i = points.size() / 2; i < points.size(); ++i)
+        tree.insert(points[i]);
+    vector<point_t<3>> live;
+    for (size_t i = 0; i < points.size(); ++i) {
+        if (i % 3 == 0)
+            tree.erase(points[i]);
+        else
+            live.push_back(points[i]);
+    }
+    sort(live.begin(), live.end());
+
+    const auto& const_tree = tree;
+    vector<point_t<3>> iterated(const_tree.begin(), const_tree.end()), visited;
+    const_tree.for_each_point([&visited](const point_t<3>& p) { visited.push_back(p); });
+    size_t ret = iterated != visited;
+    sort(iterated.begin(), iterated.end());
+    ret += iterated != live;
+
+    barn::kd_batch_options batch;
+    batch.n_threads = n_threads;
+    vector<vector<point_t<3>>> per_thread(n_threads);
+    const_tree.for_each_point([&](const point_t<3>& p, const size_t thread) { per_thread.at(thread).push_back(p); }, batch);
+    vector<point_t<3>> parallel;
+    for (const auto& v : per_thread)
+        parallel.insert(parallel.end(), v.begin(), v.end());
+    sort(parallel.begin(), parallel.end());
+    return ret + (parallel != live);
+}
+
+
+/// Calls the testing routine
+void kd_tree_test_all() {
+
+    auto& os = std::cout;
+    auto all_passed = true;
+    os << "\n";
+
+    os << "Test kd_tree range queries" << std::endl;
+    FunctionTest<size_t, size_t> range_linked_test(kd_tree_range_mismatches<barn::kd_layout::linked>);
+    range_linked_test.verbosity_level = verbosity::NORMAL;
+    range_linked_test.test("linked, empty", size_t(0), size_t(0));
+    range_linked_test.test("linked, 1 point", size_t(0), size_t(1));
+    range_linked_test.test("linked, 2000 points", size_t(0), size_t(2000));
+    all_passed &= range_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t> range_flat_test(kd_tree_range_mismatches<barn::kd_layout::flat>);
+    range_flat_test.verbosity_level = verbosity::NORMAL;
+    range_flat_test.test("flat, empty", size_t(0), size_t(0));
+    range_flat_test.test("flat, 1 point", size_t(0), size_t(1));
+    range_flat_test.test("flat, 2000 points", size_t(0), size_t(2000));
+    all_passed &= range_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree k-nearest-neighbor queries" << std::endl;
+    FunctionTest<size_t, size_t, size_t> k_nearest_linked_test(kd_tree_k_nearest_mismatches<barn::kd_layout::linked>);
+    k_nearest_linked_test.verbosity_level = verbosity::NORMAL;
+    k_nearest_linked_test.test("linked, empty", size_t(0), size_t(0), size_t(5));
+    k_nearest_linked_test.test("linked, k = 0", size_t(0), size_t(2000), size_t(0));
+    k_nearest_linked_test.test("linked, k = 1", size_t(0), size_t(2000), size_t(1));
+    k_nearest_linked_test.test("linked, k = 10", size_t(0), size_t(2000), size_t(10));
+    k_nearest_linked_test.test("linked, k > size", size_t(0), size_t(50), size_t(60));
+    all_passed &= k_nearest_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, size_t> k_nearest_flat_test(kd_tree_k_nearest_mismatches<barn::kd_layout::flat>);
+    k_nearest_flat_test.verbosity_level = verbosity::NORMAL;
+    k_nearest_flat_test.test("flat, empty", size_t(0), size_t(0), size_t(5));
+    k_nearest_flat_test.test("flat, k = 0", size_t(0), size_t(2000), size_t(0));
+    k_nearest_flat_test.test("flat, k = 1", size_t(0), size_t(2000), size_t(1));
+    k_nearest_flat_test.test("flat, k = 10", size_t(0), size_t(2000), size_t(10));
+    k_nearest_flat_test.test("flat, k > size", size_t(0), size_t(50), size_t(60));
+    all_passed &= k_nearest_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree visitor range queries" << std::endl;
+    FunctionTest<size_t, size_t> visitor_linked_test(kd_tree_visitor_range_mismatches<barn::kd_layout::linked>);
+    visitor_linked_test.verbosity_level = verbosity::NORMAL;
+    visitor_linked_test.test("linked, empty", size_t(0), size_t(0));
+    visitor_linked_test.test("linked, 2000 points", size_t(0), size_t(2000));
+    all_passed &= visitor_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t> visitor_flat_test(kd_tree_visitor_range_mismatches<barn::kd_layout::flat>);
+    visitor_flat_test.verbosity_level = verbosity::NORMAL;
+    visitor_flat_test.test("flat, empty", size_t(0), size_t(0));
+    visitor_flat_test.test("flat, 2000 points", size_t(0), size_t(2000));
+    all_passed &= visitor_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree metrics" << std::endl;
+    FunctionTest<size_t, size_t, barn::kd_metric::l1> l1_test(kd_tree_metric_mismatches<barn::kd_metric::l1>);
+    l1_test.verbosity_level = verbosity::NORMAL;
+    l1_test.test("l1", size_t(0), size_t(2000), barn::kd_metric::l1());
+    all_passed &= l1_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, barn::kd_metric::linf> linf_test(kd_tree_metric_mismatches<barn::kd_metric::linf>);
+    linf_test.verbosity_level = verbosity::NORMAL;
+    linf_test.test("linf", size_t(0), size_t(2000), barn::kd_metric::linf());
+    all_passed &= linf_test.write_test_series_summary();
+
+    using weighted_l2 = barn::kd_metric::weighted_l2<float, 3>;
+    FunctionTest<size_t, size_t, weighted_l2> weighted_l2_test(kd_tree_metric_mismatches<weighted_l2>);
+    weighted_l2_test.verbosity_level = verbosity::NORMAL;
+    weighted_l2_test.test("weighted l2, unit weights", size_t(0), size_t(2000), weighted_l2());
+    weighted_l2_test.test("weighted l2, skewed weights", size_t(0), size_t(2000), weighted_l2(array<float, 3>{ { 1.f, 4.f, 0.25f } }));
+    weighted_l2_test.test("weighted l2, ignored axis", size_t(0), size_t(2000), weighted_l2(array<float, 3>{ { 1.f, 0.f, 1.f } }));
+    all_passed &= weighted_l2_test.write_test_series_summary();
+
+    os << "Test kd_tree parallel construction" << std::endl;
+    FunctionTest<size_t, size_t, size_t> parallel_build_test(kd_tree_parallel_build_mismatches);
+    parallel_build_test.verbosity_level = verbosity::NORMAL;
+    parallel_build_test.test("1 thread", size_t(0), size_t(5000), size_t(1));
+    parallel_build_test.test("2 threads", size_t(0), size_t(5000), size_t(2));
+    parallel_build_test.test("7 threads", size_t(0), size_t(5000), size_t(7));
+    parallel_build_test.test("7 threads, few points", size_t(0), size_t(10), size_t(7));
+    all_passed &= parallel_build_test.write_test_series_summary();
+
+    os << "Test kd_tree batched queries" << std::endl;
+    FunctionTest<size_t, size_t, size_t, bool> batch_linked_test(kd_tree_batch_mismatches<barn::kd_layout::linked>);
+    batch_linked_test.verbosity_level = verbosity::NORMAL;
+    batch_linked_test.test("linked, no queries", size_t(0), size_t(0), size_t(4), true);
+    batch_linked_test.test("linked, given order", size_t(0), size_t(500), size_t(1), false);
+    batch_linked_test.test("linked, 4 threads", size_t(0), size_t(500), size_t(4), true);
+    all_passed &= batch_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, size_t, bool> batch_flat_test(kd_tree_batch_mismatches<barn::kd_layout::flat>);
+    batch_flat_test.verbosity_level = verbosity::NORMAL;
+    batch_flat_test.test("flat, no queries", size_t(0), size_t(0), size_t(4), true);
+    batch_flat_test.test("flat, given order", size_t(0), size_t(500), size_t(1), false);
+    batch_flat_test.test("flat, 4 threads", size_t(0), size_t(500), size_t(4), true);
+    all_passed &= batch_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree bucketed leaves" << std::endl;
+    FunctionTest<size_t, size_t, size_t> bucket_test(kd_tree_bucket_mismatches);
+    bucket_test.verbosity_level = verbosity::NORMAL;
+    bucket_test.test("bucket size 2", size_t(0), size_t(3000), size_t(2));
+    bucket_test.test("bucket size 7", size_t(0), size_t(3000), size_t(7));
+    bucket_test.test("bucket size 16", size_t(0), size_t(3000), size_t(16));
+    bucket_test.test("bucket size 256", size_t(0), size_t(3000), barn::kd_max_bucket_size);
+    bucket_test.test("bucket larger than the tree", size_t(0), size_t(100), size_t(128));
+    all_passed &= bucket_test.write_test_series_summary();
+
+    os << "Test kd_tree box queries" << std::endl;
+    FunctionTest<size_t, size_t, size_t> box_linked_test(kd_tree_box_mismatches<barn::kd_layout::linked>);
+    box_linked_test.verbosity_level = verbosity::NORMAL;
+    box_linked_test.test("linked, empty", size_t(0), size_t(0), size_t(1));
+    box_linked_test.test("linked, 3000 points", size_t(0), size_t(3000), size_t(1));
+    all_passed &= box_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, size_t> box_flat_test(kd_tree_box_mismatches<barn::kd_layout::flat>);
+    box_flat_test.verbosity_level = verbosity::NORMAL;
+    box_flat_test.test("flat, empty", size_t(0), size_t(0), size_t(1));
+    box_flat_test.test("flat, 3000 points", size_t(0), size_t(3000), size_t(1));
+    box_flat_test.test("flat, 3000 points, bucket size 16", size_t(0), size_t(3000), size_t(16));
+    all_passed &= box_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree balanced inserts" << std::endl;
+    FunctionTest<size_t, size_t, size_t> balance_linked_test(kd_tree_balanced_insert_mismatches<barn::kd_layout::linked>);
+    balance_linked_test.verbosity_level = verbosity::NORMAL;
+    balance_linked_test.test("linked, sorted inserts", size_t(0), size_t(5000), size_t(1));
+    all_passed &= balance_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, size_t> balance_flat_test(kd_tree_balanced_insert_mismatches<barn::kd_layout::flat>);
+    balance_flat_test.verbosity_level = verbosity::NORMAL;
+    balance_flat_test.test("flat, sorted inserts", size_t(0), size_t(5000), size_t(1));
+    balance_flat_test.test("flat, sorted inserts, bucket size 16", size_t(0), size_t(5000), size_t(16));
+    all_passed &= balance_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree erase and compaction" << std::endl;
+    FunctionTest<size_t, size_t, float> erase_linked_test(kd_tree_erase_mismatches<barn::kd_layout::linked>);
+    erase_linked_test.verbosity_level = verbosity::NORMAL;
+    erase_linked_test.test("linked, never compacting", size_t(0), size_t(3000), 0.f);
+    erase_linked_test.test("linked, compacting in the background", size_t(0), size_t(3000), 0.2f);
+    all_passed &= erase_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, float> erase_flat_test(kd_tree_erase_mismatches<barn::kd_layout::flat>);
+    erase_flat_test.verbosity_level = verbosity::NORMAL;
+    erase_flat_test.test("flat, never compacting", size_t(0), size_t(3000), 0.f);
+    erase_flat_test.test("flat, compacting in the background", size_t(0), size_t(3000), 0.2f);
+    erase_flat_test.test("flat, compacting right away", size_t(0), size_t(100), 0.2f);
+    all_passed &= erase_flat_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t> erase_twin_linked_test(kd_tree_erase_twin_mismatches<barn::kd_layout::linked>);
+    erase_twin_linked_test.verbosity_level = verbosity::NORMAL;
+    erase_twin_linked_test.test("linked, equal coordinates, different payloads", size_t(0), size_t(100000));
+    all_passed &= erase_twin_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t> erase_twin_flat_test(kd_tree_erase_twin_mismatches<barn::kd_layout::flat>);
+    erase_twin_flat_test.verbosity_level = verbosity::NORMAL;
+    erase_twin_flat_test.test("flat, equal coordinates, different payloads", size_t(0), size_t(100000));
+    all_passed &= erase_twin_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree approximate k-nearest-neighbor queries" << std::endl;
+    FunctionTest<size_t, float, size_t> approximate_linked_test(kd_tree_approximate_k_nearest_violations<barn::kd_layout::linked>);
+    approximate_linked_test.verbosity_level = verbosity::NORMAL;
+    approximate_linked_test.test("linked, exact", size_t(0), 0.f, size_t(0));
+    approximate_linked_test.test("linked, epsilon 0.5", size_t(0), 0.5f, size_t(0));
+    approximate_linked_test.test("linked, 4 leaves", size_t(0), 0.f, size_t(4));
+    all_passed &= approximate_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, float, size_t> approximate_flat_test(kd_tree_approximate_k_nearest_violations<barn::kd_layout::flat>);
+    approximate_flat_test.verbosity_level = verbosity::NORMAL;
+    approximate_flat_test.test("flat, exact", size_t(0), 0.f, size_t(0));
+    approximate_flat_test.test("flat, epsilon 0.5", size_t(0), 0.5f, size_t(0));
+    approximate_flat_test.test("flat, epsilon 2", size_t(0), 2.f, size_t(0));
+    approximate_flat_test.test("flat, 2 leaves", size_t(0), 0.f, size_t(2));
+    all_passed &= approximate_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree split policies" << std::endl;
+    FunctionTest<size_t, barn::kd_split, size_t> split_linked_test(kd_tree_split_mismatches<barn::kd_layout::linked>);
+    split_linked_test.verbosity_level = verbosity::NORMAL;
+    split_linked_test.test("linked, widest spread", size_t(0), barn::kd_split::widest_spread, size_t(1));
+    split_linked_test.test("linked, sliding midpoint", size_t(0), barn::kd_split::sliding_midpoint, size_t(1));
+    split_linked_test.test("linked, cost model", size_t(0), barn::kd_split::cost_model, size_t(1));
+    all_passed &= split_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, barn::kd_split, size_t> split_flat_test(kd_tree_split_mismatches<barn::kd_layout::flat>);
+    split_flat_test.verbosity_level = verbosity::NORMAL;
+    split_flat_test.test("flat, widest spread", size_t(0), barn::kd_split::widest_spread, size_t(8));
+    split_flat_test.test("flat, sliding midpoint", size_t(0), barn::kd_split::sliding_midpoint, size_t(8));
+    split_flat_test.test("flat, cost model", size_t(0), barn::kd_split::cost_model, size_t(8));
+    all_passed &= split_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree presorted construction" << std::endl;
+    FunctionTest<size_t, size_t, size_t, size_t> presort_test(kd_tree_presort_mismatches);
+    presort_test.verbosity_level = verbosity::NORMAL;
+    presort_test.test("single points", size_t(0), size_t(3000), size_t(1), size_t(1));
+    presort_test.test("bucket size 16", size_t(0), size_t(3000), size_t(16), size_t(1));
+    presort_test.test("bucket size 16, 4 threads", size_t(0), size_t(3000), size_t(16), size_t(4));
+    all_passed &= presort_test.write_test_series_summary();
+
+    os << "Test kd_tree nearest_iterator" << std::endl;
+    FunctionTest<size_t, size_t, size_t> nearest_linked_test(kd_tree_nearest_iterator_mismatches<barn::kd_layout::linked>);
+    nearest_linked_test.verbosity_level = verbosity::NORMAL;
+    nearest_linked_test.test("linked, empty", size_t(0), size_t(0), size_t(10));
+    nearest_linked_test.test("linked, 50 steps", size_t(0), size_t(2000), size_t(50));
+    nearest_linked_test.test("linked, all points", size_t(0), size_t(300), size_t(300));
+    all_passed &= nearest_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, size_t> nearest_flat_test(kd_tree_nearest_iterator_mismatches<barn::kd_layout::flat>);
+    nearest_flat_test.verbosity_level = verbosity::NORMAL;
+    nearest_flat_test.test("flat, empty", size_t(0), size_t(0), size_t(10));
+    nearest_flat_test.test("flat, 50 steps", size_t(0), size_t(2000), size_t(50));
+    nearest_flat_test.test("flat, all points", size_t(0), size_t(300), size_t(300));
+    all_passed &= nearest_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree dimensions" << std::endl;
+    FunctionTest<size_t, size_t> dims_1_test(kd_tree_dimension_mismatches<1>);
+    dims_1_test.verbosity_level = verbosity::NORMAL;
+    dims_1_test.test("1 dimension", size_t(0), size_t(2000));
+    all_passed &= dims_1_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t> dims_2_test(kd_tree_dimension_mismatches<2>);
+    dims_2_test.verbosity_level = verbosity::NORMAL;
+    dims_2_test.test("2 dimensions", size_t(0), size_t(2000));
+    all_passed &= dims_2_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t> dims_5_test(kd_tree_dimension_mismatches<5>);
+    dims_5_test.verbosity_level = verbosity::NORMAL;
+    dims_5_test.test("5 dimensions", size_t(0), size_t(2000));
+    all_passed &= dims_5_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t> dims_16_test(kd_tree_dimension_mismatches<16>);
+    dims_16_test.verbosity_level = verbosity::NORMAL;
+    dims_16_test.test("16 dimensions", size_t(0), size_t(2000));
+    all_passed &= dims_16_test.write_test_series_summary();
+
+    os << "Test kd_tree radius joins" << std::endl;
+    FunctionTest<size_t, size_t, float, size_t> join_linked_test(kd_tree_radius_join_mismatches<barn::kd_layout::linked>);
+    join_linked_test.verbosity_level = verbosity::NORMAL;
+    join_linked_test.test("linked, empty", size_t(0), size_t(0), 0.1f, size_t(1));
+    join_linked_test.test("linked, radius 0.05", size_t(0), size_t(1500), 0.05f, size_t(1));
+    join_linked_test.test("linked, radius 0.1, 4 threads", size_t(0), size_t(1500), 0.1f, size_t(4));
+    all_passed &= join_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, float, size_t> join_flat_test(kd_tree_radius_join_mismatches<barn::kd_layout::flat>);
+    join_flat_test.verbosity_level = verbosity::NORMAL;
+    join_flat_test.test("flat, empty", size_t(0), size_t(0), 0.1f, size_t(1));
+    join_flat_test.test("flat, radius 0.05", size_t(0), size_t(1500), 0.05f, size_t(1));
+    join_flat_test.test("flat, radius 0.1, 4 threads", size_t(0), size_t(1500), 0.1f, size_t(4));
+    all_passed &= join_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree refit" << std::endl;
+    FunctionTest<size_t, size_t, size_t> refit_linked_test(kd_tree_refit_mismatches<barn::kd_layout::linked>);
+    refit_linked_test.verbosity_level = verbosity::NORMAL;
+    refit_linked_test.test("linked, reinserting", size_t(0), size_t(3000), size_t(0));
+    refit_linked_test.test("linked, rebuilding up to 64 points", size_t(0), size_t(3000), size_t(64));
+    all_passed &= refit_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, size_t> refit_flat_test(kd_tree_refit_mismatches<barn::kd_layout::flat>);
+    refit_flat_test.verbosity_level = verbosity::NORMAL;
+    refit_flat_test.test("flat, reinserting", size_t(0), size_t(3000), size_t(0));
+    refit_flat_test.test("flat, rebuilding up to 64 points", size_t(0), size_t(3000), size_t(64));
+    all_passed &= refit_flat_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t> refit_twin_linked_test(kd_tree_refit_twin_mismatches<barn::kd_layout::linked>);
+    refit_twin_linked_test.verbosity_level = verbosity::NORMAL;
+    refit_twin_linked_test.test("linked, equal coordinates, different payloads", size_t(0), size_t(100000));
+    all_passed &= refit_twin_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t> refit_twin_flat_test(kd_tree_refit_twin_mismatches<barn::kd_layout::flat>);
+    refit_twin_flat_test.verbosity_level = verbosity::NORMAL;
+    refit_twin_flat_test.test("flat, equal coordinates, different payloads", size_t(0), size_t(100000));
+    all_passed &= refit_twin_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree statistics" << std::endl;
+    FunctionTest<size_t, size_t> stats_linked_test(kd_tree_stats_mismatches<barn::kd_layout::linked>);
+    stats_linked_test.verbosity_level = verbosity::NORMAL;
+    stats_linked_test.test("linked", size_t(0), size_t(3000));
+    all_passed &= stats_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t> stats_flat_test(kd_tree_stats_mismatches<barn::kd_layout::flat>);
+    stats_flat_test.verbosity_level = verbosity::NORMAL;
+    stats_flat_test.test("flat", size_t(0), size_t(3000));
+    all_passed &= stats_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree quantized coordinates" << std::endl;
+    FunctionTest<size_t, size_t, size_t, barn::kd_metric::l2> quantized_l2_test(kd_tree_quantized_mismatches<barn::kd_metric::l2>);
+    quantized_l2_test.verbosity_level = verbosity::NORMAL;
+    quantized_l2_test.test("l2, bucket size 1", size_t(0), size_t(4000), size_t(1), barn::kd_metric::l2());
+    quantized_l2_test.test("l2, bucket size 16", size_t(0), size_t(4000), size_t(16), barn::kd_metric::l2());
+    all_passed &= quantized_l2_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, size_t, barn::kd_metric::linf> quantized_linf_test(kd_tree_quantized_mismatches<barn::kd_metric::linf>);
+    quantized_linf_test.verbosity_level = verbosity::NORMAL;
+    quantized_linf_test.test("linf, bucket size 16", size_t(0), size_t(4000), size_t(16), barn::kd_metric::linf());
+    all_passed &= quantized_linf_test.write_test_series_summary();
+
+    os << "Test kd_tree k_nearest_join" << std::endl;
+    FunctionTest<size_t, size_t, size_t, size_t> knn_join_linked_test(kd_tree_k_nearest_join_mismatches<barn::kd_layout::linked>);
+    knn_join_linked_test.verbosity_level = verbosity::NORMAL;
+    knn_join_linked_test.test("linked, empty", size_t(0), size_t(0), size_t(4), size_t(1));
+    knn_join_linked_test.test("linked, k = 1", size_t(0), size_t(3000), size_t(1), size_t(1));
+    knn_join_linked_test.test("linked, k = 8, 4 threads", size_t(0), size_t(3000), size_t(8), size_t(4));
+    all_passed &= knn_join_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, size_t, size_t> knn_join_flat_test(kd_tree_k_nearest_join_mismatches<barn::kd_layout::flat>);
+    knn_join_flat_test.verbosity_level = verbosity::NORMAL;
+    knn_join_flat_test.test("flat, empty", size_t(0), size_t(0), size_t(4), size_t(1));
+    knn_join_flat_test.test("flat, k = 1", size_t(0), size_t(3000), size_t(1), size_t(1));
+    knn_join_flat_test.test("flat, k = 8, 4 threads", size_t(0), size_t(3000), size_t(8), size_t(4));
+    knn_join_flat_test.test("flat, k > size", size_t(0), size_t(20), size_t(30), size_t(1));
+    all_passed &= knn_join_flat_test.write_test_series_summary();
+
+    os << "Test kd_tree iteration" << std::endl;
+    FunctionTest<size_t, size_t, size_t> iteration_linked_test(kd_tree_iteration_mismatches<barn::kd_layout::linked>);
+    iteration_linked_test.verbosity_level = verbosity::NORMAL;
+    iteration_linked_test.test("linked, empty", size_t(0), size_t(0), size_t(1));
+    iteration_linked_test.test("linked, 1 thread", size_t(0), size_t(4000), size_t(1));
+    iteration_linked_test.test("linked, 5 threads", size_t(0), size_t(4000), size_t(5));
+    all_passed &= iteration_linked_test.write_test_series_summary();
+
+    FunctionTest<size_t, size_t, size_t> iteration_flat_test(kd_tree_iteration_mismatches<barn::kd_layout::flat>);
+    iteration_flat_test.verbosity_level = verbosity::NORMAL;
+    iteration_flat_test.test("flat, empty", size_t(0), size_t(0), size_t(1));
+    iteration_flat_test.test("flat, 1 thread", size_t(0), size_t(4000), size_t(1));
+    iteration_flat_test.test("flat, 5 threads", size_t(0), size_t(4000), size_t(5));
+    all_passed &= iteration_flat_test.write_test_series_summary();
+
+    os << "\n";
+    if (all_passed) os << "+++ ALL TEST SERIES PASSED +++ :)))";
+    else            os << "--- SOME ERRORS OCCURED ---    :(((";
+    os << "\n\n\n";
+}